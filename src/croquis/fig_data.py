@@ -198,13 +198,16 @@ class FreeformLineData(FigData):
         self.line_width = kwargs.pop('line_width', 3)
         self.highlight_line_width = kwargs.pop('highlight_line_width', 5)
 
+        self._add_to_plotter(parent)
+
+        misc_util.check_empty(kwargs)
+
+    def _add_to_plotter(self, parent):
         parent._C.add_freeform_line_data(
             self.X, self.Y, self.start_idxs, self.colors,
             self.item_cnt, self.total_pts_cnt,
             self.marker_size, self.line_width, self.highlight_line_width)
 
-        misc_util.check_empty(kwargs)
-
     def get_pts(self, item_id):
         offset = item_id - self.start_item_id
         X = np.asarray(self.X)
@@ -214,10 +217,27 @@ class FreeformLineData(FigData):
                                               else self.total_pts_cnt
         return X[start_idx:end_idx], Y[start_idx:end_idx]
 
+# Points without lines: takes the same arguments as FreeformLineData, except
+# that `start_idxs` is optional (by default, all points belong to one item).
+class ScatterData(FreeformLineData):
+    def __init__(self, parent, X, Y, colors=None, **kwargs):
+        if ('start_idxs' not in kwargs) and ('groupby' not in kwargs):
+            kwargs['start_idxs'] = [0]
+
+        super().__init__(parent, X, Y, colors, **kwargs)
+
+    def _add_to_plotter(self, parent):
+        self.line_width = 0
+        parent._C.add_scatter_data(
+            self.X, self.Y, self.start_idxs, self.colors,
+            self.item_cnt, self.total_pts_cnt, self.marker_size)
+
 # Create a figure of the appropriate class.
 # TODO: Support other types!
 def create_fig_data(parent, *args, **kwargs):
-    if ('start_idxs' in kwargs) or ('groupby' in kwargs):
+    if kwargs.pop('scatter', False):
+        return ScatterData(parent, *args, **kwargs)
+    elif ('start_idxs' in kwargs) or ('groupby' in kwargs):
         return FreeformLineData(parent, *args, **kwargs)
     else:
         return RectangularLineData(parent, *args, **kwargs)
@@ -8,7 +8,7 @@ import threading
 import numpy as np
 
 from .lib import _csrc
-from . import axis_util, comm, display, fig_data, png_util, thr_manager
+from . import axis_util, comm, display, fig_data, thr_manager
 
 logger = logging.getLogger(__name__)
 
@@ -38,6 +38,18 @@ class Plotter(object):
             if arg is not None: self.axis_config[axis] = arg
             self.axis_config.setdefault(axis, 'linear')
 
+        # If True, show the density of lines (as a heatmap) instead of drawing
+        # each line with its own color: useful when there are too many lines.
+        self._C.set_density_mode(bool(kwargs.pop('density', False)))
+
+        # Size of each tile (in pixels): must be 128, 256, or 512.  Larger tiles
+        # mean fewer messages, but each tile takes longer to draw.
+        self._C.set_tile_size(int(kwargs.pop('tile_size', 256)))
+
+        # If True, draw dense lines faster by keeping only a few points per
+        # pixel column: the result may differ slightly from the exact drawing.
+        self._C.set_fast_lines(bool(kwargs.pop('fast_lines', False)))
+
         self.fig_data_list = []
         self.labels = []
         self.next_item_id = 0
@@ -130,13 +142,12 @@ class Plotter(object):
         msgtype = json_data.pop('msg')
 
         if msgtype == 'tile':
-            # Construct PNG file data.
+            # `data1` is the PNG file, already compressed by C++ code.
             assert data1 is not None
             is_transparent = 'item_id' in json_data
-            data1 = png_util.generate_png(data1, is_transparent)
 
-            # Add label info.
-            if is_transparent:
+            # Add label info (only if a single item is highlighted).
+            if is_transparent and 'item_end' not in json_data:
                 item_id = json_data['item_id']
                 json_data['label'] = self.labels[item_id]
                 style, = self._get_figdata(item_id).get_label_styles([item_id])
@@ -364,7 +375,11 @@ class Plotter(object):
                 retval += [int(row), int(col), int(seq_no)]
             return retval
 
-        self._C.tile_req_handler(canvas_config, item.get('id', -1),
+        # Highlight tiles for items [id, end): see Plotter::tile_req_handler().
+        item_id = item.get('id', -1)
+        item_end = item.get('end', item_id + 1) if item_id != -1 else -1
+
+        self._C.tile_req_handler(canvas_config, item_id, item_end,
                                  _flatten(item['prio']), _flatten(item['reg']))
 
     # Helper function for finding a FigData that contains the given item.
@@ -8,6 +8,7 @@
 #include <string>
 #include <utility>  // pair
 
+#include "croquis/util/cpu_features.h"
 #include "croquis/util/error_helper.h"  // throw_value_error
 #include "croquis/util/macros.h"  // DIE_MSG
 
@@ -192,6 +193,32 @@ class GenericBuffer2D {
 #endif
     }
 
+    // Same as calling get_transformed() on `cnt` consecutive elements along
+    // the second axis, starting at `ptr`: the results are stored to `out`.
+    //
+    // Uses AVX2 if the data is contiguous float or double.
+    inline void get_transformed_n(const char *ptr, int cnt, float A, float b,
+                                  float *out) const;
+
+    // Get the value as double (without losing precision for double data).
+    double get_double(const char *ptr) const {
+        switch (type) {
+            case BufferType::INT8:   return *(int8_t *) ptr;
+            case BufferType::UINT8:  return *(uint8_t *) ptr;
+            case BufferType::INT16:  return *(int16_t *) ptr;
+            case BufferType::UINT16: return *(uint16_t *) ptr;
+            case BufferType::INT32:  return *(int32_t *) ptr;
+            case BufferType::UINT32: return *(uint32_t *) ptr;
+            case BufferType::INT64:  return *(int64_t *) ptr;
+            case BufferType::UINT64: return *(uint64_t *) ptr;
+            case BufferType::FLOAT:  return *(float *) ptr;
+            case BufferType::DOUBLE: return *(double *) ptr;
+        }
+#ifdef __GNUC__
+        __builtin_unreachable();
+#endif
+    }
+
     // TODO: We don't need color_util.h any more?
     uint8_t get_color(const char *ptr) const {
         switch (type) {
@@ -262,4 +289,125 @@ class GenericBuffer2D {
     template<typename T> std::pair<T, T> minmax_helper() const;
 };
 
+// Accessor for GenericBuffer2D when the element type is known at compile time:
+// it has the same interface as GenericBuffer2D for reading coordinates, so
+// that the same template code can use either.  See dispatch_xy_types() below.
+template<typename T> class TypedBuffer2D {
+  private:
+    const char *const ptr_;
+
+  public:
+    int shape[2];
+    int strides[2];  // In bytes, same as GenericBuffer2D.
+
+    explicit TypedBuffer2D(const GenericBuffer2D &buf)
+        : ptr_(buf.get()),
+          shape{buf.shape[0], buf.shape[1]},
+          strides{buf.strides[0], buf.strides[1]} { }
+
+    const char *get(int i, int j) const
+    { return ptr_ + i * strides[0] + j * strides[1]; }
+
+    float get_transformed(const char *ptr, float A, float b) const
+    { return A * (*(const T *) ptr) + b; }
+
+    inline void get_transformed_n(const char *ptr, int cnt, float A, float b,
+                                  float *out) const;
+};
+
+template<typename T>
+void TypedBuffer2D<T>::get_transformed_n(const char *ptr, int cnt,
+                                         float A, float b, float *out) const
+{
+    for (int i = 0; i < cnt; i++)
+        out[i] = get_transformed(ptr + i * strides[1], A, b);
+}
+
+// AVX2 versions of get_transformed_n() for contiguous arrays, in
+// buffer_avx2.cc: only called if the CPU supports AVX2.
+void transform_n_avx2(const float *p, int cnt, float A, float b, float *out);
+void transform_n_avx2(const double *p, int cnt, float A, float b, float *out);
+
+template<>
+inline void TypedBuffer2D<float>::get_transformed_n(
+                const char *ptr, int cnt, float A, float b, float *out) const
+{
+#ifdef CROQUIS_ENABLE_AVX2
+    if (strides[1] == sizeof(float) &&
+        util::cpu_features.isa >= util::Isa::AVX2) {
+        transform_n_avx2((const float *) ptr, cnt, A, b, out);
+        return;
+    }
+#endif
+
+    for (int i = 0; i < cnt; i++)
+        out[i] = get_transformed(ptr + i * strides[1], A, b);
+}
+
+template<>
+inline void TypedBuffer2D<double>::get_transformed_n(
+                const char *ptr, int cnt, float A, float b, float *out) const
+{
+#ifdef CROQUIS_ENABLE_AVX2
+    if (strides[1] == sizeof(double) &&
+        util::cpu_features.isa >= util::Isa::AVX2) {
+        transform_n_avx2((const double *) ptr, cnt, A, b, out);
+        return;
+    }
+#endif
+
+    for (int i = 0; i < cnt; i++)
+        out[i] = get_transformed(ptr + i * strides[1], A, b);
+}
+
+void GenericBuffer2D::get_transformed_n(const char *ptr, int cnt,
+                                        float A, float b, float *out) const
+{
+    switch (type) {
+        case BufferType::FLOAT:
+            TypedBuffer2D<float>(*this).get_transformed_n(ptr, cnt, A, b, out);
+            return;
+        case BufferType::DOUBLE:
+            TypedBuffer2D<double>(*this).get_transformed_n(ptr, cnt, A, b, out);
+            return;
+        default:
+            for (int i = 0; i < cnt; i++)
+                out[i] = get_transformed(ptr + i * strides[1], A, b);
+    }
+}
+
+// Helper functions to resolve the element types of X and Y once, instead of
+// checking them for every data point.
+//
+// dispatch_xy_types(X, Y, fn) calls fn(X', Y'), where X' and Y' are
+// TypedBuffer2D for the common combinations (X: float/double/int64, Y:
+// float/double).  For anything else, it falls back to fn(X, Y) with the
+// original GenericBuffer2D, so that we don't instantiate too many templates.
+template<typename XT, typename F>
+inline auto dispatch_y_type(const GenericBuffer2D &X, const GenericBuffer2D &Y,
+                            F &fn) -> decltype(fn(X, Y))
+{
+    switch (Y.type) {
+        case BufferType::FLOAT:
+            return fn(TypedBuffer2D<XT>(X), TypedBuffer2D<float>(Y));
+        case BufferType::DOUBLE:
+            return fn(TypedBuffer2D<XT>(X), TypedBuffer2D<double>(Y));
+        default:
+            return fn(X, Y);
+    }
+}
+
+template<typename F>
+inline auto dispatch_xy_types(const GenericBuffer2D &X,
+                              const GenericBuffer2D &Y,
+                              F &&fn) -> decltype(fn(X, Y))
+{
+    switch (X.type) {
+        case BufferType::FLOAT: return dispatch_y_type<float>(X, Y, fn);
+        case BufferType::DOUBLE: return dispatch_y_type<double>(X, Y, fn);
+        case BufferType::INT64: return dispatch_y_type<int64_t>(X, Y, fn);
+        default: return fn(X, Y);
+    }
+}
+
 } // namespace croquis
@@ -0,0 +1,47 @@
+// AVX2 versions of TypedBuffer2D<T>::get_transformed_n(): see buffer.h.
+//
+// This file is compiled with AVX2 flags, and only called if the CPU supports
+// it (see util/cpu_features.h).
+//
+// We don't use FMA here, so that the result is identical to get_transformed():
+// otherwise, the scalar and AVX2 versions could draw slightly different images.
+
+#include "croquis/buffer.h"
+
+#include <immintrin.h>
+
+namespace croquis {
+
+void transform_n_avx2(const float *p, int cnt, float A, float b, float *out)
+{
+    const __m256 Av = _mm256_set1_ps(A);
+    const __m256 bv = _mm256_set1_ps(b);
+
+    int i = 0;
+    for (; i + 8 <= cnt; i += 8) {
+        __m256 v = _mm256_loadu_ps(p + i);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(Av, v), bv));
+    }
+
+    for (; i < cnt; i++) out[i] = A * p[i] + b;
+}
+
+// Same as get_transformed(): compute in double and then convert.
+void transform_n_avx2(const double *p, int cnt, float A, float b, float *out)
+{
+    const __m256d Av = _mm256_set1_pd(A);
+    const __m256d bv = _mm256_set1_pd(b);
+
+    int i = 0;
+    for (; i + 8 <= cnt; i += 8) {
+        __m256d v0 = _mm256_loadu_pd(p + i);
+        __m256d v1 = _mm256_loadu_pd(p + i + 4);
+        __m128 lo = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_mul_pd(Av, v0), bv));
+        __m128 hi = _mm256_cvtpd_ps(_mm256_add_pd(_mm256_mul_pd(Av, v1), bv));
+        _mm256_storeu_ps(out + i, _mm256_set_m128(hi, lo));
+    }
+
+    for (; i < cnt; i++) out[i] = A * p[i] + b;
+}
+
+}  // namespace croquis
@@ -28,15 +28,16 @@ class TileKey {
     int zoom_level;
 
     // Relative position.
-    // x offset (in pixels) = col * TILE_SIZE.
-    // y offset (in pixels) = row * TILE_SIZE.
+    // x offset (in pixels) = col * tile_size.
+    // y offset (in pixels) = row * tile_size.
     int row, col;
     int item_id;  // -1 if not a highlight tile.
+    int item_end;  // Highlight tiles contain items [item_id, item_end).
 
     TileKey(int sm_version, int config_id, int zoom_level,
-            int row, int col, int item_id)
+            int row, int col, int item_id, int item_end)
         : sm_version(sm_version), config_id(config_id), zoom_level(zoom_level),
-          row(row), col(col), item_id(item_id) { }
+          row(row), col(col), item_id(item_id), item_end(item_end) { }
 
     bool operator==(const TileKey &b) const {
         return sm_version == b.sm_version &&
@@ -44,7 +45,8 @@ class TileKey {
                zoom_level == b.zoom_level &&
                row == b.row &&
                col == b.col &&
-               item_id == b.item_id;
+               item_id == b.item_id &&
+               item_end == b.item_end;
     }
 
     // For debugging.
@@ -54,11 +56,17 @@ class TileKey {
                        "[%d]%d:%d:%d:%d",
                        sm_version, config_id, zoom_level, row, col);
         }
-        else {
+        else if (item_end == item_id + 1) {
             return util::string_printf(
                        "[%d]%d:%d:%d:%d:%d",
                        sm_version, config_id, zoom_level, row, col, item_id);
         }
+        else {
+            return util::string_printf(
+                       "[%d]%d:%d:%d:%d:%d-%d",
+                       sm_version, config_id, zoom_level, row, col,
+                       item_id, item_end);
+        }
     }
 };
 
@@ -99,6 +107,7 @@ template<> struct hash<::croquis::TileKey>
         hashval = ::croquis::util::hash_combine(hashval, key.row);
         hashval = ::croquis::util::hash_combine(hashval, key.col);
         hashval = ::croquis::util::hash_combine(hashval, key.item_id);
+        hashval = ::croquis::util::hash_combine(hashval, key.item_end);
         return hashval;
     }
 };
@@ -193,24 +202,24 @@ class CanvasConfig {
 
     // Get transformation for tile coordinates.
     //
-    // Each tile is made of 256*256 pixels (256 = TILE_SIZE = TS).  To keep the
-    // code consistent, we assume that the middle of the tile has integer
+    // Each tile is made of TS*TS pixels (TS = tile_size, e.g., 256).  To keep
+    // the code consistent, we assume that the middle of the tile has integer
     // coordinates.  E.g., tile #(0, 0) is made of coordinates [-0.5, 0.5] x
     // [0.5, 0.5], which corresponds to pixel coordinates [-0.5, 255.5] x [-0.5,
-    // 255.5].  Hence,
+    // 255.5] (for TS = 256).  Hence,
     //      tx = (px - 127.5) / 256 = (px - (TS-1)/2) / TS.
     //
     // Combining them,
     //      xscale = (Z * (w-1)) / (TS * (x1-x0)),
     //      tx = xscale * x - xscale * (x0+x1)/2 + w / (2*TS) - 1/2.
-    Transform get_tile_transform() const {
+    Transform get_tile_transform(int tile_size) const {
         Transform t;
 
         double zoom = pow(ZOOM_FACTOR, zoom_level);
-        t.xscale = (zoom / TILE_SIZE) * ((w - 1) / (x1 - x0));
-        t.xbias = -t.xscale * (x0 + x1) * 0.5 + w / (2. * TILE_SIZE) - 0.5;
-        t.yscale = (zoom / TILE_SIZE) * ((h - 1) / (y0 - y1));
-        t.ybias = -t.yscale * (y0 + y1) * 0.5 + h / (2. * TILE_SIZE) - 0.5;
+        t.xscale = (zoom / tile_size) * ((w - 1) / (x1 - x0));
+        t.xbias = -t.xscale * (x0 + x1) * 0.5 + w / (2. * tile_size) - 0.5;
+        t.yscale = (zoom / tile_size) * ((h - 1) / (y0 - y1));
+        t.ybias = -t.yscale * (y0 + y1) * 0.5 + h / (2. * tile_size) - 0.5;
 
         return t;
     }
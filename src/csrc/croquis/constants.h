@@ -4,7 +4,12 @@
 
 namespace croquis {
 
+// Default size (width and height) of a tile, in pixels.  Plotter can also use
+// MIN_TILE_SIZE, MAX_TILE_SIZE, or anything in between that is a power of two
+// (see Plotter::set_tile_size()).
 static const int TILE_SIZE = 256;
+static const int MIN_TILE_SIZE = 128;
+static const int MAX_TILE_SIZE = 512;
 
 // How much zoom we do per each step: must match croquis_fe.js.
 static const float ZOOM_FACTOR = 1.5;
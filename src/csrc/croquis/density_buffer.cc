@@ -0,0 +1,144 @@
+// A buffer for density (heatmap) tiles.
+
+#include "croquis/density_buffer.h"
+
+#include <math.h>  // log2f
+#include <stdint.h>  // uint32_t
+
+#include <immintrin.h>
+
+#include <algorithm>  // min
+
+#include "croquis/grayscale_buffer.h"
+
+namespace croquis {
+
+// The colormap goes from sparse to dense: it approximates "viridis" of
+// matplotlib, by interpolating these colors.
+static const uint32_t colormap_anchors[] = {
+    0x440154, 0x3b528b, 0x21918c, 0x5ec962, 0xfde725,
+};
+
+// Pixels not covered by any line.
+static const uint32_t background_color = 0xffffff;  // white
+
+namespace {
+struct Colormap {
+    uint32_t colors[256];
+
+    Colormap() {
+        const int n = sizeof(colormap_anchors) / sizeof(colormap_anchors[0]);
+        for (int i = 0; i < 256; i++) {
+            const float pos = i * (n - 1) / 255.f;
+            const int k = std::min((int) pos, n - 2);
+            const float t = pos - k;
+
+            uint32_t color = 0;
+            for (int shift = 0; shift < 24; shift += 8) {
+                const float c0 = (colormap_anchors[k] >> shift) & 0xff;
+                const float c1 = (colormap_anchors[k + 1] >> shift) & 0xff;
+                color |= (uint32_t) nearbyintf(c0 + (c1 - c0) * t) << shift;
+            }
+            colors[i] = color;
+        }
+    }
+
+    // Map the total coverage to a color.  We use the log scale so that a
+    // single line and a million lines are both visible: one fully covered
+    // line maps to 16, and we saturate at 65535 lines.
+    uint32_t get(uint32_t count) const {
+        if (count == 0) return background_color;
+        const float lines = count * (1.f / 255.f);
+        const int level = std::min(255, (int) (log2f(1.f + lines) * 16.f));
+        return colors[level];
+    }
+};
+}  // namespace
+
+static const Colormap colormap;
+
+// We simply add `gray_buf` to `counts`.  This isn't as heavy as
+// RgbBuffer::merge() (no blending, no hovermap), so we use SSE2 (which every
+// x86-64 CPU supports) and don't bother with other instruction sets.
+void DensityBuffer::merge(GrayscaleBuffer *gray_buf, int /* line_id */,
+                          uint32_t /* color */)
+{
+    const __m128i zeros = _mm_setzero_si128();
+
+    mark_dirty(gray_buf);
+    for (int i = 0; i < gray_buf->blk_cnt; i++) {
+        const int offset = gray_buf->blklist[i];
+        const __m128i gray = gray_buf->buf[offset];
+        gray_buf->buf[offset] = zeros;
+
+        // Widen to 32 bits and add.  (punpck[lh]bw, punpck[lh]wd, paddd)
+        const __m128i lo = _mm_unpacklo_epi8(gray, zeros);
+        const __m128i hi = _mm_unpackhi_epi8(gray, zeros);
+        __m128i *dest = (__m128i *) &counts[offset * 16];
+        dest[0] = _mm_add_epi32(dest[0], _mm_unpacklo_epi16(lo, zeros));
+        dest[1] = _mm_add_epi32(dest[1], _mm_unpackhi_epi16(lo, zeros));
+        dest[2] = _mm_add_epi32(dest[2], _mm_unpacklo_epi16(hi, zeros));
+        dest[3] = _mm_add_epi32(dest[3], _mm_unpackhi_epi16(hi, zeros));
+    }
+
+    // Clear the blocklist for `gray_buf`.
+    gray_buf->blk_cnt = 0;
+}
+
+void DensityBuffer::compose(const ColoredBufferBase &layer0)
+{
+    const DensityBuffer &layer = static_cast<const DensityBuffer &>(layer0);
+    mark_dirty(layer);
+
+    for (int i = 0; i < layer.dirty_cnt_; i++) {
+        const int offset = layer.dirty_list_[i];
+        const __m128i *src = (const __m128i *) &layer.counts[offset * 16];
+        __m128i *dest = (__m128i *) &counts[offset * 16];
+        for (int j = 0; j < 4; j++)
+            dest[j] = _mm_add_epi32(dest[j], src[j]);  // paddd
+    }
+}
+
+// Same format as RgbBuffer::make_png_data().
+std::unique_ptr<UniqueMessageData>
+DensityBuffer::make_png_data(const std::string &name) const
+{
+    const int TS = tile_size();
+    auto msg = std::make_unique<UniqueMessageData>(name, (TS * 3 + 1) * TS);
+
+    // RGB values of the previous row, for the "up" filter.
+    uint8_t prev_line[MAX_TILE_SIZE * 3];
+    memset(prev_line, 0, sizeof(prev_line));
+
+    uint8_t *dest = (uint8_t *) (msg->get());
+    for (int row = 0; row < TS; row++) {
+        *(dest++) = (row == 0) ? 0 : 2;
+
+        for (int x = 0; x < TS; x++) {
+            const uint32_t color = colormap.get(get_count(x, row));
+            const uint8_t rgb[3] = {
+                (uint8_t) (color >> 16), (uint8_t) (color >> 8),
+                (uint8_t) color,
+            };
+            for (int i = 0; i < 3; i++) {
+                *(dest++) = rgb[i] - prev_line[x * 3 + i];
+                prev_line[x * 3 + i] = rgb[i];
+            }
+        }
+    }
+
+    return msg;
+}
+
+std::unique_ptr<UniqueMessageData>
+DensityBuffer::make_hovermap_data(const std::string &name) const
+{
+    return make_empty_hovermap_data(name);
+}
+
+uint32_t DensityBuffer::get_pixel(int x, int y) const
+{
+    return colormap.get(get_count(x, y));
+}
+
+} // namespace croquis
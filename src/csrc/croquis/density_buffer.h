@@ -0,0 +1,87 @@
+// A buffer for density (heatmap) tiles.
+
+#pragma once
+
+#include <stdint.h>  // uint32_t
+#include <stdlib.h>  // free
+#include <string.h>  // memset
+
+#include <memory>  // unique_ptr
+#include <string>
+
+#include "croquis/constants.h"  // TILE_SIZE
+#include "croquis/message.h"  // UniqueMessageData
+#include "croquis/rgb_buffer.h"  // ColoredBufferBase
+#include "croquis/util/aligned_alloc.h"
+
+namespace croquis {
+
+// Used instead of RgbBuffer in density mode (see Plotter::set_density_mode()).
+//
+// When there are many overlapping lines, painting them one by one in RgbBuffer
+// gives an opaque blob where the last line wins.  Instead, DensityBuffer adds
+// up how much each pixel is covered by lines, and maps the total through a
+// colormap when creating the PNG data.  Line colors are ignored.
+//
+// Since we don't know which line is "on top", there's no hovermap: we return
+// -1 (i.e., nothing) for every pixel.
+class DensityBuffer final : public ColoredBufferBase {
+  public:
+    // Sum of the coverage of all lines merged so far (i.e., GrayscaleBuffer
+    // pixel values, where 255 means fully covered), arranged in 4x4 blocks
+    // just like GrayscaleBuffer.  We need 32 bits because 16 bits would
+    // overflow after only 257 lines.
+    //
+    // alignas(16) uint32_t counts[tile_blk_cnt() * 16];
+    uint32_t *counts = nullptr;
+
+    explicit DensityBuffer(int tile_size = TILE_SIZE)
+        : ColoredBufferBase(tile_size)
+    { alloc_blks(); }
+
+    ~DensityBuffer() { free(counts); }
+
+    // Restore the buffer to the same state as DensityBuffer(tile_size).
+    void reset(int tile_size = TILE_SIZE) {
+        if (set_tile_size(tile_size)) {
+            alloc_blks();
+            return;
+        }
+        clear_dirty([this](int i) {
+            memset(&counts[i * 16], 0x00, 16 * sizeof(counts[0]));
+        });
+    }
+
+    // `line_id` and `color` are unused.
+    void merge(GrayscaleBuffer *buf, int line_id,
+               uint32_t color /* 0xaarrggbb */) override;
+
+    // `layer` must be a DensityBuffer: we simply add the counts.
+    void compose(const ColoredBufferBase &layer) override;
+
+    std::unique_ptr<UniqueMessageData>
+    make_png_data(const std::string &name) const override;
+
+    std::unique_ptr<UniqueMessageData>
+    make_hovermap_data(const std::string &name) const override;
+
+    uint32_t get_pixel(int x, int y) const override;
+
+    // Get the coverage at the given pixel.
+    uint32_t get_count(int x, int y) const {
+        int idx1 = (y / 4) * (tile_size() / 4) + (x / 4);
+        int idx2 = (y % 4) * 4 + (x % 4);
+        return counts[idx1 * 16 + idx2];
+    }
+
+  private:
+    // (Re)allocate `counts` for the current tile size, and clear it.
+    void alloc_blks() {
+        const int n = tile_blk_cnt() * 16;
+        counts = (uint32_t *)
+            util::realloc_aligned(counts, 16, n * sizeof(uint32_t));
+        memset(counts, 0x00, n * sizeof(uint32_t));
+    }
+};
+
+} // namespace croquis
@@ -7,13 +7,19 @@
 #include <math.h>  // fmin, NAN
 #include <stdint.h>  // int64_t, INT32_MAX
 
+#include <algorithm>  // max
 #include <utility>  // pair
 
 #include "croquis/buffer.h"  // Buffer2D
 #include "croquis/canvas.h"  // CanvasConfig
+#include "croquis/constants.h"  // TILE_SIZE
+#include "croquis/grayscale_buffer.h"  // CircleSprites
 #include "croquis/intersection_finder.h"
+#include "croquis/line_pyramid.h"
+#include "croquis/spatial_index.h"
 #include "croquis/util/error_helper.h"  // throw_value_error
 #include "croquis/util/macros.h"  // DISALLOW_COPY_AND_MOVE
+#include "croquis/util/math.h"  // Divider
 
 namespace croquis {
 
@@ -40,12 +46,50 @@ struct Range2D {
 struct PlotRequest {
     const int sm_version;
     const CanvasConfig canvas;
-    const int item_id;  // -1 to draw all.
 
-    PlotRequest(int sm_version, const CanvasConfig canvas, int item_id)
-        : sm_version(sm_version), canvas(canvas), item_id(item_id) { }
+    // For highlight tiles, we draw items [item_id, item_end).  Both are -1 to
+    // draw all (i.e., regular tiles).
+    const int item_id;
+    const int item_end;
+
+    // If true, lines may be drawn using a coarser level of LinePyramid (which
+    // is not pixel-identical): set by Plotter (only if fast lines are enabled)
+    // for canvas configs created after all pyramids are built.
+    const bool use_lod;
+
+    // Width and height of each tile, in pixels: see Plotter::set_tile_size().
+    const int tile_size;
+
+    // If true, dense runs of line segments are reduced with decimate_m4()
+    // before painting: faster, but not pixel-identical.  See
+    // Plotter::set_fast_lines().
+    const bool fast_lines;
+
+    PlotRequest(int sm_version, const CanvasConfig canvas, int item_id,
+                int item_end, bool use_lod = false, int tile_size = TILE_SIZE,
+                bool fast_lines = false)
+        : sm_version(sm_version), canvas(canvas),
+          item_id(item_id), item_end(item_end), use_lod(use_lod),
+          tile_size(tile_size), fast_lines(fast_lines) { }
+
+    // Shorthand for regular tiles, or highlight tiles of a single item.
+    PlotRequest(int sm_version, const CanvasConfig canvas, int item_id,
+                bool use_lod = false, int tile_size = TILE_SIZE,
+                bool fast_lines = false)
+        : PlotRequest(sm_version, canvas, item_id,
+                      (item_id == -1) ? -1 : item_id + 1, use_lod,
+                      tile_size, fast_lines) { }
 
     bool is_highlight() const { return (item_id != -1); }
+
+    // A highlight request for multiple items (e.g., search results) only
+    // draws selected items in the range, just like regular tiles.  (If a
+    // single item is requested, we draw it even if it's not selected.)
+    bool is_group_highlight() const { return item_end - item_id > 1; }
+
+    // True if unselected items should be skipped.
+    bool uses_selection() const
+    { return !is_highlight() || is_group_highlight(); }
 };
 
 // An abstract class that holds the figure data passed by Python API.
@@ -67,15 +111,28 @@ class FigureData {
     // Return the x/y range of this data.
     virtual Range2D range() const = 0;
 
+    // Build the spatial index: called once by Plotter::add_figure_data().
+    virtual void build_index() { }
+
+    // Build the line pyramid: called once in a background task launched by
+    // Plotter::add_figure_data().
+    virtual void build_lod() { }
+
     // Return { start_atom_idx, end_atom_idx } of a given item.
     // `item_id` must be between [start_item_id, start_item_id + item_cnt).
     virtual std::pair<int64_t, int64_t> get_atom_idxs(int item_id) = 0;
 
     // Fill in the intersection information.
     // Called by Plotter::compute_intersection_task() - must be thread-safe.
+    //
+    // There are two versions, depending on the type of IntersectionResult
+    // chosen by Plotter::launch_tasks().
+    virtual void compute_intersection(
+                     const PlotRequest &req,
+                     const IntersectionResultSet<int32_t> *irs,
+                     IntersectionResult<int32_t> *result) = 0;
     virtual void compute_intersection(
                      const PlotRequest &req,
-                     const SelectionMap &sm,
                      const IntersectionResultSet<int64_t> *irs,
                      IntersectionResult<int64_t> *result) = 0;
 
@@ -83,9 +140,51 @@ class FigureData {
     // plots of preceding FigureData, if any.
     //
     // Called by Plotter::draw_tile_task() - must be thread-safe.
-    typedef IntersectionResultSet<int64_t>::Iterator IrsIter_t;
-    virtual IrsIter_t paint(ColoredBufferBase *tile, const PlotRequest &req,
-                            IrsIter_t iter, int row, int col) = 0;
+    typedef IntersectionResultSet<int32_t>::Iterator IrsIter32_t;
+    typedef IntersectionResultSet<int64_t>::Iterator IrsIter64_t;
+    virtual IrsIter32_t paint(ColoredBufferBase *tile, const PlotRequest &req,
+                              const SelectionMap &sm,
+                              IrsIter32_t iter, int row, int col) = 0;
+    virtual IrsIter64_t paint(ColoredBufferBase *tile, const PlotRequest &req,
+                              const SelectionMap &sm,
+                              IrsIter64_t iter, int row, int col) = 0;
+
+  protected:
+    // paint() draws up to this many consecutive segments of a line at once
+    // with GrayscaleBuffer::draw_polyline(), after reducing them with
+    // decimate_m4() if `req.fast_lines` is set.
+    static const int MAX_POLYLINE_SEGS = 1024;
+
+    // Spatial index over data points, filled by build_index().
+    SpatialIndex index_;
+
+    // Reduced versions of lines, filled by build_lod().
+    LinePyramid lod_;
+
+    // Return the level of `lod_` to use for the request (zero if we should
+    // use the original data).  compute_intersection() and paint() must agree
+    // on it, so it only depends on the request.  Reduced lines are close to,
+    // but not pixel-identical with, the original (see LinePyramid).
+    int get_lod_level(const PlotRequest &req) const {
+        return req.use_lod
+                   ? lod_.select_level(req.canvas.get_transform().xscale) : 0;
+    }
+
+    // Helper function to create the index query for the tiles handled by
+    // `irs`: `margin` is the distance (in tile coordinates) a line or marker
+    // can reach beyond its data point.
+    template<typename DType>
+    static SpatialIndex::Query make_index_query(
+               const CanvasConfig::Transform &tr,
+               const IntersectionResultSet<DType> *irs, float margin) {
+        // Tile #k covers tile coordinates [k - 0.5, k + 0.5].
+        margin += 0.5f;
+        return SpatialIndex::Query(
+            tr,
+            irs->col_start() - margin, irs->row_start() - margin,
+            irs->col_start() + irs->ncols() - 1 + margin,
+            irs->row_start() + irs->nrows() - 1 + margin);
+    }
 };
 
 // Lines made of a rectangular array of 2-D points.
@@ -136,11 +235,17 @@ class RectangularLineData : public FigureData {
 
     const int pts_cnt_;
 
+    // Divides by (2 * pts_cnt_): used to find the item ID from atom index.
+    const util::Divider atom_divider_;
+
     const float marker_size_;
     const float line_width_;
     // TODO: Also add highglight_marker_size_?
     const float highlight_line_width_;
 
+    // Markers, pre-drawn for paint().
+    const CircleSprites marker_sprites_;
+
   public:
     RectangularLineData(int next_item_id, int64_t next_atom_idx,
                         const py::buffer_info &X,
@@ -154,20 +259,46 @@ class RectangularLineData : public FigureData {
           X_("X", X), Y_("Y", Y),
           colors_("colors", colors, GenericBuffer2D::COLOR),
           pts_cnt_(pts_cnt),
+          atom_divider_(std::max(1, 2 * pts_cnt)),
           marker_size_(marker_size), line_width_(line_width),
-          highlight_line_width_(highlight_line_width)
+          highlight_line_width_(highlight_line_width),
+          marker_sprites_(marker_size * .5f)
     { }
 
     ~RectangularLineData() { }
 
     Range2D range() const override;
+    void build_index() override;
+    void build_lod() override;
     std::pair<int64_t, int64_t> get_atom_idxs(int item_id) override;
     void compute_intersection(const PlotRequest &req,
-                              const SelectionMap &sm,
+                              const IntersectionResultSet<int32_t> *irs,
+                              IntersectionResult<int32_t> *result) override;
+    void compute_intersection(const PlotRequest &req,
                               const IntersectionResultSet<int64_t> *irs,
                               IntersectionResult<int64_t> *result) override;
-    IrsIter_t paint(ColoredBufferBase *tile, const PlotRequest &req,
-                    IrsIter_t iter, int row, int col) override;
+    IrsIter32_t paint(ColoredBufferBase *tile, const PlotRequest &req,
+                      const SelectionMap &sm,
+                      IrsIter32_t iter, int row, int col) override;
+    IrsIter64_t paint(ColoredBufferBase *tile, const PlotRequest &req,
+                      const SelectionMap &sm,
+                      IrsIter64_t iter, int row, int col) override;
+
+  private:
+    // Actual implementation of compute_intersection() and paint(), for each
+    // combination of X/Y types (see dispatch_xy_types() in buffer.h) and
+    // IntersectionResult types.
+    template<typename XBuf, typename YBuf, typename DType>
+    void compute_intersection_impl(const XBuf &X, const YBuf &Y,
+                                   const PlotRequest &req,
+                                   const IntersectionResultSet<DType> *irs,
+                                   IntersectionResult<DType> *result);
+
+    template<typename XBuf, typename YBuf, typename IrsIter>
+    IrsIter paint_impl(const XBuf &X, const YBuf &Y,
+                       ColoredBufferBase *tile, const PlotRequest &req,
+                       const SelectionMap &sm,
+                       IrsIter iter, int row, int col);
 
     DISALLOW_COPY_AND_MOVE(RectangularLineData);
 };
@@ -191,6 +322,9 @@ class FreeformLineData : public FigureData {
     // TODO: Also add highglight_marker_size_?
     const float highlight_line_width_;
 
+    // Markers, pre-drawn for paint().
+    const CircleSprites marker_sprites_;
+
   public:
     FreeformLineData(int next_item_id, int64_t next_atom_idx,
                      const py::buffer_info &X,
@@ -206,21 +340,45 @@ class FreeformLineData : public FigureData {
           colors_("colors", colors, GenericBuffer2D::COLOR),
           total_pts_cnt_(total_pts_cnt),
           marker_size_(marker_size), line_width_(line_width),
-          highlight_line_width_(highlight_line_width)
+          highlight_line_width_(highlight_line_width),
+          marker_sprites_(marker_size * .5f)
     { }
 
     ~FreeformLineData() { }
 
     Range2D range() const override;
+    void build_index() override;
+    void build_lod() override;
     std::pair<int64_t, int64_t> get_atom_idxs(int item_id) override;
     void compute_intersection(const PlotRequest &req,
-                              const SelectionMap &sm,
+                              const IntersectionResultSet<int32_t> *irs,
+                              IntersectionResult<int32_t> *result) override;
+    void compute_intersection(const PlotRequest &req,
                               const IntersectionResultSet<int64_t> *irs,
                               IntersectionResult<int64_t> *result) override;
-    IrsIter_t paint(ColoredBufferBase *tile, const PlotRequest &req,
-                    IrsIter_t iter, int row, int col) override;
+    IrsIter32_t paint(ColoredBufferBase *tile, const PlotRequest &req,
+                      const SelectionMap &sm,
+                      IrsIter32_t iter, int row, int col) override;
+    IrsIter64_t paint(ColoredBufferBase *tile, const PlotRequest &req,
+                      const SelectionMap &sm,
+                      IrsIter64_t iter, int row, int col) override;
 
   private:
+    // Actual implementation of compute_intersection() and paint(), for each
+    // combination of X/Y types (see dispatch_xy_types() in buffer.h) and
+    // IntersectionResult types.
+    template<typename XBuf, typename YBuf, typename DType>
+    void compute_intersection_impl(const XBuf &X, const YBuf &Y,
+                                   const PlotRequest &req,
+                                   const IntersectionResultSet<DType> *irs,
+                                   IntersectionResult<DType> *result);
+
+    template<typename XBuf, typename YBuf, typename IrsIter>
+    IrsIter paint_impl(const XBuf &X, const YBuf &Y,
+                       ColoredBufferBase *tile, const PlotRequest &req,
+                       const SelectionMap &sm,
+                       IrsIter iter, int row, int col);
+
     // Helper function: return the number of points in the given item ID.
     // We naively(?) assume that each line contains at most 2G points.
     int get_pts_cnt(int rel_item_id) const {
@@ -240,7 +398,124 @@ class FreeformLineData : public FigureData {
     int64_t get_start_idx(int rel_item_id) const
     { return start_idxs_.get_intval(0, rel_item_id, total_pts_cnt_); }
 
+    // Helper function: find the item (relative to `start_item_id`) that
+    // contains the given atom, using binary search over `start_idxs_`.
+    int find_item(int64_t atom_idx) const {
+        // Point #pt belongs to the last item whose start index is <= pt.
+        // (Empty items share the start index with the following item.)
+        const int64_t pt = (atom_idx - start_atom_idx) / 2;
+        int lo = 0, hi = item_cnt;
+        while (hi - lo > 1) {
+            int mid = lo + (hi - lo) / 2;
+            if (get_start_idx(mid) <= pt) lo = mid; else hi = mid;
+        }
+        return lo;
+    }
+
     DISALLOW_COPY_AND_MOVE(FreeformLineData);
 };
 
+// Points drawn as markers only, without lines: they are grouped into items the
+// same way as FreeformLineData (i.e., item #i contains points
+// start_idxs_[i] ... start_idxs_[i + 1] - 1), but each atom is just one point,
+// so we don't waste atom IDs for line segments, and we can handle many points
+// at once in compute_intersection() and paint().
+class ScatterData : public FigureData {
+  private:
+    // `X_`, `Y_`, `start_idxs_` are actually 1-D buffers:
+    // `X_` and `Y_` must have shape (1, # of points);
+    // `start_idxs_` has shape (1, # of items).
+    const GenericBuffer2D X_;
+    const GenericBuffer2D Y_;
+    const GenericBuffer2D start_idxs_;
+    const GenericBuffer2D colors_;
+
+    const int64_t total_pts_cnt_;
+
+    const float marker_size_;
+
+    // Markers, pre-drawn for paint().
+    const CircleSprites marker_sprites_;
+
+    // Maximum number of markers transformed together in paint().
+    static const int MAX_MARKER_BATCH = 1024;
+
+  public:
+    ScatterData(int next_item_id, int64_t next_atom_idx,
+                const py::buffer_info &X,
+                const py::buffer_info &Y,
+                const py::buffer_info &start_idxs,
+                const py::buffer_info &colors,
+                int item_cnt, int64_t total_pts_cnt,
+                float marker_size)
+        : FigureData(next_item_id, item_cnt, next_atom_idx, total_pts_cnt),
+          X_("X", X), Y_("Y", Y),
+          start_idxs_("start_idxs", start_idxs, GenericBuffer2D::INTEGER_TYPE),
+          colors_("colors", colors, GenericBuffer2D::COLOR),
+          total_pts_cnt_(total_pts_cnt),
+          marker_size_(marker_size),
+          marker_sprites_(marker_size * .5f)
+    { }
+
+    ~ScatterData() { }
+
+    Range2D range() const override;
+    void build_index() override;
+    std::pair<int64_t, int64_t> get_atom_idxs(int item_id) override;
+    void compute_intersection(const PlotRequest &req,
+                              const IntersectionResultSet<int32_t> *irs,
+                              IntersectionResult<int32_t> *result) override;
+    void compute_intersection(const PlotRequest &req,
+                              const IntersectionResultSet<int64_t> *irs,
+                              IntersectionResult<int64_t> *result) override;
+    IrsIter32_t paint(ColoredBufferBase *tile, const PlotRequest &req,
+                      const SelectionMap &sm,
+                      IrsIter32_t iter, int row, int col) override;
+    IrsIter64_t paint(ColoredBufferBase *tile, const PlotRequest &req,
+                      const SelectionMap &sm,
+                      IrsIter64_t iter, int row, int col) override;
+
+  private:
+    // Actual implementation of compute_intersection() and paint(), for each
+    // combination of X/Y types (see dispatch_xy_types() in buffer.h) and
+    // IntersectionResult types.
+    template<typename XBuf, typename YBuf, typename DType>
+    void compute_intersection_impl(const XBuf &X, const YBuf &Y,
+                                   const PlotRequest &req,
+                                   const IntersectionResultSet<DType> *irs,
+                                   IntersectionResult<DType> *result);
+
+    template<typename XBuf, typename YBuf, typename IrsIter>
+    IrsIter paint_impl(const XBuf &X, const YBuf &Y,
+                       ColoredBufferBase *tile, const PlotRequest &req,
+                       const SelectionMap &sm,
+                       IrsIter iter, int row, int col);
+
+    // Helper function for accessing start_idxs_.
+    int64_t get_start_idx(int rel_item_id) const
+    { return start_idxs_.get_intval(0, rel_item_id, total_pts_cnt_); }
+
+    // Helper function: return the index of the point after the last point of
+    // the given item.
+    int64_t get_end_idx(int rel_item_id) const {
+        return (rel_item_id < item_cnt - 1) ? get_start_idx(rel_item_id + 1)
+                                            : total_pts_cnt_;
+    }
+
+    // Helper function: find the item (relative to `start_item_id`) that
+    // contains the given point, using binary search over `start_idxs_`.
+    int find_item(int64_t pt) const {
+        // Empty items share the start index with the following item, so we
+        // look for the last item whose start index is <= pt.
+        int lo = 0, hi = item_cnt;
+        while (hi - lo > 1) {
+            int mid = lo + (hi - lo) / 2;
+            if (get_start_idx(mid) <= pt) lo = mid; else hi = mid;
+        }
+        return lo;
+    }
+
+    DISALLOW_COPY_AND_MOVE(ScatterData);
+};
+
 } // namespace croquis
@@ -6,8 +6,9 @@
 #include "croquis/figure_data.h"
 
 #include <inttypes.h>  // PRId64
+#include <math.h>  // isnan
 
-#include <algorithm>  // max
+#include <algorithm>  // max, min
 #include <tuple>  // tie
 
 #include "croquis/grayscale_buffer.h"  // GrayscaleBuffer
@@ -15,6 +16,7 @@
 #include "croquis/line_algorithm.h"
 #include "croquis/rgb_buffer.h"  // ColoredBufferBase
 #include "croquis/util/logging.h"  // DBG_LOG1
+#include "croquis/util/thread_local_pool.h"
 
 #define DEBUG_FIG 0
 
@@ -30,6 +32,30 @@ Range2D FreeformLineData::range() const
     return retval;
 }
 
+void FreeformLineData::build_index()
+{
+    index_.build(total_pts_cnt_,
+                 [this](int64_t g, double *x, double *y) {
+                     *x = X_.get_double(X_.get(0, g));
+                     *y = Y_.get_double(Y_.get(0, g));
+                 },
+                 item_cnt,
+                 [this](int i) {
+                     return (i < item_cnt - 1) ? get_start_idx(i + 1)
+                                               : total_pts_cnt_;
+                 });
+}
+
+void FreeformLineData::build_lod()
+{
+    lod_.build(item_cnt,
+               [this](int i) { return get_pts_cnt(i); },
+               [this](int i, int j, double *x, double *y) {
+                   *x = X_.get_double(X_.get(0, get_start_idx(i) + j));
+                   *y = Y_.get_double(Y_.get(0, get_start_idx(i) + j));
+               });
+}
+
 std::pair<int64_t, int64_t> FreeformLineData::get_atom_idxs(int item_id)
 {
     int rel_id = item_id - start_item_id;
@@ -41,22 +67,43 @@ std::pair<int64_t, int64_t> FreeformLineData::get_atom_idxs(int item_id)
 // Runs in the thread pool.
 void FreeformLineData::compute_intersection(
          const PlotRequest &req,
-         const SelectionMap &sm,
+         const IntersectionResultSet<int32_t> *irs,
+         IntersectionResult<int32_t> *result)
+{
+    dispatch_xy_types(X_, Y_, [&](const auto &X, const auto &Y) {
+        compute_intersection_impl(X, Y, req, irs, result);
+    });
+}
+
+// Runs in the thread pool.
+void FreeformLineData::compute_intersection(
+         const PlotRequest &req,
          const IntersectionResultSet<int64_t> *irs,
          IntersectionResult<int64_t> *result)
+{
+    dispatch_xy_types(X_, Y_, [&](const auto &X, const auto &Y) {
+        compute_intersection_impl(X, Y, req, irs, result);
+    });
+}
+
+template<typename XBuf, typename YBuf, typename DType>
+void FreeformLineData::compute_intersection_impl(
+         const XBuf &X, const YBuf &Y,
+         const PlotRequest &req,
+         const IntersectionResultSet<DType> *irs,
+         IntersectionResult<DType> *result)
 {
     // Transformation from input coordinates to "tile coordinates".
-    CanvasConfig::Transform tr = req.canvas.get_tile_transform();
+    CanvasConfig::Transform tr = req.canvas.get_tile_transform(req.tile_size);
 
     float line_width = req.is_highlight() ? highlight_line_width_ : line_width_;
-    float tw = line_width / TILE_SIZE;
-    float marker_radius = marker_size_ / (2.f * TILE_SIZE);
+    float tw = line_width / req.tile_size;
+    float marker_radius = marker_size_ / (2.f * req.tile_size);
 
-    // For simplicity, assume line width and marker size is smaller than
-    // TILE_SIZE.
-    // TODO: Relax this!
-    CHECK(tw < 1.0);
-    CHECK(marker_radius < 1.0);
+    // Half line width, plus some slack for numerical error, for checking
+    // segments that stay inside a single tile.  (Lines may be wider than a
+    // tile: StraightLineVisitor handles any width.)
+    const float half_tw = tw * 0.5f + 1e-4f;
 
     const int64_t batch_start =
         std::max(start_atom_idx, result->start_id);
@@ -80,16 +127,11 @@ void FreeformLineData::compute_intersection(
     //      - If pt_idx == pts_cnt - 1, the atom is unused.
     //      - If pt_idx >= pts_cnt, it is a marker at (X[i], Y[i]) where i =
     //        (start_idx + pt_idx - pts_cnt).
-    //
-    // TODO: Use binary search?
-    int rel_item_id, start_idx, pt_idx, pts_cnt;
-    for (rel_item_id = 0; rel_item_id < start_idxs_.shape[1]; rel_item_id++) {
-        start_idx = get_start_idx(rel_item_id);
-        pt_idx = (batch_start - start_atom_idx) - 2 * start_idx;
-        pts_cnt = get_pts_cnt(rel_item_id);
-        CHECK(pt_idx >= 0);
-        if (pt_idx < 2 * pts_cnt) break;
-    }
+    int rel_item_id = find_item(batch_start);
+    int start_idx = get_start_idx(rel_item_id);
+    int pt_idx = (batch_start - start_atom_idx) - 2 * start_idx;
+    int pts_cnt = get_pts_cnt(rel_item_id);
+    CHECK(pt_idx >= 0 && pt_idx < 2 * pts_cnt);
     int64_t atom_idx = batch_start;
 
     auto do_visit = [=, &atom_idx](int x, int y) {
@@ -103,65 +145,140 @@ void FreeformLineData::compute_intersection(
         irs->row_start() + irs->nrows() - 1,
         do_visit);
 
+    // Markers may be larger than a tile: see the marker loop below.
+    const float xmin = irs->col_start() - 1.f;
+    const float xmax = irs->col_start() + irs->ncols();
+    const float ymin = irs->row_start() - 1.f;
+    const float ymax = irs->row_start() + irs->nrows();
+    auto clamp_x = [=](float x) { return std::min(std::max(x, xmin), xmax); };
+    auto clamp_y = [=](float y) { return std::min(std::max(y, ymin), ymax); };
+
+    // Used to skip blocks of points that cannot intersect any of our tiles.
+    const SpatialIndex::Query query =
+        make_index_query(tr, irs, std::max(tw, marker_radius));
+
+    // Level of `lod_` to use for line segments.
+    const int lod_level = get_lod_level(req);
+
+    // NOTE: We record all items regardless of SelectionMap, so that the result
+    // can be reused when the selection changes: unselected items are skipped
+    // by paint().
     while (true) {
-        // Find the first selected item starting from `atom_idx`.
-        // (For highlight tiles, we do not care about selected items because an
-        // item was explicitly requested.)
-        if (!req.is_highlight()) {
-            while (true) {
-                bool selected = sm.m[start_item_id + rel_item_id];
-                // DBG_LOG1(DEBUG_FIG, "item #%d selected=%s",
-                //          start_item_id + rel_item_id, selected ? "true" : "false");
-                if (selected) break;
-
-                rel_item_id++;
-                if (rel_item_id >= item_cnt) return;
-                start_idx = get_start_idx(rel_item_id);
-                pt_idx = 0;
-                pts_cnt = get_pts_cnt(rel_item_id);
-                atom_idx = start_atom_idx + 2 * start_idx;
-                if (atom_idx >= batch_end) return;
-            }
+        // Skip the whole item if it cannot intersect any of our tiles.
+        if (!index_.item_may_intersect(rel_item_id, query)) {
+            atom_idx += (2 * pts_cnt) - pt_idx;
+            if (atom_idx >= batch_end) return;
+            rel_item_id++;
+            start_idx = get_start_idx(rel_item_id);
+            pt_idx = 0;
+            pts_cnt = get_pts_cnt(rel_item_id);
+            continue;
         }
 
-        // Pointers to x, y data inside the buffer (X_ and Y_).
-        const char *xp, *yp;
-        // Values of (x, y) in tile coordinates.
-        float tx0, ty0;
+        // Index of the first point of this item, for the spatial index.
+        const int64_t pt_base = start_idx;
+
+        // Values of (x, y) in tile coordinates: we transform up to eight
+        // segments (= nine points) at a time.
+        float tx[9], ty[9];
 
         //----------------------------------------
         // Handle line segments (0 <= pt_idx < pts_cnt - 1)
 
-        if (pt_idx < pts_cnt - 1) {
-            xp = X_.get(0, start_idx + pt_idx);
-            yp = Y_.get(0, start_idx + pt_idx);
-            tx0 = X_.get_transformed(xp, tr.xscale, tr.xbias);
-            ty0 = Y_.get_transformed(yp, tr.yscale, tr.ybias);
+        // If we use a reduced line, the segment between two consecutive kept
+        // points #j and #k uses atom ID for segment #j (so that paint() can
+        // find it), and the IDs of the skipped segments are unused.
+        std::pair<const int32_t *, const int32_t *> kept(nullptr, nullptr);
+        if (lod_level > 0 && pt_idx < pts_cnt - 1)
+            kept = lod_.get(lod_level, rel_item_id);
+
+        if (kept.first != kept.second) {
+            const int64_t atom_base = atom_idx - pt_idx;
+
+            // Skip segments that end to the left of our tiles: x coordinates
+            // are non-decreasing, so we can use binary search.
+            const int32_t *p =
+                std::lower_bound(kept.first, kept.second, pt_idx);
+            const int32_t *hi = kept.second - 1;
+            while (p < hi) {
+                const int32_t *mid = p + (hi - p) / 2;
+                const float x = X.get_transformed(X.get(0, start_idx + mid[1]),
+                                                  tr.xscale, tr.xbias);
+                if (x < query.xmin) p = mid + 1; else hi = mid;
+            }
+
+            float x0 = X.get_transformed(X.get(0, start_idx + p[0]),
+                                         tr.xscale, tr.xbias);
+            float y0 = Y.get_transformed(Y.get(0, start_idx + p[0]),
+                                         tr.yscale, tr.ybias);
+            for (; p + 1 < kept.second && x0 <= query.xmax; p++) {
+                atom_idx = atom_base + p[0];
+                if (atom_idx >= batch_end) return;
+
+                const float x1 = X.get_transformed(X.get(0, start_idx + p[1]),
+                                                   tr.xscale, tr.xbias);
+                const float y1 = Y.get_transformed(Y.get(0, start_idx + p[1]),
+                                                   tr.yscale, tr.ybias);
+                visitor.visit(x0, y0, x1, y1, tw);
+                x0 = x1;
+                y0 = y1;
+            }
+
+            atom_idx = atom_base + pts_cnt - 1;
+            if (atom_idx >= batch_end) return;
+            pt_idx = pts_cnt - 1;
         }
 
+        // True if we need to consult the spatial index.
+        bool check_index = true;
+
         while (pt_idx < pts_cnt - 1) {
-            // Read the next point.
-            const char *xp_next = xp + X_.strides[1];
-            const char *yp_next = yp + Y_.strides[1];
-            float tx1 = X_.get_transformed(xp_next, tr.xscale, tr.xbias);
-            float ty1 = Y_.get_transformed(yp_next, tr.yscale, tr.ybias);
-
-#if 0
-            printf("batch_start = %ld atom_idx = %ld rel_item_id = %d pt_idx = %d\n",
-                   batch_start, atom_idx, rel_item_id, pt_idx);
-            printf("  x0 y0 x1 y1 = %.3f %.3f %.3f %.3f\n",
-                   *xp, *yp, *xp_next, *yp_next);
-#endif
-
-            visitor.visit(tx0, ty0, tx1, ty1, tw);
-
-            xp = xp_next;
-            yp = yp_next;
-            tx0 = tx1;
-            ty0 = ty1;
+            // At each block boundary, skip blocks that cannot intersect.
+            if (check_index ||
+                ((pt_base + pt_idx) & SpatialIndex::BLK_MASK) == 0) {
+                const int64_t g = pt_base + pt_idx;
+                const int64_t skip =
+                    index_.next_candidate(g, pt_base + pts_cnt - 1, query) - g;
+                atom_idx += skip;
+                pt_idx += skip;
+                if (atom_idx >= batch_end) return;
+                if (pt_idx == pts_cnt - 1) break;
+                check_index = false;
+            }
 
-            if (++atom_idx >= batch_end) return;
-            pt_idx++;
+            // Handle segments until the next block boundary (or the end of the
+            // line or the batch), up to eight at a time.
+            const int cnt = std::min<int64_t>({
+                8,
+                SpatialIndex::BLK_MASK + 1 -
+                    ((pt_base + pt_idx) & SpatialIndex::BLK_MASK),
+                pts_cnt - 1 - pt_idx,
+                batch_end - atom_idx,
+            });
+
+            X.get_transformed_n(X.get(0, start_idx + pt_idx), cnt + 1,
+                                tr.xscale, tr.xbias, tx);
+            Y.get_transformed_n(Y.get(0, start_idx + pt_idx), cnt + 1,
+                                tr.yscale, tr.ybias, ty);
+
+            // Segments that stay inside a single tile (which is the common
+            // case unless we're zoomed in) don't need the visitor.
+            int tile_x[8], tile_y[8];
+            const int single_tile =
+                (cnt == 8) ? find_single_pixel_segments(tx, ty, half_tw,
+                                                        tile_x, tile_y)
+                           : 0;
+
+            for (int i = 0; i < cnt; i++) {
+                if (single_tile & (1 << i))
+                    do_visit(tile_x[i], tile_y[i]);
+                else
+                    visitor.visit(tx[i], ty[i], tx[i + 1], ty[i + 1], tw);
+                atom_idx++;
+            }
+
+            if (atom_idx >= batch_end) return;
+            pt_idx += cnt;
         }
 
         // This ID is unused.
@@ -173,27 +290,57 @@ void FreeformLineData::compute_intersection(
         //----------------------------------------
         // Handle markers (pts_cnt <= pt_idx < pts_cnt * 2).
 
-        xp = X_.get(0, start_idx + pt_idx - pts_cnt);
-        yp = Y_.get(0, start_idx + pt_idx - pts_cnt);
+        check_index = true;
 
         while (pt_idx < pts_cnt * 2) {
-            float tx = X_.get_transformed(xp, tr.xscale, tr.xbias);
-            float ty = Y_.get_transformed(yp, tr.yscale, tr.ybias);
-
-            int txi0 = nearbyintf(tx - marker_radius);
-            int txi1 = nearbyintf(tx + marker_radius);
-            int tyi0 = nearbyintf(ty - marker_radius);
-            int tyi1 = nearbyintf(ty + marker_radius);
+            if (check_index ||
+                ((pt_base + pt_idx - pts_cnt) & SpatialIndex::BLK_MASK) == 0) {
+                const int64_t g = pt_base + (pt_idx - pts_cnt);
+                const int64_t skip =
+                    index_.next_candidate(g, pt_base + pts_cnt, query) - g;
+                atom_idx += skip;
+                pt_idx += skip;
+                if (atom_idx >= batch_end) return;
+                if (pt_idx == pts_cnt * 2) break;
+                check_index = false;
+            }
 
-            do_visit(txi0, tyi0);
-            do_visit(txi0, tyi1);
-            do_visit(txi1, tyi0);
-            do_visit(txi1, tyi1);
+            const int cnt = std::min<int64_t>({
+                8,
+                SpatialIndex::BLK_MASK + 1 -
+                    ((pt_base + pt_idx - pts_cnt) & SpatialIndex::BLK_MASK),
+                pts_cnt * 2 - pt_idx,
+                batch_end - atom_idx,
+            });
+
+            X.get_transformed_n(X.get(0, start_idx + pt_idx - pts_cnt), cnt,
+                                tr.xscale, tr.xbias, tx);
+            Y.get_transformed_n(Y.get(0, start_idx + pt_idx - pts_cnt), cnt,
+                                tr.yscale, tr.ybias, ty);
+
+            for (int i = 0; i < cnt; i++) {
+                if (isnan(tx[i]) || isnan(ty[i])) {
+                    atom_idx++;
+                    continue;
+                }
+
+                // Visit every tile the marker overlaps: usually up to four,
+                // but a marker may be larger than a tile.  Coordinates are
+                // clamped to just outside `irs`, so that we don't loop over
+                // (or overflow on) far-away tiles.
+                const int txi0 = nearbyintf(clamp_x(tx[i] - marker_radius));
+                const int txi1 = nearbyintf(clamp_x(tx[i] + marker_radius));
+                const int tyi0 = nearbyintf(clamp_y(ty[i] - marker_radius));
+                const int tyi1 = nearbyintf(clamp_y(ty[i] + marker_radius));
+
+                for (int y = tyi0; y <= tyi1; y++) {
+                    for (int x = txi0; x <= txi1; x++) do_visit(x, y);
+                }
+                atom_idx++;
+            }
 
-            if (++atom_idx >= batch_end) return;
-            pt_idx++;
-            xp += X_.strides[1];
-            yp += Y_.strides[1];
+            if (atom_idx >= batch_end) return;
+            pt_idx += cnt;
         }
 
         CHECK(pt_idx == pts_cnt * 2);
@@ -205,9 +352,33 @@ void FreeformLineData::compute_intersection(
 }
 
 // Runs in the thread pool.
-FreeformLineData::IrsIter_t
+FreeformLineData::IrsIter32_t
 FreeformLineData::paint(ColoredBufferBase *tile, const PlotRequest &req,
-                        IrsIter_t iter, int row, int col)
+                        const SelectionMap &sm,
+                        IrsIter32_t iter, int row, int col)
+{
+    return dispatch_xy_types(X_, Y_, [&](const auto &X, const auto &Y) {
+        return paint_impl(X, Y, tile, req, sm, iter, row, col);
+    });
+}
+
+// Runs in the thread pool.
+FreeformLineData::IrsIter64_t
+FreeformLineData::paint(ColoredBufferBase *tile, const PlotRequest &req,
+                        const SelectionMap &sm,
+                        IrsIter64_t iter, int row, int col)
+{
+    return dispatch_xy_types(X_, Y_, [&](const auto &X, const auto &Y) {
+        return paint_impl(X, Y, tile, req, sm, iter, row, col);
+    });
+}
+
+template<typename XBuf, typename YBuf, typename IrsIter>
+IrsIter
+FreeformLineData::paint_impl(const XBuf &X, const YBuf &Y,
+                             ColoredBufferBase *tile, const PlotRequest &req,
+                             const SelectionMap &sm,
+                             IrsIter iter, int row, int col)
 {
     if (!iter.has_next()) return iter;
 
@@ -216,10 +387,17 @@ FreeformLineData::paint(ColoredBufferBase *tile, const PlotRequest &req,
 
     // Transformation from input to pixel coordinates.
     CanvasConfig::Transform tr = req.canvas.get_transform();
-    tr.xbias -= col * TILE_SIZE;
-    tr.ybias -= row * TILE_SIZE;
+    tr.xbias -= col * req.tile_size;
+    tr.ybias -= row * req.tile_size;
 
-    auto gray_buf = std::make_unique<GrayscaleBuffer>();
+    auto gray_buf =
+        util::ThreadLocalPool<GrayscaleBuffer>::acquire(req.tile_size);
+
+    // Transformed coordinates of the segments being drawn.
+    float tx[MAX_POLYLINE_SEGS + 1], ty[MAX_POLYLINE_SEGS + 1];
+
+    // Level of `lod_` to use: must match compute_intersection().
+    const int lod_level = get_lod_level(req);
 
     // Remember `item_id` of the previous atom so that we can reuse `gray_buf`
     // for parts of the same line.
@@ -229,31 +407,45 @@ FreeformLineData::paint(ColoredBufferBase *tile, const PlotRequest &req,
 
     // Find the starting item ID: see the comments at compute_intersection().
     int64_t atom_idx = iter.peek();
-    int rel_item_id, start_idx, pt_idx, pts_cnt;
-    for (rel_item_id = 0; rel_item_id < start_idxs_.shape[1]; rel_item_id++) {
-        start_idx = get_start_idx(rel_item_id);
-        pt_idx = (atom_idx - start_atom_idx) - 2 * start_idx;
-        pts_cnt = get_pts_cnt(rel_item_id);
-        CHECK(pt_idx >= 0);
-        if (pt_idx < 2 * pts_cnt) break;
-    }
+    int rel_item_id = find_item(atom_idx);
+    int start_idx = get_start_idx(rel_item_id);
+    int pts_cnt = get_pts_cnt(rel_item_id);
+    int pt_idx;
 
     while (true) {
         if (!iter.has_next() || iter.peek() >= start_atom_idx + atom_cnt) break;
         atom_idx = iter.get_next();
 
-        // Keep `rel_item_id` and others in sync with `atom_idx`.
-        while (true) {
-            pt_idx = (atom_idx - start_atom_idx) - 2 * start_idx;
-            if (pt_idx < 2 * pts_cnt) break;
-
+        // Keep `rel_item_id` and others in sync with `atom_idx`: try the next
+        // item first, and use binary search if we skipped further.
+        pt_idx = (atom_idx - start_atom_idx) - 2 * start_idx;
+        if (pt_idx >= 2 * pts_cnt) {
             rel_item_id++;
             CHECK(rel_item_id < item_cnt);  // Sanity check.
             start_idx = get_start_idx(rel_item_id);
             pts_cnt = get_pts_cnt(rel_item_id);
+            pt_idx = (atom_idx - start_atom_idx) - 2 * start_idx;
+
+            if (pt_idx >= 2 * pts_cnt) {
+                rel_item_id = find_item(atom_idx);
+                start_idx = get_start_idx(rel_item_id);
+                pts_cnt = get_pts_cnt(rel_item_id);
+                pt_idx = (atom_idx - start_atom_idx) - 2 * start_idx;
+            }
+            CHECK(pt_idx >= 0 && pt_idx < 2 * pts_cnt);  // Sanity check.
         }
 
-        if (prev_id != -1 && prev_id != rel_item_id) {
+        // Skip unselected items.  (For single-item highlight tiles, we do not
+        // care about selected items because the item was explicitly
+        // requested.)
+        if (req.uses_selection() && !sm.m[start_item_id + rel_item_id])
+            continue;
+
+        // For highlight tiles, `line_id` is unused, so we can draw all items of
+        // the same color together and merge them once.
+        if (prev_id != -1 && prev_id != rel_item_id &&
+            !(req.is_highlight() &&
+              colors_.get_argb(rel_item_id) == colors_.get_argb(prev_id))) {
             CHECK(prev_id < rel_item_id);
             uint32_t color = colors_.get_argb(prev_id);
             // DBG_LOG1(DEBUG_FIG, "(%d %d) tile merge: %08x\n", row, col, color);
@@ -261,41 +453,63 @@ FreeformLineData::paint(ColoredBufferBase *tile, const PlotRequest &req,
         }
         prev_id = rel_item_id;
 
-        if (pt_idx < pts_cnt - 1) {
-            // Draw a line.
-            const char *xp0 = X_.get(0, start_idx + pt_idx);
-            const char *yp0 = Y_.get(0, start_idx + pt_idx);
-            const char *xp1 = xp0 + X_.strides[1];
-            const char *yp1 = yp0 + Y_.strides[1];
-
-            const float x0 = X_.get_transformed(xp0, tr.xscale, tr.xbias);
-            const float y0 = Y_.get_transformed(yp0, tr.yscale, tr.ybias);
-            const float x1 = X_.get_transformed(xp1, tr.xscale, tr.xbias);
-            const float y1 = Y_.get_transformed(yp1, tr.yscale, tr.ybias);
-
-#if 0
-            if (fabs(x0) > 1e6 || fabs(y0) > 1e6 ||
-                fabs(x1) > 1e6 || fabs(y1) > 1e6) {
-                DBG_LOG1(DEBUG_FIG,
-                    "(%d, %d) Drawing line [#%zu]: "
-                    "data coord: (%.2f, %.2f)--(%.2f, %.2f) "
-                    "pixel coord: (%.2f, %.2f)--(%.2f, %.2f) line_width=%.2f",
-                    row, col, atom_idx, *xp0, *yp0, *xp1, *yp1,
-                    x0, y0, x1, y1, line_width);
+        std::pair<const int32_t *, const int32_t *> kept(nullptr, nullptr);
+        if (lod_level > 0 && pt_idx < pts_cnt - 1)
+            kept = lod_.get(lod_level, rel_item_id);
+
+        if (kept.first != kept.second) {
+            // Draw the reduced line: this atom is the segment from kept point
+            // #pt_idx to the next kept point (see compute_intersection()).
+            const int64_t atom_base = atom_idx - pt_idx;
+            const int32_t *p =
+                std::lower_bound(kept.first, kept.second, pt_idx);
+            CHECK(*p == pt_idx && p + 1 < kept.second);
+
+            int cnt = 1;
+            while (cnt < MAX_POLYLINE_SEGS && p + cnt + 1 < kept.second &&
+                   iter.has_next() && iter.peek() == atom_base + p[cnt]) {
+                iter.get_next();
+                cnt++;
+            }
+
+            for (int i = 0; i <= cnt; i++) {
+                tx[i] = X.get_transformed(X.get(0, start_idx + p[i]),
+                                          tr.xscale, tr.xbias);
+                ty[i] = Y.get_transformed(Y.get(0, start_idx + p[i]),
+                                          tr.yscale, tr.ybias);
+            }
+            const int draw_cnt =
+                req.fast_lines ? decimate_m4(tx, ty, cnt + 1) : cnt + 1;
+            gray_buf->draw_polyline(tx, ty, draw_cnt, line_width);
+        }
+        else if (pt_idx < pts_cnt - 1) {
+            // Draw lines: consecutive segments of the same line are drawn
+            // together, so that each point is transformed only once, and
+            // segments inside the same pixel column can be merged.
+            int cnt = 1;
+            while (cnt < MAX_POLYLINE_SEGS && pt_idx + cnt < pts_cnt - 1 &&
+                   iter.has_next() && iter.peek() == atom_idx + cnt) {
+                iter.get_next();
+                cnt++;
             }
-#endif
 
-            gray_buf->draw_line(x0, y0, x1, y1, line_width);
+            X.get_transformed_n(X.get(0, start_idx + pt_idx), cnt + 1,
+                                tr.xscale, tr.xbias, tx);
+            Y.get_transformed_n(Y.get(0, start_idx + pt_idx), cnt + 1,
+                                tr.yscale, tr.ybias, ty);
+            const int draw_cnt =
+                req.fast_lines ? decimate_m4(tx, ty, cnt + 1) : cnt + 1;
+            gray_buf->draw_polyline(tx, ty, draw_cnt, line_width);
         }
         else if (pt_idx >= pts_cnt) {
             // Draw a marker.
-            const char *xp0 = X_.get(0, start_idx + pt_idx - pts_cnt);
-            const char *yp0 = Y_.get(0, start_idx + pt_idx - pts_cnt);
+            const char *xp0 = X.get(0, start_idx + pt_idx - pts_cnt);
+            const char *yp0 = Y.get(0, start_idx + pt_idx - pts_cnt);
 
-            const float x0 = X_.get_transformed(xp0, tr.xscale, tr.xbias);
-            const float y0 = Y_.get_transformed(yp0, tr.yscale, tr.ybias);
+            const float x0 = X.get_transformed(xp0, tr.xscale, tr.xbias);
+            const float y0 = Y.get_transformed(yp0, tr.yscale, tr.ybias);
 
-            gray_buf->draw_circle(x0, y0, marker_size_ * .5f);
+            gray_buf->draw_circle(x0, y0, marker_sprites_);
         }
     }
 
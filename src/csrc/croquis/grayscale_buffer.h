@@ -3,44 +3,134 @@
 #pragma once
 
 #include <stdint.h>  // uint64_t
+#include <stdlib.h>  // free
 #include <string.h>  // memset
 
 #include <immintrin.h>  // __m128i
 
+#include <vector>
+
+#include "croquis/constants.h"  // TILE_SIZE
+#include "croquis/util/aligned_alloc.h"
+#include "croquis/util/macros.h"  // DISALLOW_COPY_AND_MOVE
+
 namespace croquis {
 
+// Defined in grayscale_buffer_impl.h.
+struct CircleSetup;
+struct LineSetup;
+
+class CircleSprites;
+
 class GrayscaleBuffer {
   public:
-    // Each BitmapBuffer contains 256x256 pixels, and each block is 4x4.
-    enum { BLK_CNT = 4096 };  // = (256 * 256) / (4 * 4)
+    // Each GrayscaleBuffer contains (tile_size x tile_size) pixels, and each
+    // block is 4x4.  Blocks are stored row by row, so that the block at
+    // (x, y) is at index (y / 4) * (tile_size / 4) + (x / 4).
+    //
+    // Arrays are sized for the current tile, and reallocated by reset() if
+    // the tile size changes.
 
     // Comprised of 16-byte blocks, where each block is a 4x4 area.
-    alignas(16) __m128i buf[BLK_CNT];
+    __m128i *buf = nullptr;  // alignas(16) __m128i buf[tile_blk_cnt()];
 
     // List of blocks that are changed so far: we have 2 extra entries, because
     // store_blks() may write up to 2 entries past the end.
-    uint16_t blklist[BLK_CNT + 2];
+    uint16_t *blklist = nullptr;  // uint16_t blklist[tile_blk_cnt() + 2];
     int blk_cnt = 0;  // Number of blocks stored in `blklist`.
 
-    GrayscaleBuffer() { memset(buf, 0x00, BLK_CNT * sizeof(__m128i)); }
+    explicit GrayscaleBuffer(int tile_size = TILE_SIZE)
+        : tile_size_(tile_size)
+    { alloc_blks(); }
+
+    ~GrayscaleBuffer() {
+        free(buf);
+        free(blklist);
+    }
+
+    DISALLOW_COPY_AND_MOVE(GrayscaleBuffer);
+
+    // Restore the buffer to the same state as GrayscaleBuffer(tile_size).
+    void reset(int tile_size = TILE_SIZE) {
+        if (tile_size != tile_size_) {
+            tile_size_ = tile_size;
+            blk_cnt = 0;
+            alloc_blks();
+            return;
+        }
 
-    void reset() {
         for (int i = 0; i < blk_cnt; i++)
             _mm_store_si128(&buf[blklist[i]], _mm_setzero_si128());
         blk_cnt = 0;
     }
 
-  private:
-    // Helper function.
-    inline void store_blk(int offset, __m128i blks);
+    int tile_size() const { return tile_size_; }
 
-  public:
+    // Number of 4x4 blocks in the tile.
+    int tile_blk_cnt() const { return (tile_size_ * tile_size_) / 16; }
+
+    // Call the implementation for the best instruction set available on this
+    // CPU.
     void draw_line(float x0, float y0, float x1, float y1, float width);
     void draw_circle(float x0, float y0, float radius);
 
+    // Same as draw_circle(x0, y0, sprites.radius()), except that the center is
+    // rounded to 1/8 pixel, and the circle is copied from `sprites` instead of
+    // being computed.  (If `sprites` is empty, it's exactly the same.)
+    void draw_circle(float x0, float y0, const CircleSprites &sprites);
+
+    // Draw a line connecting points (xs[i], ys[i]) for 0 <= i < n: same as
+    // calling draw_line() for each segment, but faster when we have many short
+    // segments, because we skip segments outside the buffer before doing any
+    // setup.
+    void draw_polyline(const float *xs, const float *ys, int n, float width);
+
+  private:
+    int tile_size_;
+
+    // (Re)allocate the arrays for the current tile size, and clear `buf`.
+    void alloc_blks() {
+        const int n = tile_blk_cnt();
+        buf = (__m128i *) util::realloc_aligned(buf, 16, n * sizeof(__m128i));
+        blklist = (uint16_t *)
+            util::realloc_aligned(blklist, 16, (n + 2) * sizeof(uint16_t));
+        memset(buf, 0x00, n * sizeof(__m128i));
+    }
+
+    // Implementations for each instruction set (see util/cpu_features.h), in
+    // grayscale_buffer_{scalar,sse4,avx2,avx512}.cc.  They all give the same
+    // result.
+    //
+    // They are instantiated for each supported tile size, so that the block
+    // layout is known at compile time.
+    template<int TileSize> void draw_line_scalar(const LineSetup &s);
+    template<int TileSize> void draw_line_sse4(const LineSetup &s);
+    template<int TileSize> void draw_line_avx2(const LineSetup &s);
+    template<int TileSize> void draw_line_avx512(const LineSetup &s);
+    template<int TileSize>
+    void draw_circle_scalar(float x0, float y0, const CircleSetup &s);
+    template<int TileSize>
+    void draw_circle_sse4(float x0, float y0, const CircleSetup &s);
+    template<int TileSize>
+    void draw_circle_avx2(float x0, float y0, const CircleSetup &s);
+    template<int TileSize>
+    void draw_circle_avx512(float x0, float y0, const CircleSetup &s);
+
+    // Choose the implementation for the best instruction set available on
+    // this CPU and the current tile size.
+    typedef void (GrayscaleBuffer::*LineImpl)(const LineSetup &s);
+    typedef void (GrayscaleBuffer::*CircleImpl)(float x0, float y0,
+                                                const CircleSetup &s);
+    template<int TileSize> static LineImpl line_impl_for();
+    template<int TileSize> static CircleImpl circle_impl_for();
+    LineImpl line_impl() const;
+    CircleImpl circle_impl() const;
+
+  public:
+
     // Helper function to get a pixel for testing.
     inline uint8_t get_pixel(int x, int y) const {
-        int idx1 = (y / 4) * 64 + (x / 4);
+        int idx1 = (y / 4) * (tile_size_ / 4) + (x / 4);
         int idx2 = (y % 4) * 4 + (x % 4);
 
         // I think this *should* be `char` to work around the "strict aliasing"
@@ -49,4 +139,41 @@ class GrayscaleBuffer {
     }
 };
 
+// Pre-drawn circles of a given radius, at every position inside a 4x4 block in
+// steps of 1/8 pixel, so that we can draw many markers of the same size
+// quickly (see GrayscaleBuffer::draw_circle()).
+//
+// We keep only non-empty blocks of each circle.  If the radius is larger than
+// MAX_RADIUS, we don't keep anything and simply call draw_circle() instead.
+class CircleSprites {
+  public:
+    static const int SUBPIXEL = 8;  // Centers are rounded to 1/8 pixel.
+    static const int POS_CNT = 4 * SUBPIXEL;  // Positions per block side.
+    static constexpr float MAX_RADIUS = 4.f;
+
+  private:
+    const float radius_;
+
+    // A 4x4 block, and its position relative to the block containing the
+    // center.
+    struct Blk {
+        __m128i pixels;
+        int8_t x, y;
+    };
+
+    // Blocks of the circle centered at (x / SUBPIXEL, y / SUBPIXEL) are
+    // blks_[starts_[k]] ... blks_[starts_[k + 1] - 1], where
+    // k = y * POS_CNT + x.
+    std::vector<Blk> blks_;
+    std::vector<int> starts_;
+
+  public:
+    explicit CircleSprites(float radius);
+
+    float radius() const { return radius_; }
+    bool empty() const { return starts_.empty(); }
+
+    friend class GrayscaleBuffer;
+};
+
 } // namespace croquis
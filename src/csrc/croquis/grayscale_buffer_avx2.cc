@@ -0,0 +1,334 @@
+// AVX2 version of GrayscaleBuffer::draw_line() and draw_circle().  Versions for
+// other instruction sets (grayscale_buffer_{scalar,sse4,avx512}.cc) follow the
+// same algorithm, so the detailed comments are here.
+//
+// This file is compiled with AVX2 flags, and only called if the CPU supports
+// it (see util/cpu_features.h).
+
+#include "croquis/grayscale_buffer.h"
+
+#include <stdint.h>  // uint32_t
+#include <stdio.h>  // printf (for debugging)
+
+#include <immintrin.h>
+
+#include "croquis/grayscale_buffer_impl.h"
+#include "croquis/util/avx_util.h"
+
+// #define DEBUG_BITMAP
+
+namespace croquis {
+
+namespace {
+struct ColorBlock {
+    __m256i blk0, blk1;
+};
+}  // namespace
+
+// Helper function to compute the "color" of 8x4 pixels from the given eight
+// "relative" y coordinates, which can represent either the lower or the higher
+// boundary line.
+//
+// A pixel is painted white (0xff) if it's entirely above the line, black (0x00)
+// if it's entirely below the line, and the proportion of the area *above* the
+// line, if the line passes through the pixel.  (We assume that y value is
+// shifted by 0.5 - equivalently, pixel #0 spans y value of [0.0, 1.0].)
+//
+// For example, if y value is 1.6, then the returned pixels for that column is:
+// [0x00 0x66 0xff 0xff] (where 0x66 = 102 = 0.4 * 255).
+//
+// For efficiency(?), we actually compute *two* blocks, 8x4 each, so that we
+// compute a whole 8x8 area per one function call.
+//
+// NOTE: This algorithm is an approximation.  Computing the exact color (i.e.,
+// the exact area under the given line) requires computing a quadratic formula
+// (because it can be a triangle), and a line can actually pass through multiple
+// pixels with the same x value.
+static inline ColorBlock compute_color(__m256 yrel)
+{
+    const __m256i all_ones = _mm256_set1_epi8(0xff);
+    ColorBlock retval;
+
+    __m256 yfloor = _mm256_floor_ps(yrel);  // vroundps
+    __m256i yint = _mm256_cvtps_epi32(yfloor);  // vcvtps2dq
+    __m256 yfrac = _mm256_sub_ps(yrel, yfloor);  // vsubps
+
+    // Here, `color` is [0, 255], and signifies the proportion of area *under*
+    // the line in the pixel that the line passes through.
+    __m256i color = _mm256_cvtps_epi32(  // vcvtps2dq
+        _mm256_mul_ps(yfrac, _mm256_set1_ps(255.f)));  // vmulps
+
+    // Flip bits: color (0, 1, ..., 255) becomes (-1, -2, ..., -256).
+    color = _mm256_andnot_si256(color, all_ones);  // vpandn
+
+    // Shift each entry in `color` by k bytes, where k is the value of
+    // `yint`.
+    //
+    // NOTE: vpsllvd conveniently zeros out all bits if coordinate is not
+    //       between [0, 32).
+    __m256i shift0 = _mm256_slli_epi32(yint, 3);  // vpslld: multiply by 8.
+    __m256i color0 = _mm256_sllv_epi32(color, shift0);  // vpsllvd
+
+    // If yint is negative, then the line is below the lowest pixel: fill
+    // the pixels with 0xff.
+    __m256i is_neg0 =
+        _mm256_cmpgt_epi32(_mm256_setzero_si256(), yint);  // vpcmpgtd
+    retval.blk0 = _mm256_or_si256(color0, is_neg0);  // vpor
+
+    // Same for the higher block (y is higher by 4).
+    __m256i shift1 = _mm256_sub_epi32(shift0, _mm256_set1_epi32(32));
+    __m256i color1 = _mm256_sllv_epi32(color, shift1);  // vpsllvd
+    __m256i is_neg1 =
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(4), yint);  // vpcmpgtd
+    retval.blk1 = _mm256_or_si256(color1, is_neg1);  // vpor
+
+    return retval;
+}
+
+template<int TileSize>
+void GrayscaleBuffer::draw_line_avx2(const LineSetup &s)
+{
+    const int shuffle_type = s.shuffle_type;
+    const float slope = s.slope;
+    const int umin = s.umin;
+    const int umax = s.umax;
+    const int vmin = s.vmin;
+    const int vmax = s.vmax;
+    int ublk = s.ublk;
+    int vblk = s.vblk;
+
+    // In each successive eight columns:
+    //      vL + 0.5 = (leftmost u * slope) + vL_disps
+    //      vH + 0.5 = (leftmost u * slope) + vH_disps
+    const __m256 steps = _mm256_set_ps(7.f, 6.f, 5.f, 4.f, 3.f, 2.f, 1.f, 0.f);
+    const __m256 vL_disps = _mm256_fmadd_ps(  // vfmadd...ps
+        steps, _mm256_set1_ps(slope), _mm256_set1_ps(s.vL0));
+    const __m256 vH_disps = _mm256_fmadd_ps(  // vfmadd...ps
+        steps, _mm256_set1_ps(slope), _mm256_set1_ps(s.vH0));
+
+    // Used to compute bitmasks for allowed u & v ranges (umin--umax,
+    // vmin--vmax).
+    __m256i uthreshold = _mm256_set1_epi32(umax - umin - 0x80000000U + 1);
+    __m256i vthreshold = _mm256_set1_epi32(vmax - vmin - 0x80000000U + 1);
+
+    int down_cnt = 0;
+
+#ifdef DEBUG_BITMAP
+    printf("  ublk = %d vblk = %d\n", ublk, vblk);
+#endif
+
+    while (true) {
+        const __m256i zeros = _mm256_setzero_si256();
+        const __m256i all_ones = _mm256_set1_epi8(0xff);
+        const __m256i isteps = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+        // Compute displacement relative to (ublk * 8, vblk * 8).
+        const float vrel = get_vrel(ublk, vblk, slope);
+        const __m256 vL_rel =
+            _mm256_add_ps(_mm256_set1_ps(vrel), vL_disps);  // vaddps
+        const __m256 vH_rel =
+            _mm256_add_ps(_mm256_set1_ps(vrel), vH_disps);  // vaddps
+
+        ColorBlock colorL = compute_color(vL_rel);
+        ColorBlock colorH = compute_color(vH_rel);
+
+        // Subtract the "colors" so that we get the correct area *between* lower
+        // and higher lines for each pixel.
+        ColorBlock colors;
+        colors.blk0 = _mm256_sub_epi8(colorL.blk0, colorH.blk0);
+        colors.blk1 = _mm256_sub_epi8(colorL.blk1, colorH.blk1);
+
+        // Apply bitmask for allowed u range (umin--umax).
+        // We shift coordinate so that `umin` becomes INT_MIN, so
+        // (ucoords < INT_MIN + umax - umin + 1) iff u is in [umin, umax].
+        int ucoord = ublk * 8 - umin - 0x80000000;
+        __m256i ucoords =
+            _mm256_add_epi32(_mm256_set1_epi32(ucoord), isteps);  // vpaddd
+        __m256i umask = _mm256_cmpgt_epi32(uthreshold, ucoords);  // vpcmpgtd
+        colors.blk0 = _mm256_and_si256(colors.blk0, umask);  // vpand
+        colors.blk1 = _mm256_and_si256(colors.blk1, umask);  // vpand
+
+#ifdef DEBUG_BITMAP
+        printf("ublk vblk = %d %d : u v = %d %d\n",
+               ublk, vblk, ublk * 8, vblk * 8);
+        printf("  vL, vH at start: %.2f %.2f\n",
+               s.vL0 + slope * ublk * 8, s.vH0 + slope * ublk * 8);
+        printf("  ucoords = %s\n", util::to_string(ucoords).c_str());
+        printf("  umask = %s\n", util::to_string(umask).c_str());
+        printf("  colors.blk0 = %s\n", util::to_string(colors.blk0).c_str());
+        printf("  colors.blk1 = %s\n", util::to_string(colors.blk1).c_str());
+        printf("  colorL.blk0 = %s\n", util::to_string(colorL.blk0).c_str());
+        printf("  colorL.blk1 = %s\n", util::to_string(colorL.blk1).c_str());
+        printf("  colorH.blk0 = %s\n", util::to_string(colorH.blk0).c_str());
+        printf("  colorH.blk1 = %s\n", util::to_string(colorH.blk1).c_str());
+#endif
+
+        // Compute the bitmask for allowed v range (vmin--vmax).
+        int vcoord = vblk * 8 - vmin - 0x80000000;
+        __m256i vcoords =
+            _mm256_add_epi32(_mm256_set1_epi32(vcoord), isteps);  // vpaddd
+        __m256i vmask = _mm256_cmpgt_epi32(vthreshold, vcoords);  // vpcmpgtd
+
+        // Now shuffle `colors` into the correct coordinate (xy-space) so that
+        // we can write them into the buffer.
+        const __m128i *pptr =
+            &((const __m128i *) pixel_shuffle_map)[shuffle_type];
+        __m256i c_idxs = _mm256_broadcastsi128_si256(*pptr);  // vbroadcasti128
+        colors.blk0 = _mm256_shuffle_epi8(colors.blk0, c_idxs);  // vpshufb
+        colors.blk1 = _mm256_shuffle_epi8(colors.blk1, c_idxs);  // vpshufb
+
+        // Ditto for v masks.
+        pptr = &((const __m128i *) vmask_shuffle_map)[shuffle_type];
+        __m256i v_idxs = _mm256_broadcastsi128_si256(*pptr);  // vbroadcasti128
+        vmask = _mm256_shuffle_epi8(vmask, v_idxs);  // vpshufb
+        __m256i vmask0 =
+            _mm256_permute2x128_si256(vmask, vmask, 0x00);  // vperm2i128
+        __m256i vmask1 =
+            _mm256_permute2x128_si256(vmask, vmask, 0x11);  // vperm2i128
+
+        // Apply the bitmask for allowed v range.
+        colors.blk0 = _mm256_and_si256(colors.blk0, vmask0);  // vpand
+        colors.blk1 = _mm256_and_si256(colors.blk1, vmask1);  // vpand
+
+        // Now store the blocks.
+        store_blk(this,
+                  get_blk_idx<TileSize>(ublk * 2, vblk * 2, shuffle_type),
+                  _mm256_castsi256_si128(colors.blk0));
+        store_blk(this,
+                  get_blk_idx<TileSize>(ublk * 2 + 1, vblk * 2, shuffle_type),
+                  _mm256_extracti128_si256(colors.blk0, 1));  // vextracti128
+        store_blk(this,
+                  get_blk_idx<TileSize>(ublk * 2, vblk * 2 + 1, shuffle_type),
+                  _mm256_castsi256_si128(colors.blk1));
+        store_blk(this,
+                  get_blk_idx<TileSize>(ublk * 2 + 1, vblk * 2 + 1,
+                                        shuffle_type),
+                  _mm256_extracti128_si256(colors.blk1, 1));  // vextracti128
+
+        // Check the highest byte (i.e., top right pixel).
+        // (1) If the lower line passes below the pixel (i.e., highest byte of
+        //     `colorL` > 0), then we have to process the block to the right
+        //     later.
+        __m256i is_zero = _mm256_cmpeq_epi8(colorL.blk1, zeros);  // vpcmpeqb
+        int check_right = (_mm256_movemask_epi8(is_zero) >= 0);  // vpmovmskb
+
+        // (2) If the higher line passes above the pixel (i.e., highest byte of
+        //     `colorH` < 255), then we have to move up.
+        __m256i is_max = _mm256_cmpeq_epi8(colorH.blk1, all_ones);  // vpcmpeqb
+        int up = (_mm256_movemask_epi8(is_max) >= 0);  // vpmovmskb
+        up &= (vblk < (TileSize / 8) - 1);
+
+#ifdef DEBUG_BITMAP
+        printf("check_right = %d up = %d\n", check_right, up);
+#endif
+
+        // If both `check_right` and `up` is true, then increment `down_cnt` so
+        // that we can find the correct staring point after moving right later.
+        //
+        // For example, if we move like this:
+        //
+        //      (3, 4)       ...
+        //        ^   \       ^
+        //      (3, 3) \    (4, 3)
+        //        ^     \     ^
+        //      (3, 2)   -->(4, 2)
+        //        ^
+        //      (3, 1)
+        //
+        // Then:
+        //      (3, 1) : up
+        //      (3, 2) : up, check_right -> increment down_cnt
+        //      (3, 3) : up, check_right -> increment down_cnt
+        //      (3, 4) :     check_right -> apply and clear down_cnt
+        //      (4, 2) ...
+        down_cnt += (check_right & up);
+
+        ublk += !up;
+        int vincr = up ? 1 : -down_cnt;
+        vblk += vincr;
+
+        down_cnt &= -up;  // "if (!up) down_cnt = 0;"
+
+        if (ublk >= (TileSize / 8) || (ublk * 8) > umax) return;
+    }
+}
+
+template<int TileSize>
+void GrayscaleBuffer::draw_circle_avx2(float x0, float y0,
+                                       const CircleSetup &s)
+{
+    const __m256 A = _mm256_set1_ps(s.A);
+    const __m256 B = _mm256_set1_ps(s.B);
+    const int xblk0 = s.xblk0;
+    const int xblk1 = s.xblk1;
+    const int yblk0 = s.yblk0;
+    const int yblk1 = s.yblk1;
+
+    // We process each 4x4 block by dividing it into two 4x2 blocks.
+    // Block #0 contains rows #0 and #2, and block #1 contains rows #1 and #3.
+    // (This looks weird, but then we can merge them correctly with
+    // _mm256_packs_epi32.
+    const __m256 xsteps = _mm256_set_ps(3.f, 2.f, 1.f, 0.f, 3.f, 2.f, 1.f, 0.f);
+    const __m256 xdists0 =
+        _mm256_add_ps(_mm256_set1_ps(xblk0 * 4 - x0), xsteps);
+
+    const __m256 ysteps = _mm256_set_ps(2.f, 2.f, 2.f, 2.f, 0.f, 0.f, 0.f, 0.f);
+    __m256 ydistsL = _mm256_add_ps(_mm256_set1_ps(yblk0 * 4 - y0), ysteps);
+    __m256 ydistsH = _mm256_add_ps(ydistsL, _mm256_set1_ps(1.f));
+
+    for (int yblk = yblk0; yblk <= yblk1; yblk++) {
+        __m256 xdists = xdists0;
+        __m256 ydistsL2 = _mm256_mul_ps(ydistsL, ydistsL);
+        __m256 ydistsH2 = _mm256_mul_ps(ydistsH, ydistsH);
+
+        for (int xblk = xblk0; xblk <= xblk1; xblk++) {
+            __m256 xdists2 = _mm256_mul_ps(xdists, xdists);
+
+            __m256 distsL2 = _mm256_add_ps(xdists2, ydistsL2);
+            __m256 distsH2 = _mm256_add_ps(xdists2, ydistsH2);
+
+            __m256 colorL = _mm256_fmadd_ps(distsL2, A, B);
+            __m256 colorH = _mm256_fmadd_ps(distsH2, A, B);
+
+            __m256i colorL_int = _mm256_cvtps_epi32(colorL);  // vcvtps2dq
+            __m256i colorH_int = _mm256_cvtps_epi32(colorH);  // vcvtps2dq
+
+            // First convert to int16_t with saturation.
+            // `color_int` contains 16 values in this order:
+            //      colorL_int[0, 1, 2, 3]
+            //      colorH_int[0, 1, 2, 3]
+            //      colorL_int[4, 5, 6, 7]
+            //      colorH_int[4, 5, 6, 7]
+            __m256i color_short = _mm256_packs_epi32(colorL_int, colorH_int);
+                // vpackssdw
+
+            // Now convert to uint8_t with saturation.
+            __m128i colorL_short = _mm256_castsi256_si128(color_short);
+            __m128i colorH_short = _mm256_extractf128_si256(color_short, 1);
+                // vextractf128
+            __m128i color = _mm_packus_epi16(colorL_short, colorH_short);
+                // packuswb
+
+            store_blk(this, get_blk_idx<TileSize>(xblk, yblk, 0), color);
+
+            // Update `xdists`.
+            xdists = _mm256_add_ps(xdists, _mm256_set1_ps(4.f));
+        }
+
+        ydistsL = _mm256_add_ps(ydistsL, _mm256_set1_ps(4.f));
+        ydistsH = _mm256_add_ps(ydistsH, _mm256_set1_ps(4.f));
+    }
+}
+
+// Instantiate for each supported tile size.
+template void GrayscaleBuffer::draw_line_avx2<128>(const LineSetup &s);
+template void GrayscaleBuffer::draw_line_avx2<256>(const LineSetup &s);
+template void GrayscaleBuffer::draw_line_avx2<512>(const LineSetup &s);
+template void GrayscaleBuffer::draw_circle_avx2<128>(
+    float x0, float y0, const CircleSetup &s);
+template void GrayscaleBuffer::draw_circle_avx2<256>(
+    float x0, float y0, const CircleSetup &s);
+template void GrayscaleBuffer::draw_circle_avx2<512>(
+    float x0, float y0, const CircleSetup &s);
+
+} // namespace croquis
@@ -0,0 +1,237 @@
+// AVX-512 version of GrayscaleBuffer: see grayscale_buffer_avx2.cc for the
+// original (AVX2) version, which has more detailed comments.
+//
+// This file is compiled with AVX-512 flags, and only called if the CPU supports
+// it (see util/cpu_features.h).  The results must be identical to the AVX2
+// version.
+
+#include <stdint.h>  // uint64_t
+
+#include <immintrin.h>
+
+#include <algorithm>  // min, max
+
+#include "croquis/grayscale_buffer.h"
+#include "croquis/grayscale_buffer_impl.h"
+
+namespace croquis {
+
+namespace {
+struct ColorBlock512 {
+    __m512i blk0, blk1;
+};
+}  // namespace
+
+// Same as compute_color() in grayscale_buffer_avx2.cc, but computes sixteen
+// columns at once: we use it to compute the lower and the higher lines
+// together.
+static inline ColorBlock512 compute_color(__m512 yrel)
+{
+    const __m512i all_ones = _mm512_set1_epi32(-1);
+    ColorBlock512 retval;
+
+    __m512 yfloor = _mm512_roundscale_ps(  // vrndscaleps
+        yrel, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    __m512i yint = _mm512_cvtps_epi32(yfloor);  // vcvtps2dq
+    __m512 yfrac = _mm512_sub_ps(yrel, yfloor);  // vsubps
+
+    __m512i color = _mm512_cvtps_epi32(  // vcvtps2dq
+        _mm512_mul_ps(yfrac, _mm512_set1_ps(255.f)));  // vmulps
+    color = _mm512_andnot_si512(color, all_ones);  // vpandnd
+
+    __m512i shift0 = _mm512_slli_epi32(yint, 3);  // vpslld: multiply by 8.
+    __m512i color0 = _mm512_sllv_epi32(color, shift0);  // vpsllvd
+
+    // If yint is negative, fill the pixels with 0xff.
+    __mmask16 is_neg0 =
+        _mm512_cmpgt_epi32_mask(_mm512_setzero_si512(), yint);  // vpcmpgtd
+    retval.blk0 =
+        _mm512_mask_mov_epi32(color0, is_neg0, all_ones);  // vmovdqa32
+
+    // Same for the higher block (y is higher by 4).
+    __m512i shift1 = _mm512_sub_epi32(shift0, _mm512_set1_epi32(32));
+    __m512i color1 = _mm512_sllv_epi32(color, shift1);  // vpsllvd
+    __mmask16 is_neg1 =
+        _mm512_cmpgt_epi32_mask(_mm512_set1_epi32(4), yint);  // vpcmpgtd
+    retval.blk1 =
+        _mm512_mask_mov_epi32(color1, is_neg1, all_ones);  // vmovdqa32
+
+    return retval;
+}
+
+template<int TileSize>
+void GrayscaleBuffer::draw_line_avx512(const LineSetup &s)
+{
+    const int shuffle_type = s.shuffle_type;
+    const float slope = s.slope;
+    int ublk = s.ublk;
+    int vblk = s.vblk;
+
+    // The lower eight lanes are for the lower line, and the higher eight lanes
+    // are for the higher line: in each successive eight columns,
+    //      vL + 0.5 = (leftmost u * slope) + vLH_disps[0..7]
+    //      vH + 0.5 = (leftmost u * slope) + vLH_disps[8..15]
+    const __m512 steps = _mm512_set_ps(7.f, 6.f, 5.f, 4.f, 3.f, 2.f, 1.f, 0.f,
+                                       7.f, 6.f, 5.f, 4.f, 3.f, 2.f, 1.f, 0.f);
+    const __m512 vLH0 = _mm512_insertf32x8(  // vinsertf32x8
+        _mm512_set1_ps(s.vL0), _mm256_set1_ps(s.vH0), 1);
+    const __m512 vLH_disps = _mm512_fmadd_ps(  // vfmadd...ps
+        steps, _mm512_set1_ps(slope), vLH0);
+
+    // Used to compute the bitmask for allowed u range (umin--umax): see
+    // draw_line_avx2().
+    const __m512i uthreshold =
+        _mm512_set1_epi32(s.umax - s.umin - 0x80000000U + 1);
+    const __m512i isteps = _mm512_set_epi32(7, 6, 5, 4, 3, 2, 1, 0,
+                                            7, 6, 5, 4, 3, 2, 1, 0);
+
+    // Shuffle maps for the current coordinate type.
+    const __m512i c_idxs = _mm512_broadcast_i32x4(  // vbroadcasti32x4
+        ((const __m128i *) pixel_shuffle_map)[shuffle_type]);
+
+    int down_cnt = 0;
+
+    while (true) {
+        const __m512i zeros = _mm512_setzero_si512();
+        const __m512i all_ones = _mm512_set1_epi32(-1);
+
+        // Compute displacement relative to (ublk * 8, vblk * 8).
+        const float vrel = get_vrel(ublk, vblk, slope);
+        const __m512 vLH_rel =
+            _mm512_add_ps(_mm512_set1_ps(vrel), vLH_disps);  // vaddps
+
+        ColorBlock512 colorLH = compute_color(vLH_rel);
+
+        // Rearrange into [L.blk0, L.blk1] and [H.blk0, H.blk1], and subtract
+        // the "colors" to get the area between lower and higher lines.
+        __m512i colorL = _mm512_shuffle_i64x2(  // vshufi64x2
+            colorLH.blk0, colorLH.blk1, 0x44);
+        __m512i colorH = _mm512_shuffle_i64x2(  // vshufi64x2
+            colorLH.blk0, colorLH.blk1, 0xee);
+        __m512i colors = _mm512_sub_epi8(colorL, colorH);  // vpsubb
+
+        // Apply bitmask for allowed u range (umin--umax): each 32-bit lane is
+        // a column of four pixels.
+        int ucoord = ublk * 8 - s.umin - 0x80000000;
+        __m512i ucoords =
+            _mm512_add_epi32(_mm512_set1_epi32(ucoord), isteps);  // vpaddd
+        __mmask16 umask =
+            _mm512_cmpgt_epi32_mask(uthreshold, ucoords);  // vpcmpgtd
+
+        // Apply bitmask for allowed v range (vmin--vmax): each byte of a 32-bit
+        // lane is a row.  Rows [vlo, vhi] of this block are allowed.
+        const int64_t vbase = (int64_t) vblk * 8;
+        const int64_t vlo = std::max<int64_t>(s.vmin - vbase, 0);
+        const int64_t vhi = std::min<int64_t>(s.vmax - vbase, 7);
+        uint64_t rows = (vlo <= vhi) ? (2ULL << vhi) - (1ULL << vlo) : 0;
+        __mmask64 vmask = ((rows & 0x0f) * 0x11111111ULL) |
+                          ((rows >> 4) * 0x11111111ULL << 32);
+
+        colors = _mm512_maskz_mov_epi32(umask, colors);  // vmovdqa32
+        colors = _mm512_maskz_mov_epi8(vmask, colors);  // vmovdqu8
+
+        // Now shuffle `colors` into the correct coordinate (xy-space), and
+        // store the blocks.
+        colors = _mm512_shuffle_epi8(colors, c_idxs);  // vpshufb
+
+        store_blk(this,
+                  get_blk_idx<TileSize>(ublk * 2, vblk * 2, shuffle_type),
+                  _mm512_castsi512_si128(colors));
+        store_blk(this,
+                  get_blk_idx<TileSize>(ublk * 2 + 1, vblk * 2, shuffle_type),
+                  _mm512_extracti32x4_epi32(colors, 1));  // vextracti32x4
+        store_blk(this,
+                  get_blk_idx<TileSize>(ublk * 2, vblk * 2 + 1, shuffle_type),
+                  _mm512_extracti32x4_epi32(colors, 2));  // vextracti32x4
+        store_blk(this,
+                  get_blk_idx<TileSize>(ublk * 2 + 1, vblk * 2 + 1,
+                                        shuffle_type),
+                  _mm512_extracti32x4_epi32(colors, 3));  // vextracti32x4
+
+        // Check the top right pixel: byte #31 of `colorLH.blk1` for the lower
+        // line, and byte #63 for the higher line.
+        __mmask64 is_zero =
+            _mm512_cmpeq_epi8_mask(colorLH.blk1, zeros);  // vpcmpeqb
+        __mmask64 is_max =
+            _mm512_cmpeq_epi8_mask(colorLH.blk1, all_ones);  // vpcmpeqb
+        int check_right = !((is_zero >> 31) & 1);
+        int up = !((is_max >> 63) & 1);
+        up &= (vblk < (TileSize / 8) - 1);
+
+        // See draw_line_avx2() for explanation.
+        down_cnt += (check_right & up);
+
+        ublk += !up;
+        int vincr = up ? 1 : -down_cnt;
+        vblk += vincr;
+
+        down_cnt &= -up;  // "if (!up) down_cnt = 0;"
+
+        if (ublk >= (TileSize / 8) || (ublk * 8) > s.umax) return;
+    }
+}
+
+template<int TileSize>
+void GrayscaleBuffer::draw_circle_avx512(float x0, float y0,
+                                         const CircleSetup &s)
+{
+    const __m512 A = _mm512_set1_ps(s.A);
+    const __m512 B = _mm512_set1_ps(s.B);
+
+    // Unlike draw_circle_avx2(), we process a whole 4x4 block at once, in the
+    // natural (row-major) order.
+    const __m512 xsteps = _mm512_set_ps(3.f, 2.f, 1.f, 0.f, 3.f, 2.f, 1.f, 0.f,
+                                        3.f, 2.f, 1.f, 0.f, 3.f, 2.f, 1.f, 0.f);
+    const __m512 xdists0 =
+        _mm512_add_ps(_mm512_set1_ps(s.xblk0 * 4 - x0), xsteps);
+
+    // To get the identical result as draw_circle_avx2(), we compute y
+    // distances exactly the same way: rows #0 and #2 in `ydistsL`, and rows #1
+    // and #3 in `ydistsH`.
+    const __m256 ysteps = _mm256_set_ps(2.f, 2.f, 2.f, 2.f, 0.f, 0.f, 0.f, 0.f);
+    __m256 ydistsL = _mm256_add_ps(_mm256_set1_ps(s.yblk0 * 4 - y0), ysteps);
+    __m256 ydistsH = _mm256_add_ps(ydistsL, _mm256_set1_ps(1.f));
+
+    for (int yblk = s.yblk0; yblk <= s.yblk1; yblk++) {
+        // Rows are now in the order of (#0, #2, #1, #3): fix the order.
+        __m512 ydists2 = _mm512_insertf32x8(  // vinsertf32x8
+            _mm512_castps256_ps512(_mm256_mul_ps(ydistsL, ydistsL)),
+            _mm256_mul_ps(ydistsH, ydistsH), 1);
+        ydists2 = _mm512_shuffle_f32x4(  // vshuff32x4
+            ydists2, ydists2, _MM_SHUFFLE(3, 1, 2, 0));
+
+        __m512 xdists = xdists0;
+        for (int xblk = s.xblk0; xblk <= s.xblk1; xblk++) {
+            __m512 xdists2 = _mm512_mul_ps(xdists, xdists);
+            __m512 dists2 = _mm512_add_ps(xdists2, ydists2);
+            __m512 color = _mm512_fmadd_ps(dists2, A, B);
+
+            // Convert to uint8_t with saturation.
+            __m512i color_int = _mm512_cvtps_epi32(color);  // vcvtps2dq
+            color_int = _mm512_max_epi32(  // vpmaxsd
+                color_int, _mm512_setzero_si512());
+            __m128i color8 = _mm512_cvtusepi32_epi8(color_int);  // vpmovusdb
+
+            store_blk(this, get_blk_idx<TileSize>(xblk, yblk, 0), color8);
+
+            // Update `xdists`.
+            xdists = _mm512_add_ps(xdists, _mm512_set1_ps(4.f));
+        }
+
+        ydistsL = _mm256_add_ps(ydistsL, _mm256_set1_ps(4.f));
+        ydistsH = _mm256_add_ps(ydistsH, _mm256_set1_ps(4.f));
+    }
+}
+
+// Instantiate for each supported tile size.
+template void GrayscaleBuffer::draw_line_avx512<128>(const LineSetup &s);
+template void GrayscaleBuffer::draw_line_avx512<256>(const LineSetup &s);
+template void GrayscaleBuffer::draw_line_avx512<512>(const LineSetup &s);
+template void GrayscaleBuffer::draw_circle_avx512<128>(
+    float x0, float y0, const CircleSetup &s);
+template void GrayscaleBuffer::draw_circle_avx512<256>(
+    float x0, float y0, const CircleSetup &s);
+template void GrayscaleBuffer::draw_circle_avx512<512>(
+    float x0, float y0, const CircleSetup &s);
+
+} // namespace croquis
@@ -0,0 +1,123 @@
+// Internal helpers shared by GrayscaleBuffer implementations for different
+// instruction sets (grayscale_buffer_{scalar,sse4,avx2,avx512}.cc).
+//
+// NOTE: This file is included by translation units compiled with different
+//       instruction sets, so every function here must have internal linkage
+//       (i.e., `static`): otherwise, the linker may pick the AVX-512 version of
+//       a function and call it on a CPU without AVX-512.
+
+#pragma once
+
+#include <stdint.h>  // uint32_t
+
+#include <immintrin.h>
+
+#include "croquis/grayscale_buffer.h"
+
+namespace croquis {
+
+// Shuffle maps used by draw_line(): see grayscale_buffer.cc.
+extern const uint32_t pixel_shuffle_map[16];
+extern const uint32_t vmask_shuffle_map[16];
+
+// Parameters for drawing a line, computed by setup_line(): see
+// GrayscaleBuffer::draw_line() for details.
+struct LineSetup {
+    // How the line was transformed to the uv-space.
+    int shuffle_type;
+
+    // Slope and the v-intercept of lower/higher lines (plus 0.5).
+    float slope, vL0, vH0;
+
+    // Bounding box in the uv-space.
+    int umin, umax, vmin, vmax;
+
+    // The first 8x8 block to process.
+    int ublk, vblk;
+};
+
+// Fill in `s` and return true, or return false if there's nothing to draw.
+bool setup_line(float x0, float y0, float x1, float y1, float width,
+                int tile_size, LineSetup *s);
+
+// Parameters for drawing a circle, computed by setup_circle().
+struct CircleSetup {
+    // The color of a pixel is (A * D^2 + B), where D is the distance from the
+    // center.
+    float A, B;
+
+    // Range of 4x4 blocks to process (inclusive).
+    int xblk0, xblk1, yblk0, yblk1;
+};
+
+void setup_circle(float x0, float y0, float radius, int tile_size,
+                  CircleSetup *s);
+
+// Round to the nearest integer, or return INT_MIN (0x80000000) if out of range,
+// exactly like vcvtps2dq.
+static inline int cvt_round(float f)
+{
+    return _mm_cvtss_si32(_mm_set_ss(f));  // vcvtss2si
+}
+
+// Compute the v-coordinate of the lower left corner of 8x8 block (ublk, vblk),
+// relative to the line (i.e., `vrel` in draw_line_avx2()).  We compute in
+// double so that the result is rounded only once, as if it were computed by
+// FMA: this way, we get the same result whether or not the compiler uses FMA.
+static inline float get_vrel(int ublk, int vblk, float slope)
+{
+    return (double) (ublk * 8) * slope - (vblk * 8);
+}
+
+// log2 of the number of 4x4 blocks in each row of a tile.
+static constexpr int blk_shift(int tile_size)
+{
+    return (tile_size == 128) ? 5 : (tile_size == 256) ? 6 : 7;
+}
+
+// Compute the blcok index back from ublk, vblk and current coordinate type.
+// ublk2 == ublk *2, vblk2 == blk * 2.
+// See draw_line() for what `shuffle_type` means.
+template<int TileSize>
+static inline int get_blk_idx(int ublk2, int vblk2, int shuffle_type)
+{
+    static_assert(TileSize == 128 || TileSize == 256 || TileSize == 512,
+                  "Unsupported tile size");
+    const int SHIFT = blk_shift(TileSize);
+    const int MAXBLK = (TileSize / 4) - 1;
+
+    int ushift = (shuffle_type & 0x02) ? SHIFT : 0;
+    int vshift = (shuffle_type & 0x02) ? 0 : SHIFT;
+
+    // E.g., for 256x256 tiles,
+    // mask[0, 1, 2, 3] = (0x0000, 0x0fc0, 0x0000, 0x003f)
+    const static int mask[4] = { 0x0000, MAXBLK << SHIFT, 0x0000, MAXBLK };
+    return ((ublk2 << ushift) + (vblk2 << vshift)) ^ mask[shuffle_type];
+}
+
+// Read a 4x4 block (16 bytes) at buf[offset], apply max, and store it back.  If
+// the block transitions from zero to nonzero, also record the offset to
+// `blklist`.
+static inline void store_blk(GrayscaleBuffer *gray_buf, int offset,
+                             __m128i blk)
+{
+    __m128i orig = gray_buf->buf[offset];  // vmovdqa
+    gray_buf->buf[offset] = _mm_max_epu8(blk, orig);  // vpmaxub, vmovdqa
+
+    // Check if the block transitioned from zero to nonzero, and if so, append
+    // to `blklist`.
+#ifdef __SSE4_1__
+    bool changed =
+        _mm_testz_si128(orig, orig) & ~_mm_testz_si128(blk, blk);  // vptest
+#else
+    const __m128i zeros = _mm_setzero_si128();
+    bool changed =
+        (_mm_movemask_epi8(_mm_cmpeq_epi8(orig, zeros)) == 0xffff) &
+        (_mm_movemask_epi8(_mm_cmpeq_epi8(blk, zeros)) != 0xffff);
+#endif
+
+    gray_buf->blklist[gray_buf->blk_cnt] = offset;
+    gray_buf->blk_cnt += changed;
+}
+
+} // namespace croquis
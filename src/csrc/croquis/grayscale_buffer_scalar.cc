@@ -0,0 +1,173 @@
+// Scalar version of GrayscaleBuffer: see grayscale_buffer_avx2.cc for the
+// algorithm.
+//
+// This file is compiled without any instruction set flags, so it runs on any
+// x86-64 CPU.  It is much slower than other versions, but serves as the
+// reference: the results must be identical.
+
+#include "croquis/grayscale_buffer.h"
+
+#include <math.h>  // floorf
+#include <stdint.h>  // uint8_t, uint32_t
+
+#include <immintrin.h>
+
+#include <algorithm>  // min, max
+
+#include "croquis/grayscale_buffer_impl.h"
+
+namespace croquis {
+
+// Compute the "color" of a column of eight pixels from the relative y
+// coordinate of a boundary line: see compute_color() in
+// grayscale_buffer_avx2.cc.
+static inline void compute_color(float yrel, uint8_t *col)
+{
+    const float yfloor = floorf(yrel);
+    const int yint = cvt_round(yfloor);
+    const int color = cvt_round((yrel - yfloor) * 255.f);
+
+    // Row #yint gets (255 - color), rows above it get 0xff, and rows below it
+    // get 0x00: this is what the AVX2 version does by shifting.
+    for (int row = 0; row < 8; row++)
+        col[row] = (row > yint) ? 0xff : (row == yint) ? 255 - color : 0x00;
+}
+
+template<int TileSize>
+void GrayscaleBuffer::draw_line_scalar(const LineSetup &s)
+{
+    const int shuffle_type = s.shuffle_type;
+    const float slope = s.slope;
+    int ublk = s.ublk;
+    int vblk = s.vblk;
+
+    // Same as `vL_disps` and `vH_disps` in draw_line_avx2(): we compute in
+    // double so that the result is rounded only once, just like vfmadd.
+    float vL_disps[8], vH_disps[8];
+    for (int i = 0; i < 8; i++) {
+        vL_disps[i] = (double) i * slope + s.vL0;
+        vH_disps[i] = (double) i * slope + s.vH0;
+    }
+
+    // Allowed u & v ranges (umin--umax, vmin--vmax): u is allowed iff
+    // (u - umin) < urange, using unsigned arithmetic, as in draw_line_avx2().
+    const uint32_t urange = (uint32_t) s.umax - (uint32_t) s.umin + 1;
+    const uint32_t vrange = (uint32_t) s.vmax - (uint32_t) s.vmin + 1;
+
+    // Shuffle map for the current coordinate type (see pixel_shuffle_map).
+    const uint8_t *c_idxs =
+        (const uint8_t *) &pixel_shuffle_map[shuffle_type * 4];
+
+    int down_cnt = 0;
+
+    while (true) {
+        const float vrel = get_vrel(ublk, vblk, slope);
+
+        // Colors of the current 8x8 block in the uv-space, indexed by
+        // [column][row].
+        uint8_t colorL[8][8], colorH[8][8];
+        for (int col = 0; col < 8; col++) {
+            compute_color(vrel + vL_disps[col], colorL[col]);
+            compute_color(vrel + vH_disps[col], colorH[col]);
+        }
+
+        // Now process each 4x4 block, in the same order as draw_line_avx2().
+        for (int blk = 0; blk < 4; blk++) {
+            const int ublk2 = ublk * 2 + (blk & 1);
+            const int vblk2 = vblk * 2 + (blk >> 1);
+
+            // Arrange pixels in the uv-space (each four bytes is a column),
+            // subtract the "colors", and apply bitmasks for allowed u & v
+            // ranges.
+            alignas(16) uint8_t colors[16];
+            for (int i = 0; i < 16; i++) {
+                const uint32_t u = ublk2 * 4 + i / 4;
+                const uint32_t v = vblk2 * 4 + i % 4;
+                const bool allowed = (u - (uint32_t) s.umin < urange) &&
+                                     (v - (uint32_t) s.vmin < vrange);
+                const int col = u % 8;
+                const int row = v % 8;
+                colors[i] =
+                    allowed ? colorL[col][row] - colorH[col][row] : 0x00;
+            }
+
+            // Shuffle into the xy-space, just like vpshufb.
+            alignas(16) uint8_t pixels[16];
+            for (int i = 0; i < 16; i++) pixels[i] = colors[c_idxs[i]];
+
+            store_blk(this, get_blk_idx<TileSize>(ublk2, vblk2, shuffle_type),
+                      _mm_load_si128((const __m128i *) pixels));
+        }
+
+        // Check the top right pixel, and find the next block to process: see
+        // draw_line_avx2().
+        int check_right = (colorL[7][7] != 0x00);
+        int up = (colorH[7][7] != 0xff);
+        up &= (vblk < (TileSize / 8) - 1);
+
+        down_cnt += (check_right & up);
+
+        ublk += !up;
+        int vincr = up ? 1 : -down_cnt;
+        vblk += vincr;
+
+        down_cnt &= -up;  // "if (!up) down_cnt = 0;"
+
+        if (ublk >= (TileSize / 8) || (ublk * 8) > s.umax) return;
+    }
+}
+
+template<int TileSize>
+void GrayscaleBuffer::draw_circle_scalar(float x0, float y0,
+                                         const CircleSetup &s)
+{
+    // To get the identical result as draw_circle_avx2(), we compute distances
+    // exactly the same way: in particular, rows #1 and #3 are computed by
+    // adding 1 to rows #0 and #2.
+    float ydists[4];
+    ydists[0] = (s.yblk0 * 4 - y0) + 0.f;
+    ydists[2] = (s.yblk0 * 4 - y0) + 2.f;
+    ydists[1] = ydists[0] + 1.f;
+    ydists[3] = ydists[2] + 1.f;
+
+    float xdists0[4];
+    for (int col = 0; col < 4; col++)
+        xdists0[col] = (s.xblk0 * 4 - x0) + (float) col;
+
+    for (int yblk = s.yblk0; yblk <= s.yblk1; yblk++) {
+        float xdists[4] = { xdists0[0], xdists0[1], xdists0[2], xdists0[3] };
+
+        for (int xblk = s.xblk0; xblk <= s.xblk1; xblk++) {
+            alignas(16) uint8_t pixels[16];
+            for (int i = 0; i < 16; i++) {
+                const float xd = xdists[i % 4];
+                const float yd = ydists[i / 4];
+                const float dists2 = xd * xd + yd * yd;
+
+                // Same as vfmadd: see draw_line_scalar().
+                const float color = (double) dists2 * s.A + s.B;
+                pixels[i] = std::min(std::max(cvt_round(color), 0), 255);
+            }
+
+            store_blk(this, get_blk_idx<TileSize>(xblk, yblk, 0),
+                      _mm_load_si128((const __m128i *) pixels));
+
+            for (int col = 0; col < 4; col++) xdists[col] += 4.f;
+        }
+
+        for (int row = 0; row < 4; row++) ydists[row] += 4.f;
+    }
+}
+
+// Instantiate for each supported tile size.
+template void GrayscaleBuffer::draw_line_scalar<128>(const LineSetup &s);
+template void GrayscaleBuffer::draw_line_scalar<256>(const LineSetup &s);
+template void GrayscaleBuffer::draw_line_scalar<512>(const LineSetup &s);
+template void GrayscaleBuffer::draw_circle_scalar<128>(
+    float x0, float y0, const CircleSetup &s);
+template void GrayscaleBuffer::draw_circle_scalar<256>(
+    float x0, float y0, const CircleSetup &s);
+template void GrayscaleBuffer::draw_circle_scalar<512>(
+    float x0, float y0, const CircleSetup &s);
+
+} // namespace croquis
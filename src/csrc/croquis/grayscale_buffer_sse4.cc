@@ -0,0 +1,249 @@
+// SSE4 version of GrayscaleBuffer: see grayscale_buffer_avx2.cc for the
+// algorithm.
+//
+// This file is compiled with SSE4.2 flags, and only called if the CPU supports
+// it (see util/cpu_features.h).  The results must be identical to other
+// versions.
+
+#include "croquis/grayscale_buffer.h"
+
+#include <stdint.h>  // uint32_t
+
+#include <immintrin.h>
+
+#include "croquis/grayscale_buffer_impl.h"
+
+namespace croquis {
+
+namespace {
+struct ColorBlock {
+    __m128i blk0, blk1;
+};
+}  // namespace
+
+// Same as compute_color() in grayscale_buffer_avx2.cc, but only computes four
+// columns.
+static inline ColorBlock compute_color(__m128 yrel)
+{
+    const __m128i all_ones = _mm_set1_epi8(0xff);
+    ColorBlock retval;
+
+    __m128 yfloor = _mm_floor_ps(yrel);  // roundps
+    __m128i yint = _mm_cvtps_epi32(yfloor);  // cvtps2dq
+    __m128 yfrac = _mm_sub_ps(yrel, yfloor);  // subps
+
+    __m128i color = _mm_cvtps_epi32(  // cvtps2dq
+        _mm_mul_ps(yfrac, _mm_set1_ps(255.f)));  // mulps
+    color = _mm_andnot_si128(color, all_ones);  // pandn
+
+    // We don't have vpsllvd, so we compare each row number with `yint`
+    // instead: row #yint gets the (flipped) color, rows above it get 0xff, and
+    // rows below it get 0x00.
+    //
+    // To compare bytes, clamp `yint` to [-1, 8] (which doesn't change the
+    // result), and copy the lowest byte of each column to all four bytes.
+    const __m128i bcast = _mm_set_epi8(12, 12, 12, 12, 8, 8, 8, 8,
+                                       4, 4, 4, 4, 0, 0, 0, 0);
+    yint = _mm_max_epi32(yint, _mm_set1_epi32(-1));  // pmaxsd
+    yint = _mm_min_epi32(yint, _mm_set1_epi32(8));  // pminsd
+    yint = _mm_shuffle_epi8(yint, bcast);  // pshufb
+    color = _mm_shuffle_epi8(color, bcast);  // pshufb
+
+    const __m128i rows0 = _mm_set1_epi32(0x03020100);
+    retval.blk0 = _mm_or_si128(
+        _mm_cmpgt_epi8(rows0, yint),  // pcmpgtb
+        _mm_and_si128(_mm_cmpeq_epi8(rows0, yint), color));  // pcmpeqb, pand
+
+    // Same for the higher block.
+    const __m128i rows1 = _mm_set1_epi32(0x07060504);
+    retval.blk1 = _mm_or_si128(
+        _mm_cmpgt_epi8(rows1, yint),  // pcmpgtb
+        _mm_and_si128(_mm_cmpeq_epi8(rows1, yint), color));  // pcmpeqb, pand
+
+    return retval;
+}
+
+template<int TileSize>
+void GrayscaleBuffer::draw_line_sse4(const LineSetup &s)
+{
+    const int shuffle_type = s.shuffle_type;
+    const float slope = s.slope;
+    int ublk = s.ublk;
+    int vblk = s.vblk;
+
+    // Same as `vL_disps` and `vH_disps` in draw_line_avx2(): we don't have
+    // FMA, so we compute in double to get the same rounding.
+    alignas(16) float disps[16];
+    for (int i = 0; i < 8; i++) {
+        disps[i] = (double) i * slope + s.vL0;
+        disps[i + 8] = (double) i * slope + s.vH0;
+    }
+
+    // "lo" and "hi" are for columns #0-3 and #4-7, respectively.
+    const __m128 vL_disps_lo = _mm_load_ps(disps);
+    const __m128 vL_disps_hi = _mm_load_ps(disps + 4);
+    const __m128 vH_disps_lo = _mm_load_ps(disps + 8);
+    const __m128 vH_disps_hi = _mm_load_ps(disps + 12);
+
+    // Used to compute bitmasks for allowed u & v ranges (umin--umax,
+    // vmin--vmax): see draw_line_avx2().
+    const __m128i uthreshold =
+        _mm_set1_epi32(s.umax - s.umin - 0x80000000U + 1);
+    const __m128i vthreshold =
+        _mm_set1_epi32(s.vmax - s.vmin - 0x80000000U + 1);
+    const __m128i isteps_lo = _mm_set_epi32(3, 2, 1, 0);
+    const __m128i isteps_hi = _mm_set_epi32(7, 6, 5, 4);
+
+    // Shuffle map for the current coordinate type.
+    const __m128i c_idxs =
+        _mm_load_si128(&((const __m128i *) pixel_shuffle_map)[shuffle_type]);
+
+    int down_cnt = 0;
+
+    while (true) {
+        // Compute displacement relative to (ublk * 8, vblk * 8).
+        const __m128 vrel = _mm_set1_ps(get_vrel(ublk, vblk, slope));
+
+        ColorBlock colorL_lo = compute_color(_mm_add_ps(vrel, vL_disps_lo));
+        ColorBlock colorL_hi = compute_color(_mm_add_ps(vrel, vL_disps_hi));
+        ColorBlock colorH_lo = compute_color(_mm_add_ps(vrel, vH_disps_lo));
+        ColorBlock colorH_hi = compute_color(_mm_add_ps(vrel, vH_disps_hi));
+
+        // Subtract the "colors" to get the area between lower and higher lines:
+        // colors[i] is the i-th 4x4 block, in the same order as
+        // draw_line_avx2() stores them.
+        __m128i colors[4];
+        colors[0] = _mm_sub_epi8(colorL_lo.blk0, colorH_lo.blk0);  // psubb
+        colors[1] = _mm_sub_epi8(colorL_hi.blk0, colorH_hi.blk0);  // psubb
+        colors[2] = _mm_sub_epi8(colorL_lo.blk1, colorH_lo.blk1);  // psubb
+        colors[3] = _mm_sub_epi8(colorL_hi.blk1, colorH_hi.blk1);  // psubb
+
+        // Bitmask for allowed u range: each 32-bit lane is a column.
+        const __m128i ucoords =
+            _mm_set1_epi32(ublk * 8 - s.umin - 0x80000000);
+        const __m128i umask_lo = _mm_cmpgt_epi32(  // pcmpgtd
+            uthreshold, _mm_add_epi32(ucoords, isteps_lo));
+        const __m128i umask_hi = _mm_cmpgt_epi32(  // pcmpgtd
+            uthreshold, _mm_add_epi32(ucoords, isteps_hi));
+
+        // Bitmask for allowed v range: compute one byte per row, and then copy
+        // to every column.  (Unlike draw_line_avx2(), we apply the mask before
+        // shuffling into the xy-space.)
+        const __m128i vcoords =
+            _mm_set1_epi32(vblk * 8 - s.vmin - 0x80000000);
+        __m128i vmask = _mm_packs_epi32(  // packssdw
+            _mm_cmpgt_epi32(vthreshold, _mm_add_epi32(vcoords, isteps_lo)),
+            _mm_cmpgt_epi32(vthreshold, _mm_add_epi32(vcoords, isteps_hi)));
+        vmask = _mm_packs_epi16(vmask, vmask);  // packsswb
+        const __m128i vmask0 =
+            _mm_shuffle_epi8(vmask, _mm_set1_epi32(0x03020100));  // pshufb
+        const __m128i vmask1 =
+            _mm_shuffle_epi8(vmask, _mm_set1_epi32(0x07060504));  // pshufb
+
+        colors[0] = _mm_and_si128(colors[0], _mm_and_si128(umask_lo, vmask0));
+        colors[1] = _mm_and_si128(colors[1], _mm_and_si128(umask_hi, vmask0));
+        colors[2] = _mm_and_si128(colors[2], _mm_and_si128(umask_lo, vmask1));
+        colors[3] = _mm_and_si128(colors[3], _mm_and_si128(umask_hi, vmask1));
+
+        // Now shuffle into the correct coordinate (xy-space), and store the
+        // blocks.
+        for (int blk = 0; blk < 4; blk++) {
+            store_blk(this,
+                      get_blk_idx<TileSize>(ublk * 2 + (blk & 1),
+                                            vblk * 2 + (blk >> 1),
+                                            shuffle_type),
+                      _mm_shuffle_epi8(colors[blk], c_idxs));  // pshufb
+        }
+
+        // Check the top right pixel, and find the next block to process: see
+        // draw_line_avx2().
+        int check_right = (_mm_extract_epi8(colorL_hi.blk1, 15) != 0x00);
+        int up = (_mm_extract_epi8(colorH_hi.blk1, 15) != 0xff);  // pextrb
+        up &= (vblk < (TileSize / 8) - 1);
+
+        down_cnt += (check_right & up);
+
+        ublk += !up;
+        int vincr = up ? 1 : -down_cnt;
+        vblk += vincr;
+
+        down_cnt &= -up;  // "if (!up) down_cnt = 0;"
+
+        if (ublk >= (TileSize / 8) || (ublk * 8) > s.umax) return;
+    }
+}
+
+// Compute (dists2 * A + B) for four pixels, rounded only once (like vfmadd),
+// and convert to integers.
+static inline __m128i get_circle_color(__m128 dists2, __m128d A, __m128d B)
+{
+    __m128d lo = _mm_cvtps_pd(dists2);  // cvtps2pd
+    __m128d hi = _mm_cvtps_pd(_mm_movehl_ps(dists2, dists2));  // cvtps2pd
+    lo = _mm_add_pd(_mm_mul_pd(lo, A), B);  // mulpd, addpd
+    hi = _mm_add_pd(_mm_mul_pd(hi, A), B);  // mulpd, addpd
+
+    __m128 color = _mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi));
+    return _mm_cvtps_epi32(color);  // cvtps2dq
+}
+
+template<int TileSize>
+void GrayscaleBuffer::draw_circle_sse4(float x0, float y0,
+                                       const CircleSetup &s)
+{
+    const __m128d A = _mm_set1_pd(s.A);
+    const __m128d B = _mm_set1_pd(s.B);
+
+    const __m128 xdists0 = _mm_add_ps(_mm_set1_ps(s.xblk0 * 4 - x0),
+                                      _mm_set_ps(3.f, 2.f, 1.f, 0.f));
+
+    // To get the identical result as draw_circle_avx2(), rows #1 and #3 are
+    // computed by adding 1 to rows #0 and #2.
+    __m128 ydists[4];
+    ydists[0] = _mm_add_ps(_mm_set1_ps(s.yblk0 * 4 - y0), _mm_set1_ps(0.f));
+    ydists[2] = _mm_add_ps(_mm_set1_ps(s.yblk0 * 4 - y0), _mm_set1_ps(2.f));
+    ydists[1] = _mm_add_ps(ydists[0], _mm_set1_ps(1.f));
+    ydists[3] = _mm_add_ps(ydists[2], _mm_set1_ps(1.f));
+
+    for (int yblk = s.yblk0; yblk <= s.yblk1; yblk++) {
+        __m128 ydists2[4];
+        for (int row = 0; row < 4; row++)
+            ydists2[row] = _mm_mul_ps(ydists[row], ydists[row]);
+
+        __m128 xdists = xdists0;
+        for (int xblk = s.xblk0; xblk <= s.xblk1; xblk++) {
+            __m128 xdists2 = _mm_mul_ps(xdists, xdists);
+
+            __m128i color[4];
+            for (int row = 0; row < 4; row++) {
+                color[row] = get_circle_color(
+                    _mm_add_ps(xdists2, ydists2[row]), A, B);
+            }
+
+            // Convert to uint8_t with saturation.
+            __m128i color8 = _mm_packus_epi16(  // packuswb
+                _mm_packs_epi32(color[0], color[1]),  // packssdw
+                _mm_packs_epi32(color[2], color[3]));  // packssdw
+
+            store_blk(this, get_blk_idx<TileSize>(xblk, yblk, 0), color8);
+
+            // Update `xdists`.
+            xdists = _mm_add_ps(xdists, _mm_set1_ps(4.f));
+        }
+
+        for (int row = 0; row < 4; row++)
+            ydists[row] = _mm_add_ps(ydists[row], _mm_set1_ps(4.f));
+    }
+}
+
+// Instantiate for each supported tile size.
+template void GrayscaleBuffer::draw_line_sse4<128>(const LineSetup &s);
+template void GrayscaleBuffer::draw_line_sse4<256>(const LineSetup &s);
+template void GrayscaleBuffer::draw_line_sse4<512>(const LineSetup &s);
+template void GrayscaleBuffer::draw_circle_sse4<128>(
+    float x0, float y0, const CircleSetup &s);
+template void GrayscaleBuffer::draw_circle_sse4<256>(
+    float x0, float y0, const CircleSetup &s);
+template void GrayscaleBuffer::draw_circle_sse4<512>(
+    float x0, float y0, const CircleSetup &s);
+
+} // namespace croquis
@@ -5,6 +5,7 @@
 #include <limits.h>  // INT_MAX
 
 #include <algorithm>  // min
+#include <limits>  // numeric_limits
 #include <memory>  // make_unique
 
 #include "croquis/canvas.h"  // CanvasConfig
@@ -15,33 +16,65 @@ namespace croquis {
 
 template<typename DType>
 IntersectionResult<DType>::IntersectionResult(int tile_cnt,
-                                              DType start_id, DType end_id)
-    : tile_cnt(tile_cnt), start_id(start_id), end_id(end_id)
+                                              int64_t start_id, int64_t end_id,
+                                              IrEncoding encoding)
+    : tile_cnt(tile_cnt), start_id(start_id), end_id(end_id),
+      encoding(encoding)
 {
-    // Reserve some extra: `strip_cnt_` is the number of strips in the initial
-    // chunk.
+    CHECK(end_id - start_id <= max_batch_size());
+
+    // Reserve some extra, and round up to fill the last chunk.
     int extra = std::max(5, int(tile_cnt * 0.2));
-    strip_cnt_ = tile_cnt + extra;
+    int chunk_cnt = (tile_cnt + extra - 1) / STRIPS_PER_CHUNK + 1;
+    strip_cnt_ = chunk_cnt * STRIPS_PER_CHUNK;
 
-    chunks_.push_back(std::make_unique<DType[]>(strip_cnt_ * STRIP_SZ));
+    for (int i = 0; i < chunk_cnt; i++)
+        chunks_.push_back((DType *) StripArena::alloc());
     strips_ = std::make_unique<DType *[]>(tile_cnt);
     idxs_ = std::make_unique<int[]>(tile_cnt);
+    elem_cnts_ = std::make_unique<int64_t[]>(tile_cnt);  // Zero-initialized.
 
     // Initialize pointers.
-    DType *ptr = chunks_[0].get();
     for (int i = 0; i < tile_cnt; i++) {
+        DType *ptr = chunks_[i / STRIPS_PER_CHUNK] +
+                     (i % STRIPS_PER_CHUNK) * STRIP_SZ;
         strips_[i] = ptr;
         idxs_[i] = 0;
-        *ptr = -1;  // Sentinel value.
-        ptr += STRIP_SZ;
+        if (encoding == IrEncoding::RLE)
+            *ptr = std::numeric_limits<DType>::min();  // Sentinel value.
     }
 
+    if (encoding == IrEncoding::VARINT)
+        pending_ = std::make_unique<PendingRun[]>(tile_cnt);
+
     // Put the extra buffer into `freelist_.`.
     freelist_ = nullptr;
-    for (int i = 0; i < extra; i++) {
+    for (int i = tile_cnt; i < strip_cnt_; i++) {
+        DType *ptr = chunks_[i / STRIPS_PER_CHUNK] +
+                     (i % STRIPS_PER_CHUNK) * STRIP_SZ;
         *(void **) ptr = freelist_;
         freelist_ = (void *) ptr;
-        ptr += STRIP_SZ;
+    }
+}
+
+template<typename DType>
+IntersectionResult<DType>::~IntersectionResult()
+{
+    for (DType *chunk : chunks_) StripArena::release(chunk);
+}
+
+template<typename DType>
+void IntersectionResult<DType>::finish()
+{
+    for (int i = 0; i < tile_cnt; i++) {
+        if (encoding == IrEncoding::VARINT) {
+            flush_run(i);
+            ((uint8_t *) strips_[i])[idxs_[i]] = 0x00;
+        }
+        else
+            strips_[i][idxs_[i] + 1] = 0;
+
+        elem_cnt_ += elem_cnts_[i];
     }
 }
 
@@ -52,14 +85,11 @@ DType *IntersectionResult<DType>::allocate_chunk()
 
     // printf("allocate_chunk called !!!\n");
 
-    int chunksize = std::min(std::max(20, strip_cnt_ / 2), 1024);
-    DType *chunk =
-        util::push_back(
-            chunks_,
-            std::make_unique<DType[]>(chunksize * STRIP_SZ)).get();
+    DType *chunk = util::push_back(chunks_, (DType *) StripArena::alloc());
+    strip_cnt_ += STRIPS_PER_CHUNK;
 
     DType *ptr = chunk + STRIP_SZ;
-    for (int i = 1; i < chunksize; i++) {
+    for (int i = 1; i < STRIPS_PER_CHUNK; i++) {
         *(void **) ptr = freelist_;
         freelist_ = (void *) ptr;
         ptr += STRIP_SZ;
@@ -72,7 +102,7 @@ template<typename DType>
 IntersectionResultSet<DType>::IntersectionResultSet(
     const std::vector<int> &prio_coords,
     const std::vector<int> &reg_coords,
-    DType start, DType end, DType batch_size)
+    int64_t start, int64_t end, int64_t batch_size, IrEncoding encoding)
 {
     // printf("**********************************\n");
     // printf("IntersectionResultSet created %p\n", this);
@@ -144,14 +174,17 @@ IntersectionResultSet<DType>::IntersectionResultSet(
     // Now create the necessary number of IntersectionResult instances.
     CHECK(start <= end);  // Sanity check.
     while (start < end) {
-        DType this_size = std::min(end - start, batch_size);
-        util::emplace_back_unique(results, tile_cnt_, start, start + this_size);
+        int64_t this_size = std::min(end - start, batch_size);
+        util::emplace_back_unique(results, tile_cnt_, start, start + this_size,
+                                  encoding);
         start += this_size;
     }
 }
 
 // Instantiate necessary templates.
+template class IntersectionResult<int32_t>;
 template class IntersectionResult<int64_t>;
+template class IntersectionResultSet<int32_t>;
 template class IntersectionResultSet<int64_t>;
 
 } // namespace croquis
@@ -6,21 +6,31 @@
 #pragma once
 
 #include <assert.h>
-#include <stdint.h>  // uint64_t
+#include <stdint.h>  // int64_t
+#include <string.h>  // memcpy
 
 #include <memory>  // unique_ptr
 #include <vector>
 
 #include "croquis/canvas.h"  // Tile
+#include "croquis/strip_arena.h"
+#include "croquis/util/macros.h"  // DISALLOW_COPY_AND_MOVE
 
 namespace croquis {
 
 // Forward declaration.
 template<typename DType> class IntersectionResultSet;
 
+// How IntersectionResult encodes the list of elements: see below.
+enum class IrEncoding {
+    RLE,     // Fixed-size values of (start, length).
+    VARINT,  // Delta-encoded varints: more compact for sparse data.
+};
+
 // Buffer to hold the list of elements (line segments or points (= "markers"))
 // that intersect each tile we want to create.  Each element is represented by a
-// unique integer ID (DType), which is either int32_t or int64_t.
+// unique integer ID (int64_t), which is stored as DType (either int32_t or
+// int64_t) inside the buffer.
 //
 // An IntersectionResult instance has one output buffer per tiles being
 // processed.  This class is not thread-safe, so we need as many
@@ -30,167 +40,373 @@ template<typename DType> class IntersectionResultSet;
 // appended.  When the current strip is full, we allocate another strip from the
 // freelist, and write down its address at the end of the preceding strip.
 //
-// For now, I'm making it a templated class in case we want to support int32_t
-// later (which would cut memory usage by half), but for now we will assume that
-// DType is always int64_t.
-//
-// We assume that each element ID is less than 2**47 (= 128 trillion): we shift
-// the value by 16 bits and use the lower 16 bits to store the length of
-// consecutive IDs (up to 65535).  E.g., a run "0 1 2 3 32 64 65" can be
-// represented as:
+// With IrEncoding::RLE, each value holds the element ID relative to
+// `start_id`, shifted by LEN_BITS, and the lower LEN_BITS store the length of
+// consecutive IDs.  For int64_t, LEN_BITS is 16, so (relative) IDs must be less
+// than 2**47 (= 128 trillion) and runs can be up to 65535 long.  E.g., a run
+// "0 1 2 3 32 64 65" can be represented as:
 //      0x0000 0000 0000 0004 - 4 elements starting at 0
 //      0x0000 0000 0020 0001 - 1 element starting at 32
 //      0x0000 0000 0040 0002 - 2 elements starting at 64
 //
-// Appending a value that equals the last added value is a no-op.
+// For int32_t, LEN_BITS is 14, so the batch (end_id - start_id) must be less
+// than 2**17 (= 131072) elements, and runs can be up to 16383 long.  It cuts
+// the memory usage by half, so Plotter uses it whenever the batch is small
+// enough.
+//
+// Value 0 means end of buffer.  A negative value (-1) means the end of the
+// current strip: the following slot(s) hold the pointer to the next strip.
+// (For int32_t, the pointer takes two slots.)
+//
+// To simplify append(), the very first value of a buffer is a sentinel (the
+// minimum value of DType): it should be skipped while reading.
+//
+// With IrEncoding::VARINT, strips are treated as byte arrays, and each run is
+// written as one or two LEB128 varints (7 bits per byte, lowest bits first):
+//      ((gap + 1) << 1) | (length > 1)
+//      length - 2                      (only if length > 1)
+// where `gap` is the distance from the end of the previous run (or from
+// `start_id`).  E.g., the same run "0 1 2 3 32 64 65" becomes 6 bytes:
+//      0x03 0x02 - 4 elements at gap 0
+//      0x3a      - 1 element at gap 28 (= 32 - 4)
+//      0x41 0x00 - 2 elements at gap 31 (= 64 - 33)
+// A singleton with a small gap thus takes a single byte, instead of 4 or 8
+// bytes for RLE, which matters when tiles contain a sparse scattering of atoms
+// (e.g., noisy data).  Since a run is only written when it cannot be extended
+// any more, the current run of each buffer is kept in `pending_`.
 //
-// Value 0 means end of buffer.  A negative value `v` holds a pointer to the
-// next strip, which can be obtained by ((-v) << 3).  (It's possible because the
-// pointer must be aligned to 64-bit boundaries.)
+// A byte 0x00 means end of buffer, and 0x01 means the end of the current strip,
+// followed by the pointer to the next strip.  (The first byte of a run is
+// always at least 0x02, so they cannot be confused.)
 //
-// To simplify append(), the very first value of a buffer is a sentinel (-1):
-// it should be skipped while reading.
+// With either encoding, appending a value that equals the last added value is
+// a no-op.
 //
-// TODO: Do we need int32_t?  Let's only use int64_t for now...
+// Strips are carved out of fixed-size chunks recycled by StripArena, so they
+// are not zero-initialized: finish() must be called to terminate each buffer
+// before reading.
 template<typename DType> class IntersectionResult {
   public:
     enum { STRIP_SZ = 1024 };  // # of elements in each strip.
+    enum { STRIP_BYTES = STRIP_SZ * sizeof(DType) };
+
+    // Number of bits used for the run length.
+    enum { LEN_BITS = (sizeof(DType) == 8) ? 16 : 14 };
+    enum { LEN_MASK = (1 << LEN_BITS) - 1 };
+
+    // Number of slots needed for the link to the next strip: the marker (-1)
+    // followed by the pointer.
+    enum { LINK_SLOTS = 1 + sizeof(void *) / sizeof(DType) };
+
+    // For IrEncoding::VARINT: we need this many bytes in the current strip
+    // before writing a run - two varints of (at most) 10 bytes each, plus the
+    // link (or the end marker).
+    enum { VARINT_RESERVE = 2 * 10 + 1 + sizeof(void *) };
+
+    // Maximum value of (end_id - start_id).
+    static constexpr int64_t max_batch_size()
+    { return int64_t(1) << (sizeof(DType) * 8 - 1 - LEN_BITS); }
+
     const int tile_cnt;
 
     // This object only contains items in [start_id, end_id).
-    const DType start_id, end_id;
+    const int64_t start_id, end_id;
+
+    const IrEncoding encoding;
+
+    // Number of strips in each chunk.
+    enum {
+        STRIPS_PER_CHUNK = StripArena::CHUNK_SZ / (STRIP_SZ * sizeof(DType))
+    };
 
   private:
     // To reduce overhead, strips are contained in "chunks" - each chunk may
-    // hold multiple buffers.  We own all the chunks.
-    std::vector<std::unique_ptr<DType[]>> chunks_;
+    // hold multiple buffers.  We own all the chunks (allocated from
+    // StripArena), and the first strip of buffer #k is the k'th strip overall.
+    std::vector<DType *> chunks_;
 
     int strip_cnt_;  // Number of strips we have (including filled and free).
 
-    // Points to the strip used by each buffer: the next data for buffer #k is
-    // written at strips_[k][idxs_[k]].
+    // Points to the strip used by each buffer.  For RLE, the last value of
+    // buffer #k is at strips_[k][idxs_[k]]; for VARINT, the next run of buffer
+    // #k is written at byte offset idxs_[k] of strips_[k].
     std::unique_ptr<DType *[]> strips_;
     std::unique_ptr<int[]> idxs_;
 
+    // For VARINT: the run currently being extended for each buffer (relative
+    // to `start_id`), and the end of the previous run.
+    struct PendingRun {
+        int64_t prev_end = 0;
+        int64_t start = 0;
+        int64_t len = 0;
+    };
+    std::unique_ptr<PendingRun[]> pending_;
+
+    // Number of elements in each buffer (for VARINT, only counts runs that are
+    // already written).
+    std::unique_ptr<int64_t[]> elem_cnts_;
+
     // Points to the next free buffer.  The first 8 bytes of that buffer points
     // to the second next free buffer, and so on.
     void *freelist_;
 
+    // Statistics, used by Plotter to choose the encoding.  `elem_cnt_` is
+    // computed by finish().
+    int64_t run_cnt_ = 0;
+    int64_t elem_cnt_ = 0;
+
   public:
-    IntersectionResult(int tile_cnt, DType start_id, DType end_id);
+    IntersectionResult(int tile_cnt, int64_t start_id, int64_t end_id,
+                       IrEncoding encoding = IrEncoding::RLE);
+    ~IntersectionResult();
+
+    inline void append(int buf_id, int64_t d);
+
+    // Return the number of bytes used by the buffer.
+    size_t memory_usage() const
+    { return (size_t) strip_cnt_ * STRIP_SZ * sizeof(DType); }
 
-    inline void append(int buf_id, DType d);
+    // Number of runs added so far (for VARINT, only counts runs that are
+    // already written), and the number of elements: must be called after
+    // finish().
+    int64_t run_cnt() const { return run_cnt_; }
+    int64_t elem_cnt() const { return elem_cnt_; }
+
+    // Number of elements in buffer #k: must be called after finish().
+    int64_t elem_cnt(int buf_id) const { return elem_cnts_[buf_id]; }
 
     // Called after we added all data.
-    void finish() {
-        for (int i = 0; i < tile_cnt; i++) strips_[i][idxs_[i] + 1] = 0;
-    }
+    void finish();
 
     class Iterator {
       private:
-        DType *ptr_;
-        DType next_;
+        const void *ptr_;  // Next run to read (nullptr if there's none).
+        bool varint_;
+        int64_t base_;  // = start_id
+        int64_t next_;
+        int64_t run_end_;
 
         friend class IntersectionResult;
         friend class IntersectionResultSet<DType>;
 
-        Iterator(DType *ptr, DType next) : ptr_(ptr), next_(next) { }
+        Iterator() : Iterator(nullptr, false, 0) { }
+        Iterator(const void *ptr, bool varint, int64_t base)
+            : ptr_(ptr), varint_(varint), base_(base),
+              next_(base), run_end_(base)
+        { if (ptr_ != nullptr) read_run(); }
+
+        // Read the next run and advance `ptr_`.
+        inline void read_run();
 
       public:
-        bool has_next() const { return ptr_ != nullptr; }
-        inline DType get_next();
-        DType peek() const { return next_; }
+        bool has_next() const { return next_ < run_end_; }
+        int64_t get_next() {
+            int64_t retval = next_;
+            if (++next_ == run_end_) read_run();
+            return retval;
+        }
+        int64_t peek() const { return next_; }
+
+        // Skip the rest of the current run, and return the number of elements
+        // skipped.
+        int64_t skip_run() {
+            int64_t cnt = run_end_ - next_;
+            next_ = run_end_;
+            read_run();
+            return cnt;
+        }
     };
 
     // Create an iterator: must be called after finish().
-    inline Iterator get_iter(int buf_id);
+    Iterator get_iter(int buf_id) const {
+        const DType *ptr = chunks_[buf_id / STRIPS_PER_CHUNK] +
+                           (buf_id % STRIPS_PER_CHUNK) * STRIP_SZ;
+        if (encoding == IrEncoding::VARINT)
+            return Iterator(ptr, true, start_id);
+        else
+            return Iterator(ptr + 1 /* skip sentinel */, false, start_id);
+    }
+
+    DISALLOW_COPY_AND_MOVE(IntersectionResult);
 
   private:
-    // Slow path for append() - allocate one more chunk and return the first
+    // Take a strip from the freelist.
+    inline DType *new_strip();
+
+    // Slow path for new_strip() - allocate one more chunk and return the first
     // strip (and put the rest to `freelist_`).
     DType *allocate_chunk();
+
+    // Implementation of append() for VARINT.
+    inline void append_varint(int buf_id, int64_t rel);
+
+    // Write the pending run of buffer #k (for VARINT).
+    inline void flush_run(int buf_id);
+
+    static inline uint8_t *put_varint(uint8_t *p, uint64_t v) {
+        for (; v >= 0x80; v >>= 7) *(p++) = (v & 0x7f) | 0x80;
+        *(p++) = v;
+        return p;
+    }
+
+    static inline uint64_t get_varint(const uint8_t **pp) {
+        const uint8_t *p = *pp;
+        uint64_t v = 0;
+        for (int shift = 0; ; shift += 7) {
+            uint8_t b = *(p++);
+            v |= (uint64_t) (b & 0x7f) << shift;
+            if (b < 0x80) break;
+        }
+        *pp = p;
+        return v;
+    }
 };
 
-template<> inline void IntersectionResult<int64_t>::append(int buf_id, int64_t d)
+template<typename DType>
+inline DType *IntersectionResult<DType>::new_strip()
+{
+    DType *newbuf = (DType *) freelist_;
+    if (newbuf == nullptr)
+        return allocate_chunk();  // Slow path.
+
+    freelist_ = *(void **) freelist_;
+    return newbuf;
+}
+
+template<typename DType>
+inline void IntersectionResult<DType>::append(int buf_id, int64_t d)
 {
     // printf("IntersectionResult::append called %d %ld !!!\n", buf_id, d);
 
     assert(d >= start_id && d < end_id);
 
-    typedef int64_t DType;
+    if (encoding == IrEncoding::VARINT) {
+        append_varint(buf_id, d - start_id);
+        return;
+    }
+
+    const DType rel = d - start_id;
     DType *strip = strips_[buf_id];
 
     int idx = idxs_[buf_id];
-    int64_t val = strip[idx];
+    DType val = strip[idx];
 
     // Check if the value equals last added value.
-    if ((val >> 16) + (val & 0xffff) == d + 1) return;
+    //
+    // Note that the sentinel value will never match here, or in the next
+    // condition.
+    DType run_end = (val >> LEN_BITS) + (val & LEN_MASK);
+    if (run_end == rel + 1) return;
+
+    elem_cnts_[buf_id]++;
 
     // Check if we can extend an existing run.
-    //
-    // Note that the condition will always fail if append() is called the very
-    // first time for a buffer, because then (vall == -1) and (d >= 0).
-    if ((val >> 16) + (val & 0xffff) == d && (val & 0xffff) != 0xffff) {
+    if (run_end == rel && (val & LEN_MASK) != LEN_MASK) {
         strip[idx] = val + 1;
         return;
     }
 
-    if (idx < STRIP_SZ - 2) {
+    run_cnt_++;
+
+    if (idx < STRIP_SZ - LINK_SLOTS - 1) {
         idxs_[buf_id] = idx + 1;
-        strip[idx + 1] = (d << 16) + 0x0001;
+        strip[idx + 1] = (rel << LEN_BITS) + 0x0001;
         return;
     }
 
     // printf("IntersectionResult::append new strip !!!\n");
 
-    DType *newbuf = (DType *) freelist_;
-    if (newbuf == nullptr)
-        newbuf = allocate_chunk();  // Slow path.
-    else
-        freelist_ = *(void **) freelist_;
+    DType *newbuf = new_strip();
 
     // Save link to the new strip.
-    strip[idx + 1] = -((uint64_t) newbuf >> 3);
+    strip[idx + 1] = -1;
+    memcpy(strip + idx + 2, &newbuf, sizeof(newbuf));
 
     strips_[buf_id] = newbuf;
     idxs_[buf_id] = 0;
-    newbuf[0] = (d << 16) + 0x0001;
+    newbuf[0] = (rel << LEN_BITS) + 0x0001;
 }
 
-template<> inline IntersectionResult<int64_t>::Iterator
-IntersectionResult<int64_t>::get_iter(int buf_id)
+template<typename DType>
+inline void IntersectionResult<DType>::append_varint(int buf_id, int64_t rel)
 {
-    int64_t *ptr;
-
-    ptr = chunks_[0].get() + (buf_id * STRIP_SZ) + 1;
-    int64_t d = *ptr;
-    if (d == 0)
-        return Iterator(nullptr, 0);
-    else
-        return Iterator(ptr, d >> 16);
+    PendingRun &run = pending_[buf_id];
+    const int64_t run_end = run.start + run.len;
+
+    // Same as the last added value?
+    if (run_end == rel + 1) return;
+
+    // Can we extend the current run?  (Initially, it's an empty run at 0.)
+    if (run_end == rel) {
+        run.len++;
+        return;
+    }
+
+    flush_run(buf_id);
+    run.start = rel;
+    run.len = 1;
 }
 
-template<> inline int64_t IntersectionResult<int64_t>::Iterator::get_next()
+template<typename DType>
+inline void IntersectionResult<DType>::flush_run(int buf_id)
 {
-    int64_t retval = next_;
-    int64_t rle_end = (*ptr_ >> 16) + (*ptr_ & 0xffff);
-    if (++next_ < rle_end)
-        return retval;
-
-    int64_t d = *(++ptr_);
-    if (d == 0) {
-        // End of data.
-        ptr_ = nullptr;
+    PendingRun &run = pending_[buf_id];
+    if (run.len == 0) return;
+
+    uint8_t *strip = (uint8_t *) strips_[buf_id];
+    int idx = idxs_[buf_id];
+    if (idx > STRIP_BYTES - VARINT_RESERVE) {
+        // Save link to the new strip.
+        uint8_t *newbuf = (uint8_t *) new_strip();
+        strip[idx] = 0x01;
+        memcpy(strip + idx + 1, &newbuf, sizeof(newbuf));
+
+        strips_[buf_id] = (DType *) newbuf;
+        strip = newbuf;
+        idx = 0;
+    }
+
+    uint64_t v = ((uint64_t) (run.start - run.prev_end + 1) << 1) |
+                 (run.len > 1);
+    uint8_t *p = put_varint(strip + idx, v);
+    if (run.len > 1) p = put_varint(p, run.len - 2);
+    idxs_[buf_id] = p - strip;
+
+    run_cnt_++;
+    elem_cnts_[buf_id] += run.len;
+    run.prev_end = run.start + run.len;
+}
+
+template<typename DType>
+inline void IntersectionResult<DType>::Iterator::read_run()
+{
+    if (varint_) {
+        const uint8_t *p = (const uint8_t *) ptr_;
+        if (*p == 0x00) return;  // End of data.
+        if (*p == 0x01) {
+            // End of current strip: go to the next strip.
+            memcpy(&p, p + 1, sizeof(p));
+        }
+
+        uint64_t v = get_varint(&p);
+        next_ = run_end_ + (int64_t) (v >> 1) - 1;
+        run_end_ = next_ + ((v & 1) ? (int64_t) get_varint(&p) + 2 : 1);
+        ptr_ = p;
     }
     else {
+        const DType *p = (const DType *) ptr_;
+        DType d = *p;
+        if (d == 0) return;  // End of data.
         if (d < 0) {
             // End of current strip: go to the next strip.
-            ptr_ = (int64_t *) ((-d) << 3);
+            memcpy(&p, p + 1, sizeof(p));
+            d = *p;
         }
-        next_ = *ptr_ >> 16;
-    }
 
-    return retval;
+        next_ = base_ + (d >> LEN_BITS);
+        run_end_ = next_ + (d & LEN_MASK);
+        ptr_ = p + 1;
+    }
 }
 
 // A collection of IntersectionResult's for parallel processing: each
@@ -222,7 +438,8 @@ template<typename DType> class IntersectionResultSet {
     // constructor returns.
     IntersectionResultSet(const std::vector<int> &prio_coords,
                           const std::vector<int> &reg_coords,
-                          DType start, DType end, DType batch_size);
+                          int64_t start, int64_t end, int64_t batch_size,
+                          IrEncoding encoding = IrEncoding::RLE);
 
 //  ~IntersectionResultSet() {
 //      printf("******************************************************\n");
@@ -266,19 +483,62 @@ template<typename DType> class IntersectionResultSet {
         size_t ir_idx_;
         typename IntersectionResult<DType>::Iterator iter_;
 
+        // The iterator stops before this element: see set_limit().
+        int64_t limit_ = INT64_MAX;
+
         friend class IntersectionResultSet;
 
         Iterator(int buf_id, const IntersectionResultSet *parent)
             : buf_id_(buf_id), parent_(parent), ir_idx_(0),
-              iter_(nullptr, 0) /* will be filled by get_iter(). */
+              iter_() /* will be filled by get_iter(). */
         { }
 
+        // Go to the next IntersectionResult if the current one is exhausted.
+        inline void next_ir();
+
       public:
-        bool has_next() const { return iter_.has_next(); }
-        inline DType get_next();
-        DType peek() const { return iter_.peek(); }
+        bool has_next() const
+        { return iter_.has_next() && iter_.peek() < limit_; }
+        inline int64_t get_next();
+        int64_t peek() const { return iter_.peek(); }
+
+        // Make the iterator stop before element `limit` (i.e., has_next()
+        // returns false if the next element is `limit` or larger).  Used to
+        // split the elements of a tile into a few ranges that are painted in
+        // parallel (see Plotter::draw_tile_task()).
+        void set_limit(int64_t limit) { limit_ = limit; }
+
+        // Skip the rest of the current run of consecutive elements, and return
+        // the number of elements skipped.  Ignores the limit.
+        inline int64_t skip_run();
     };
 
+    // Return the number of bytes used by all buffers.
+    size_t memory_usage() const {
+        size_t sz = 0;
+        for (const auto &ir : results) sz += ir->memory_usage();
+        return sz;
+    }
+
+    // Return the number of runs and elements in all buffers.
+    int64_t run_cnt() const {
+        int64_t cnt = 0;
+        for (const auto &ir : results) cnt += ir->run_cnt();
+        return cnt;
+    }
+    int64_t elem_cnt() const {
+        int64_t cnt = 0;
+        for (const auto &ir : results) cnt += ir->elem_cnt();
+        return cnt;
+    }
+
+    // Return the number of elements in buffer #k.
+    int64_t elem_cnt(int buf_id) const {
+        int64_t cnt = 0;
+        for (const auto &ir : results) cnt += ir->elem_cnt(buf_id);
+        return cnt;
+    }
+
     Iterator get_iter(int buf_id) const {
         Iterator iter(buf_id, this);
 
@@ -295,18 +555,32 @@ template<typename DType> class IntersectionResultSet {
     }
 };
 
-template<> inline int64_t IntersectionResultSet<int64_t>::Iterator::get_next()
+template<typename DType>
+inline void IntersectionResultSet<DType>::Iterator::next_ir()
 {
-    int64_t retval = iter_.get_next();
     if (!iter_.has_next()) {
         // Try the next iterator.
         for (ir_idx_++; ir_idx_ < parent_->results.size(); ir_idx_++) {
             iter_ = parent_->results[ir_idx_]->get_iter(buf_id_);
-            if (iter_.has_next()) return retval;
+            if (iter_.has_next()) return;
         }
     }
+}
 
+template<typename DType>
+inline int64_t IntersectionResultSet<DType>::Iterator::get_next()
+{
+    int64_t retval = iter_.get_next();
+    next_ir();
     return retval;
 }
 
+template<typename DType>
+inline int64_t IntersectionResultSet<DType>::Iterator::skip_run()
+{
+    int64_t cnt = iter_.skip_run();
+    next_ir();
+    return cnt;
+}
+
 } // namespace croquis
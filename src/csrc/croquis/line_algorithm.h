@@ -7,6 +7,7 @@
 
 #include <algorithm>  // max
 
+#include "croquis/util/cpu_features.h"
 #include "croquis/util/logging.h"  // DBG_LOG1
 
 namespace croquis {
@@ -169,6 +170,153 @@ inline void StraightLineVisitor<F>::visit(
     }
 }
 
+// Given nine points (x[i], y[i]), find which of the eight segments between
+// consecutive points stay inside a single pixel (or tile), even after
+// accounting for the line width (`hw` is half the width).  In that case
+// StraightLineVisitor would visit just that one pixel, so the caller can skip
+// the visitor altogether.
+//
+// Returns a bitmask: if bit #i is set, segment #i (from point #i to #i+1) only
+// touches pixel (px[i], py[i]).  Segments with zero length or non-finite
+// coordinates are never reported.
+//
+// The AVX2 version is in line_algorithm_avx2.cc.
+int find_single_pixel_segments_avx2(const float *x, const float *y, float hw,
+                                    int *px, int *py);
+
+static inline int find_single_pixel_segments(const float *x, const float *y,
+                                             float hw, int *px, int *py)
+{
+#ifdef CROQUIS_ENABLE_AVX2
+    if (util::cpu_features.isa >= util::Isa::AVX2)
+        return find_single_pixel_segments_avx2(x, y, hw, px, py);
+#endif
+
+    int mask = 0;
+    for (int i = 0; i < 8; i++) {
+        const float x0 = x[i], x1 = x[i + 1];
+        const float y0 = y[i], y1 = y[i + 1];
+        if (isnan(x0) || isnan(x1) || isnan(y0) || isnan(y1)) continue;
+        if (x0 == x1 && y0 == y1) continue;  // Zero length.
+
+        // Stays inside one pixel?  (nearbyintf() rounds to even, just like
+        // vroundps.)
+        const float xlo = nearbyintf(std::min(x0, x1) - hw);
+        const float xhi = nearbyintf(std::max(x0, x1) + hw);
+        const float ylo = nearbyintf(std::min(y0, y1) - hw);
+        const float yhi = nearbyintf(std::max(y0, y1) + hw);
+        if (!(fabsf(xlo) < 1e9f && fabsf(ylo) < 1e9f)) continue;
+        if (xlo != xhi || ylo != yhi) continue;
+
+        px[i] = xlo;
+        py[i] = ylo;
+        mask |= (1 << i);
+    }
+
+    return mask;
+}
+
+// Similarly, given eight points (x[i], y[i]), find which of them stay inside a
+// single tile, even after accounting for the marker size (`r` is the radius).
+//
+// Returns a bitmask: if bit #i is set, the marker at point #i only touches
+// tile (px[i], py[i]).  Points with non-finite coordinates are never reported.
+//
+// The AVX2 version is in line_algorithm_avx2.cc.
+int find_single_tile_points_avx2(const float *x, const float *y, float r,
+                                 int *px, int *py);
+
+static inline int find_single_tile_points(const float *x, const float *y,
+                                          float r, int *px, int *py)
+{
+#ifdef CROQUIS_ENABLE_AVX2
+    if (util::cpu_features.isa >= util::Isa::AVX2)
+        return find_single_tile_points_avx2(x, y, r, px, py);
+#endif
+
+    int mask = 0;
+    for (int i = 0; i < 8; i++) {
+        const float xlo = nearbyintf(x[i] - r);
+        const float xhi = nearbyintf(x[i] + r);
+        const float ylo = nearbyintf(y[i] - r);
+        const float yhi = nearbyintf(y[i] + r);
+        if (!(fabsf(xlo) < 1e9f && fabsf(ylo) < 1e9f)) continue;
+        if (xlo != xhi || ylo != yhi) continue;
+
+        px[i] = xlo;
+        py[i] = ylo;
+        mask |= (1 << i);
+    }
+
+    return mask;
+}
+
+// Reduce a polyline of `n` points (x[i], y[i]) with M4 aggregation [1]: if many
+// consecutive points fall into the same pixel column, we only keep the first
+// and the last point in the column, and the ones with the minimum/maximum y,
+// in the original order, so that we draw at most three segments per column.
+//
+// The line still covers the same vertical range in each column and connects
+// the columns the same way, but it is not pixel-identical: within a column,
+// the line may move horizontally by a fraction of a pixel, which changes
+// anti-aliased pixels at the edges.  So paint() only calls this if the user
+// asked for it (see PlotRequest::fast_lines), and we only do this for dense
+// lines (at least M4_MIN_DENSITY points per column on average), where it
+// doesn't matter much and it saves the most.
+//
+// The points are overwritten in place, and the new number of points is
+// returned.  If the line is not dense enough, if the x coordinates are not
+// non-decreasing, or if there's any NaN (which breaks the line), we return `n`
+// without changing anything.
+//
+// [1] Uwe Jugel et al., "M4: A Visualization-Oriented Time Series Data
+//     Aggregation", VLDB 2014.
+static const int M4_MIN_DENSITY = 8;
+
+static inline int decimate_m4(float *x, float *y, int n)
+{
+    if (n < M4_MIN_DENSITY || !(n >= (x[n - 1] - x[0] + 1) * M4_MIN_DENSITY))
+        return n;
+
+    for (int i = 0; i < n; i++) {
+        if (isnan(x[i]) || isnan(y[i])) return n;
+        if (i > 0 && !(x[i - 1] <= x[i])) return n;
+    }
+
+    int out = 0;
+    for (int start = 0; start < n; ) {
+        // Find points [start, end) in the same pixel column, and the ones
+        // with the min/max y.  (Pixels are centered at integer coordinates.)
+        const float col = floorf(x[start] + 0.5f);
+        int end = start + 1;
+        int imin = start, imax = start;
+        while (end < n && floorf(x[end] + 0.5f) == col) {
+            if (y[end] < y[imin]) imin = end;
+            if (y[end] > y[imax]) imax = end;
+            end++;
+        }
+
+        // Emit the points in the original order, without duplicates.  We never
+        // overwrite points we haven't read yet, because `out` <= `start`.
+        const int last = end - 1;
+        const int idxs[4] = {
+            start, std::min(imin, imax), std::max(imin, imax), last,
+        };
+        const float xs[4] = { x[idxs[0]], x[idxs[1]], x[idxs[2]], x[idxs[3]] };
+        const float ys[4] = { y[idxs[0]], y[idxs[1]], y[idxs[2]], y[idxs[3]] };
+        for (int k = 0; k < 4; k++) {
+            if (k > 0 && idxs[k] == idxs[k - 1]) continue;
+            x[out] = xs[k];
+            y[out] = ys[k];
+            out++;
+        }
+
+        start = end;
+    }
+
+    return out;
+}
+
 // Helper function.
 template<typename F>
 StraightLineVisitor<F> create_straight_line_visitor(
@@ -0,0 +1,90 @@
+// AVX2 versions of find_single_pixel_segments() and find_single_tile_points():
+// see line_algorithm.h.
+//
+// This file is compiled with AVX2 flags, and only called if the CPU supports
+// it (see util/cpu_features.h).
+
+#include "croquis/line_algorithm.h"
+
+#include <immintrin.h>
+
+namespace croquis {
+
+int find_single_pixel_segments_avx2(const float *x, const float *y, float hw,
+                                    int *px, int *py)
+{
+    const int ROUND = _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC;
+
+    const __m256 x0 = _mm256_loadu_ps(x);
+    const __m256 x1 = _mm256_loadu_ps(x + 1);
+    const __m256 y0 = _mm256_loadu_ps(y);
+    const __m256 y1 = _mm256_loadu_ps(y + 1);
+    const __m256 hwv = _mm256_set1_ps(hw);
+
+    const __m256 xlo =
+        _mm256_round_ps(_mm256_sub_ps(_mm256_min_ps(x0, x1), hwv), ROUND);
+    const __m256 xhi =
+        _mm256_round_ps(_mm256_add_ps(_mm256_max_ps(x0, x1), hwv), ROUND);
+    const __m256 ylo =
+        _mm256_round_ps(_mm256_sub_ps(_mm256_min_ps(y0, y1), hwv), ROUND);
+    const __m256 yhi =
+        _mm256_round_ps(_mm256_add_ps(_mm256_max_ps(y0, y1), hwv), ROUND);
+
+    // Check that coordinates are not NaN (min/max silently drop them), and
+    // the pixel is within a sane range (which also filters out infinity).
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 limit = _mm256_set1_ps(1e9f);
+    __m256 ok = _mm256_and_ps(_mm256_cmp_ps(x0, x1, _CMP_ORD_Q),
+                              _mm256_cmp_ps(y0, y1, _CMP_ORD_Q));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_and_ps(xlo, abs_mask), limit,
+                                         _CMP_LT_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(_mm256_and_ps(ylo, abs_mask), limit,
+                                         _CMP_LT_OQ));
+
+    // Non-zero length.
+    ok = _mm256_and_ps(ok, _mm256_or_ps(_mm256_cmp_ps(x0, x1, _CMP_NEQ_OQ),
+                                        _mm256_cmp_ps(y0, y1, _CMP_NEQ_OQ)));
+
+    // Stays inside one pixel.
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(xlo, xhi, _CMP_EQ_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(ylo, yhi, _CMP_EQ_OQ));
+
+    _mm256_storeu_si256((__m256i *) px, _mm256_cvtps_epi32(xlo));
+    _mm256_storeu_si256((__m256i *) py, _mm256_cvtps_epi32(ylo));
+
+    return _mm256_movemask_ps(ok);
+}
+
+int find_single_tile_points_avx2(const float *x, const float *y, float r,
+                                 int *px, int *py)
+{
+    const int ROUND = _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC;
+
+    const __m256 xv = _mm256_loadu_ps(x);
+    const __m256 yv = _mm256_loadu_ps(y);
+    const __m256 rv = _mm256_set1_ps(r);
+
+    const __m256 xlo = _mm256_round_ps(_mm256_sub_ps(xv, rv), ROUND);
+    const __m256 xhi = _mm256_round_ps(_mm256_add_ps(xv, rv), ROUND);
+    const __m256 ylo = _mm256_round_ps(_mm256_sub_ps(yv, rv), ROUND);
+    const __m256 yhi = _mm256_round_ps(_mm256_add_ps(yv, rv), ROUND);
+
+    // The comparisons below are false for NaN, and the range check also
+    // filters out infinity.
+    const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 limit = _mm256_set1_ps(1e9f);
+    __m256 ok = _mm256_and_ps(
+        _mm256_cmp_ps(_mm256_and_ps(xlo, abs_mask), limit, _CMP_LT_OQ),
+        _mm256_cmp_ps(_mm256_and_ps(ylo, abs_mask), limit, _CMP_LT_OQ));
+
+    // Stays inside one tile.
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(xlo, xhi, _CMP_EQ_OQ));
+    ok = _mm256_and_ps(ok, _mm256_cmp_ps(ylo, yhi, _CMP_EQ_OQ));
+
+    _mm256_storeu_si256((__m256i *) px, _mm256_cvtps_epi32(xlo));
+    _mm256_storeu_si256((__m256i *) py, _mm256_cvtps_epi32(ylo));
+
+    return _mm256_movemask_ps(ok);
+}
+
+}  // namespace croquis
@@ -0,0 +1,20 @@
+// A multi-resolution "pyramid" of lines.
+
+#include "croquis/line_pyramid.h"
+
+#include <math.h>  // fabs
+
+namespace croquis {
+
+int LinePyramid::select_level(double xscale) const
+{
+    int level = 0;
+    for (size_t l = 0; l < levels_.size(); l++) {
+        if (!(levels_[l].max_span * fabs(xscale) <= MAX_SPAN_PX)) break;
+        level = l + 1;
+    }
+
+    return level;
+}
+
+} // namespace croquis
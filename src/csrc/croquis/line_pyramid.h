@@ -0,0 +1,192 @@
+// A multi-resolution "pyramid" of lines, used to draw lines with many more
+// points than pixels without visiting every point.
+
+#pragma once
+
+#include <math.h>  // isnan
+#include <stdint.h>  // int32_t, int64_t
+
+#include <algorithm>  // max
+#include <utility>  // pair
+#include <vector>
+
+namespace croquis {
+
+// For each line, level #l of the pyramid (l >= 1) divides the points into
+// "buckets" of (4 << l) consecutive points (8, 16, 32, ...), and keeps only
+// the first and last points of each bucket, and the points with the minimum
+// and maximum y coordinate, in the original order - just like decimate_m4()
+// (see line_algorithm.h) does for each pixel column.  Hence each level has
+// about half as many points as the previous one, and the whole pyramid holds
+// about as many indices as the original data has points.  (Level #0 is the
+// original data, which we don't store.)
+//
+// If all points of a bucket fall inside the same pixel column, the reduced
+// line still covers the same vertical range inside the column, and enters and
+// leaves the bucket at the same points.  So, for each level, we remember the
+// largest x-distance between the first and last points of a bucket, and
+// select_level() chooses the coarsest level where it's below MAX_SPAN_PX
+// pixels.  As with decimate_m4(), the result is not pixel-identical (points
+// can move horizontally by a fraction of a pixel), but it's close enough.
+//
+// We only reduce lines whose x coordinates are non-decreasing and don't
+// contain NaN (i.e., time series): other lines are always drawn in full.
+//
+// The pyramid is built once by build() (in a background task: see
+// Plotter::add_figure_data()), and is read-only after that.
+class LinePyramid {
+  public:
+    // Lines shorter than this are not reduced.
+    static const int MIN_PTS_CNT = 16;
+
+    // See above.
+    static constexpr double MAX_SPAN_PX = 0.5;
+
+  private:
+    struct Level {
+        // Indices of the kept points of all lines, concatenated: points of
+        // line #i are pts[starts[i]] ... pts[starts[i + 1] - 1].  Lines that
+        // are not reduced have no points.
+        std::vector<int32_t> pts;
+        std::vector<int64_t> starts;
+
+        // Largest x-distance between the first and last points of a bucket
+        // (in data coordinates).
+        double max_span = 0.0;
+    };
+
+    // levels_[l - 1] holds level #l.  Empty if no line was reduced.
+    std::vector<Level> levels_;
+
+  public:
+    LinePyramid() { }
+
+    // Build the pyramid: `get_pts_cnt(i)` should return the number of points
+    // of line #i, and `get_pt(i, j, &x, &y)` should return the coordinate of
+    // point #j of line #i, for 0 <= i < item_cnt.
+    template<typename F, typename G>
+    void build(int item_cnt, F get_pts_cnt, G get_pt);
+
+    // Return the coarsest level that can be used to draw with the given
+    // transformation (`xscale` is the number of pixels per unit of x), or
+    // zero if we should use the original data.
+    int select_level(double xscale) const;
+
+    // Return the range of kept points of line #i at the given level (>= 1).
+    // If the line was not reduced, returns an empty range: the caller should
+    // use the original data.
+    std::pair<const int32_t *, const int32_t *> get(int level, int i) const {
+        const Level &lvl = levels_[level - 1];
+        const int32_t *p = lvl.pts.data();
+        return { p + lvl.starts[i], p + lvl.starts[i + 1] };
+    }
+};
+
+template<typename F, typename G>
+void LinePyramid::build(int item_cnt, F get_pts_cnt, G get_pt)
+{
+    levels_.clear();
+
+    // Points kept for each bucket of the current level, four per bucket: the
+    // first point, the min/max points (in order), and the last point.  The
+    // same point may appear more than once.
+    std::vector<std::vector<int32_t>> buckets(item_cnt);
+
+    // Helper function: among points b[0] ... b[cnt - 1] of line #i (in order),
+    // append the first point, the min/max points, and the last point to `out`.
+    auto add_bucket = [&](int i, const int32_t *b, int cnt, int32_t *out) {
+        int32_t jmin = b[0], jmax = b[0];
+        double x, ymin, ymax;
+        get_pt(i, b[0], &x, &ymin);
+        ymax = ymin;
+        for (int k = 1; k < cnt; k++) {
+            double y;
+            get_pt(i, b[k], &x, &y);
+            if (y < ymin) { ymin = y; jmin = b[k]; }
+            if (y > ymax) { ymax = y; jmax = b[k]; }
+        }
+        out[0] = b[0];
+        out[1] = std::min(jmin, jmax);
+        out[2] = std::max(jmin, jmax);
+        out[3] = b[cnt - 1];
+    };
+
+    // Find lines to reduce, and build the first level (buckets of 8 points).
+    bool found = false;
+    for (int i = 0; i < item_cnt; i++) {
+        const int pts_cnt = get_pts_cnt(i);
+        if (pts_cnt < MIN_PTS_CNT) continue;
+
+        bool ok = true;
+        double prev_x = -INFINITY;
+        for (int j = 0; j < pts_cnt; j++) {
+            double x, y;
+            get_pt(i, j, &x, &y);
+            if (isnan(x) || isnan(y) || !(prev_x <= x)) {
+                ok = false;
+                break;
+            }
+            prev_x = x;
+        }
+        if (!ok) continue;
+
+        std::vector<int32_t> &b = buckets[i];
+        b.resize(((pts_cnt + 7) / 8) * 4);
+        for (int start = 0; start < pts_cnt; start += 8) {
+            int32_t idxs[8];
+            const int cnt = std::min(8, pts_cnt - start);
+            for (int k = 0; k < cnt; k++) idxs[k] = start + k;
+            add_bucket(i, idxs, cnt, &b[start / 2]);
+        }
+        found = true;
+    }
+    if (!found) return;
+
+    for (int shift = 3; ; shift++) {
+        // Buckets at this level have (1 << shift) points.
+        levels_.emplace_back();
+        Level &lvl = levels_.back();
+        lvl.starts.push_back(0);
+
+        bool more = false;  // True if we need another level.
+        for (int i = 0; i < item_cnt; i++) {
+            const std::vector<int32_t> &b = buckets[i];
+            if (!b.empty()) {
+                // Add the kept points without duplicates.
+                for (size_t k = 0; k < b.size(); k++) {
+                    if (k == 0 || b[k] != b[k - 1]) lvl.pts.push_back(b[k]);
+                }
+
+                // Bucket #k spans from point b[4k] to b[4k + 3].
+                for (size_t k = 0; k < b.size(); k += 4) {
+                    double x0, x1, y;
+                    get_pt(i, b[k], &x0, &y);
+                    get_pt(i, b[k + 3], &x1, &y);
+                    lvl.max_span = std::max(lvl.max_span, x1 - x0);
+                }
+                more = more || (b.size() > 4);
+            }
+            lvl.starts.push_back(lvl.pts.size());
+        }
+
+        if (!more) break;
+
+        // Merge pairs of buckets for the next level.
+        for (int i = 0; i < item_cnt; i++) {
+            std::vector<int32_t> &b = buckets[i];
+            if (b.empty()) continue;
+
+            size_t out = 0;
+            for (size_t k = 0; k < b.size(); k += 8) {
+                const int cnt = std::min<size_t>(8, b.size() - k);
+                int32_t tmp[4];
+                add_bucket(i, &b[k], cnt, tmp);
+                for (int m = 0; m < 4; m++) b[out++] = tmp[m];
+            }
+            b.resize(out);
+            b.shrink_to_fit();
+        }
+    }
+}
+
+} // namespace croquis
@@ -3,23 +3,30 @@
 #include "croquis/plotter.h"
 
 #include <inttypes.h>  // PRId64
+#include <limits.h>  // INT_MAX, INT_MIN
 #include <math.h>  // powf
 #include <stdio.h>  // printf (for debugging)
 
-#include <algorithm>  // min
+#include <algorithm>  // min, upper_bound
+#include <condition_variable>
+#include <memory>  // make_shared
 #include <mutex>
 #include <tuple>  // tie
 
 #include "croquis/constants.h"
+#include "croquis/density_buffer.h"
 #include "croquis/intersection_finder.h"
+#include "croquis/png_util.h"  // make_png_file
 #include "croquis/rgb_buffer.h"
+#include "croquis/strip_arena.h"
 #include "croquis/task.h"  // make_lambda_task
 #include "croquis/thr_manager.h"
 #include "croquis/util/error_helper.h"  // throw_value_error
 #include "croquis/util/logging.h"  // DBG_LOG1
 #include "croquis/util/math.h"
-#include "croquis/util/stl_container_util.h"  // append_str
+#include "croquis/util/stl_container_util.h"  // append, append_str
 #include "croquis/util/string_printf.h"
+#include "croquis/util/thread_local_pool.h"
 
 #define DEBUG_PLOT 0
 
@@ -42,7 +49,67 @@ void Plotter::add_figure_data(const std::unique_lock<std::mutex> &lck,
     next_atom_idx_ += fd->atom_cnt;
 
     range_.merge(fd->range());
+    fd->build_index();
+
+    // Line pyramids are only used for fast lines.  Building them may take a
+    // while, so we do it in the background: until they're all done, we simply
+    // draw the original data.  (Canvas configs created before that keep using
+    // the original data: see `lod_config_ids_`.)
+    //
+    // It uses the lowest priority, so that it doesn't hold up tiles (and the
+    // FIFO tasks that launch them) when the first tiles are requested.
+    if (fast_lines_) {
+        FigureData *fd_ptr = fd.get();
+        ThrManager::enqueue_lambda([this, fd_ptr]() {
+            fd_ptr->build_lod();
+            lod_built_cnt_++;
+        }, Task::SCHD_LIFO_LOW);
+    }
+
     data_.push_back(std::move(fd));
+    fd_item_ends_.push_back(next_item_id_);
+    fd_atom_ends_.push_back(next_atom_idx_);
+}
+
+void Plotter::set_density_mode(bool density_mode)
+{
+    std::unique_lock<std::mutex> lck(m_);
+
+    if (show_called()) {
+        util::throw_value_error(
+            "Density mode cannot be changed after drawing started.");
+    }
+
+    density_mode_ = density_mode;
+}
+
+void Plotter::set_tile_size(int tile_size)
+{
+    std::unique_lock<std::mutex> lck(m_);
+
+    if (show_called()) {
+        util::throw_value_error(
+            "Tile size cannot be changed after drawing started.");
+    }
+
+    if (tile_size != 128 && tile_size != 256 && tile_size != 512) {
+        util::throw_value_error(
+            "Invalid tile size %d: must be 128, 256, or 512.", tile_size);
+    }
+
+    tile_size_ = tile_size;
+}
+
+void Plotter::set_fast_lines(bool fast_lines)
+{
+    std::unique_lock<std::mutex> lck(m_);
+
+    if (show_called()) {
+        util::throw_value_error(
+            "fast_lines cannot be changed after drawing started.");
+    }
+
+    fast_lines_ = fast_lines;
 }
 
 std::pair<bool *, size_t> Plotter::init_selection_map()
@@ -91,8 +158,8 @@ void Plotter::create_canvas_config(
         y1 = fmax(pt0.y, pt1.y);
     }
 
-    int nrows = (height + TILE_SIZE - 1) / TILE_SIZE;
-    int ncols = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int nrows = (height + tile_size_ - 1) / tile_size_;
+    int ncols = (width + tile_size_ - 1) / tile_size_;
 
     // In Python code, Plotter._send_msg() will re-package this inside
     // `canvas_config` and add the axis data.
@@ -108,6 +175,7 @@ void Plotter::create_canvas_config(
         "#zoom_level=0",
         "#x_offset=0",
         "#y_offset=0",
+        "#tile_size=" + std::to_string(tile_size_),
     });
 
     // Canvas config has changed, so we generate *all* tiles in the range.
@@ -120,9 +188,12 @@ void Plotter::create_canvas_config(
         }
     }
 
+    if (fast_lines_ && lod_ready()) lod_config_ids_.insert(new_config_id);
+
     CanvasConfig new_config(new_config_id, width, height, x0, y0, x1, y1);
     launch_tasks(lck,
-                 PlotRequest(sm_->version.load(), new_config, -1 /* item_id */),
+                 PlotRequest(sm_->version.load(), new_config, -1 /* item_id */,
+                             uses_lod(new_config_id), tile_size_, fast_lines_),
                  tile_coords, {});
 }
 
@@ -191,18 +262,30 @@ void Plotter::acknowledge_seqs(const std::vector<int> &seqs)
 //  }
 }
 
-void Plotter::tile_req_handler(const CanvasConfig *canvas, int item_id,
+void Plotter::tile_req_handler(const CanvasConfig *canvas,
+                               int item_id, int item_end,
                                const std::vector<int> &prio_coords,
                                const std::vector<int> &reg_coords)
 {
     DBG_LOG1(DEBUG_PLOT, "tile_req_handler called! "
-             "config_id=%d zoom_level=%d item_id=%d",
-             canvas->id, canvas->zoom_level, item_id);
+             "config_id=%d zoom_level=%d item_id=%d item_end=%d",
+             canvas->id, canvas->zoom_level, item_id, item_end);
 
     std::unique_lock<std::mutex> lck(m_);
 
+    if (item_id == -1) {
+        if (item_end != -1)
+            util::throw_value_error("item_end must be -1 if item_id is -1.");
+    }
+    else if (!(item_id >= 0 && item_id < item_end &&
+               item_end <= next_item_id_)) {
+        util::throw_value_error("Invalid item range [%d, %d).",
+                                item_id, item_end);
+    }
+
     launch_tasks(lck,
-                 PlotRequest(sm_->version.load(), *canvas, item_id),
+                 PlotRequest(sm_->version.load(), *canvas, item_id, item_end,
+                             uses_lod(canvas->id), tile_size_, fast_lines_),
                  prio_coords, reg_coords);
 }
 
@@ -213,18 +296,70 @@ void Plotter::launch_tasks(const std::unique_lock<std::mutex> &lck,
 {
     CHECK(lck.owns_lock());
 
+    // First, draw whatever tiles we can using cached intersection results.
+    std::vector<int> prio_coords1 = prio_coords;
+    std::vector<int> reg_coords1 = reg_coords;
+    for (const IrsCacheEntry &entry : irs_cache_) {
+        if (prio_coords1.empty() && reg_coords1.empty()) return;
+        if (!entry.matches(req)) continue;
+
+        std::vector<int> prio_cached =
+            extract_cached_coords(entry.irs, &prio_coords1);
+        std::vector<int> reg_cached =
+            extract_cached_coords(entry.irs, &reg_coords1);
+        if (!prio_cached.empty() || !reg_cached.empty()) {
+            DBG_LOG1(DEBUG_PLOT, "Found %zu tiles in the cache.",
+                     (prio_cached.size() + reg_cached.size()) / 3);
+            launch_cached_tasks(lck, req, entry.irs, prio_cached, reg_cached);
+        }
+    }
+
     auto ctxt = std::make_unique<TaskCtxt>();
     std::vector<int> prio_coords2 =
-        dedup_inflight_reqs(lck, req, ctxt.get(), prio_coords);
+        dedup_inflight_reqs(lck, req, ctxt.get(), prio_coords1);
     std::vector<int> reg_coords2 =
-        dedup_inflight_reqs(lck, req, ctxt.get(), reg_coords);
+        dedup_inflight_reqs(lck, req, ctxt.get(), reg_coords1);
 
     if (prio_coords2.empty() && reg_coords2.empty()) {
         DBG_LOG1(DEBUG_PLOT, "No task left after deduplication!");
         return;
     }
 
-    // First, decide the number of subtasks to create.
+    for (size_t i = 0; i < prio_coords2.size(); i += 2)
+        util::append(ctxt->tiles, { prio_coords2[i], prio_coords2[i + 1], 1 });
+    for (size_t i = 0; i < reg_coords2.size(); i += 2)
+        util::append(ctxt->tiles, { reg_coords2[i], reg_coords2[i + 1], 0 });
+
+    // Also compute intersections for the rest of the super tile blocks, so
+    // that we can serve nearby tiles from the cache later.
+    int row_min = INT_MAX, row_max = INT_MIN;
+    int col_min = INT_MAX, col_max = INT_MIN;
+    for (size_t i = 0; i < ctxt->tiles.size(); i += 3) {
+        row_min = std::min(row_min, ctxt->tiles[i]);
+        row_max = std::max(row_max, ctxt->tiles[i]);
+        col_min = std::min(col_min, ctxt->tiles[i + 1]);
+        col_max = std::max(col_max, ctxt->tiles[i + 1]);
+    }
+    row_min &= ~(SUPER_TILE - 1);
+    col_min &= ~(SUPER_TILE - 1);
+    row_max |= (SUPER_TILE - 1);
+    col_max |= (SUPER_TILE - 1);
+
+    const int nrows = row_max - row_min + 1;
+    const int ncols = col_max - col_min + 1;
+    std::vector<bool> requested(nrows * ncols, false);
+    for (size_t i = 0; i < ctxt->tiles.size(); i += 3) {
+        requested[(ctxt->tiles[i] - row_min) * ncols +
+                  (ctxt->tiles[i + 1] - col_min)] = true;
+    }
+    for (int row = row_min; row <= row_max; row++) {
+        for (int col = col_min; col <= col_max; col++) {
+            if (!requested[(row - row_min) * ncols + (col - col_min)])
+                util::append(reg_coords2, { row, col });
+        }
+    }
+
+    // Now decide the number of subtasks to create.
     int64_t start_idx, end_idx;
     if (req.item_id == -1) {
         // Draw everything.
@@ -232,7 +367,10 @@ void Plotter::launch_tasks(const std::unique_lock<std::mutex> &lck,
         end_idx = next_atom_idx_;
     }
     else {
-        std::tie(start_idx, end_idx) = get_atom_idxs(req.item_id);
+        // Items are assigned consecutive atom indices, so the range of atoms
+        // is also contiguous.
+        start_idx = get_atom_idxs(req.item_id).first;
+        end_idx = get_atom_idxs(req.item_end - 1).second;
     }
 
     int64_t batch_size =
@@ -240,10 +378,77 @@ void Plotter::launch_tasks(const std::unique_lock<std::mutex> &lck,
                           (end_idx - start_idx) / tmgr_->nthreads),
                  (int64_t) 100000);
 
-    ctxt->irs = std::make_unique<IntersectionResultSet<int64_t>>(
-        prio_coords2, reg_coords2, start_idx, end_idx, batch_size);
+    // Each IntersectionResult stores atom indices relative to the start of its
+    // batch, so we can use the more compact 32-bit version as long as the
+    // batch is small enough, regardless of the total number of atoms.
+    if (batch_size <= IntersectionResult<int32_t>::max_batch_size()) {
+        auto irs = std::make_shared<IntersectionResultSet<int32_t>>(
+            prio_coords2, reg_coords2, start_idx, end_idx, batch_size,
+            irs_encoding_);
+        ctxt->irs.set(irs);
+        launch_intersection_tasks(req, std::move(ctxt), irs.get());
+    }
+    else {
+        auto irs = std::make_shared<IntersectionResultSet<int64_t>>(
+            prio_coords2, reg_coords2, start_idx, end_idx, batch_size,
+            irs_encoding_);
+        ctxt->irs.set(irs);
+        launch_intersection_tasks(req, std::move(ctxt), irs.get());
+    }
+}
+
+std::vector<int> Plotter::extract_cached_coords(const IrsHolder &irs,
+                                                std::vector<int> *coords)
+{
+    std::vector<int> retval, rest;
+    CHECK(coords->size() % 3 == 0);
+
+    irs.visit([&](const auto *irs) {
+        for (size_t i = 0; i < coords->size(); i += 3) {
+            const int *p = coords->data() + i;
+            bool found = (irs->get_buf_id(p[0], p[1]) != -1);
+            util::append(found ? retval : rest, { p[0], p[1], p[2] });
+        }
+    });
+
+    coords->swap(rest);
+    return retval;
+}
+
+void Plotter::launch_cached_tasks(const std::unique_lock<std::mutex> &lck,
+                                  const PlotRequest req, const IrsHolder &irs,
+                                  const std::vector<int> &prio_coords,
+                                  const std::vector<int> &reg_coords)
+{
+    CHECK(lck.owns_lock());
+
+    auto ctxt = std::make_unique<TaskCtxt>();
+    std::vector<int> prio_coords2 =
+        dedup_inflight_reqs(lck, req, ctxt.get(), prio_coords);
+    std::vector<int> reg_coords2 =
+        dedup_inflight_reqs(lck, req, ctxt.get(), reg_coords);
+
+    if (prio_coords2.empty() && reg_coords2.empty()) return;
+
+    for (size_t i = 0; i < prio_coords2.size(); i += 2)
+        util::append(ctxt->tiles, { prio_coords2[i], prio_coords2[i + 1], 1 });
+    for (size_t i = 0; i < reg_coords2.size(); i += 2)
+        util::append(ctxt->tiles, { reg_coords2[i], reg_coords2[i + 1], 0 });
+
+    ctxt->irs = irs;
+    inflight_reqs_++;
+    irs.visit([&](const auto *irs) {
+        launch_tile_tasks(lck, req, std::move(ctxt), irs);
+    });
+}
+
+template<typename DType>
+void Plotter::launch_intersection_tasks(const PlotRequest req,
+                                        std::unique_ptr<TaskCtxt> ctxt,
+                                        const IntersectionResultSet<DType> *irs)
+{
     auto ctxt_ptr = ctxt.get();
-    auto irs_ptr = ctxt->irs.get();
+    inflight_reqs_++;
 
     // We kick off these four kinds of tasks:
     //
@@ -257,15 +462,15 @@ void Plotter::launch_tasks(const std::unique_lock<std::mutex> &lck,
 
     // `tile_launcher` runs after all compute_intersection_task() tasks run.
     auto tile_launcher = make_lambda_task([=, ctxt=std::move(ctxt)]() mutable {
-        tile_launcher_task(req, std::move(ctxt));
+        tile_launcher_task(req, std::move(ctxt), irs);
     });
 
-    for (const auto &ir : irs_ptr->results) {
-        IntersectionResult<int64_t> *ir_ptr = ir.get();
+    for (const auto &ir : irs->results) {
+        IntersectionResult<DType> *ir_ptr = ir.get();
         DBG_LOG1(DEBUG_PLOT, "Enqueueing compute_interaction_task ...");
         ctxt_ptr->intersection_tasks.push_back(
             ThrManager::enqueue_lambda_no_delete(
-                [=]() { compute_intersection_task(req, irs_ptr, ir_ptr); },
+                [=]() { compute_intersection_task(req, irs, ir_ptr); },
                 Task::SCHD_LIFO, tile_launcher.get()
             )
         );
@@ -297,7 +502,7 @@ std::vector<int> Plotter::dedup_inflight_reqs(
         int col = coords[i + 1];
         int seq = coords[i + 2];
         TileKey key(req.sm_version, req.canvas.id, req.canvas.zoom_level,
-                    row, col, req.item_id);
+                    row, col, req.item_id, req.item_end);
         const auto iter = inflight_tiles_.find(key);
 
         // XXX TMP
@@ -352,97 +557,143 @@ std::vector<int> Plotter::dedup_inflight_reqs(
 }
 
 // Runs in the thread pool.
+template<typename DType>
 void Plotter::compute_intersection_task(
-         const PlotRequest req, const IntersectionResultSet<int64_t> *irs,
-         IntersectionResult<int64_t> *result)
+         const PlotRequest req, const IntersectionResultSet<DType> *irs,
+         IntersectionResult<DType> *result)
 {
     const int64_t batch_start = result->start_id;
     const int64_t batch_end = result->end_id;
 
-    // TODO: Use binary search?
-    for (auto &fd : data_) {
-        int64_t fd_start = fd->start_atom_idx;
-        int64_t fd_end = fd->start_atom_idx + fd->atom_cnt;
-        if (batch_start < fd_end && batch_end > fd_start)
-            fd->compute_intersection(req, *sm_, irs, result);
+    for (size_t i = find_fd_by_atom(batch_start); i < data_.size(); i++) {
+        FigureData *fd = data_[i].get();
+        if (fd->start_atom_idx >= batch_end) break;
+        if (fd->atom_cnt > 0)
+            fd->compute_intersection(req, irs, result);
     }
+
+    result->finish();
 }
 
 // Runs in the thread pool.
+template<typename DType>
 void Plotter::tile_launcher_task(const PlotRequest req,
-                                 std::unique_ptr<TaskCtxt> ctxt)
+                                 std::unique_ptr<TaskCtxt> ctxt,
+                                 const IntersectionResultSet<DType> *irs)
 {
     std::unique_lock<std::mutex> lck(m_);
 
     // Reap completed tasks.
     ctxt->intersection_tasks.clear();
 
+    // Choose the encoding for the next request.
+    if (irs->run_cnt() > 0) {
+        bool sparse =
+            irs->elem_cnt() < irs->run_cnt() * VARINT_MAX_AVG_RUN;
+        irs_encoding_ = (sparse) ? IrEncoding::VARINT : IrEncoding::RLE;
+    }
+
+    add_to_irs_cache(lck, req, ctxt->irs);
+    launch_tile_tasks(lck, req, std::move(ctxt), irs);
+}
+
+void Plotter::add_to_irs_cache(const std::unique_lock<std::mutex> &lck,
+                               const PlotRequest req, const IrsHolder &irs)
+{
+    CHECK(lck.owns_lock());
+
+    irs_cache_.emplace_front(req, irs);
+
+    // Drop old entries, if necessary.
+    size_t total_bytes = 0;
+    int cnt = 0;
+    for (auto iter = irs_cache_.begin(); iter != irs_cache_.end(); ) {
+        iter->irs.visit([&](const auto *irs) {
+            total_bytes += irs->memory_usage();
+        });
+
+        if (++cnt > 1 &&
+            (cnt > IRS_CACHE_SIZE || total_bytes > IRS_CACHE_MAX_BYTES))
+            iter = irs_cache_.erase(iter);
+        else
+            ++iter;
+    }
+}
+
+template<typename DType>
+void Plotter::launch_tile_tasks(const std::unique_lock<std::mutex> &lck,
+                                const PlotRequest req,
+                                std::unique_ptr<TaskCtxt> ctxt,
+                                const IntersectionResultSet<DType> *irs)
+{
+    CHECK(lck.owns_lock());
+
+    // `cleanup_task` keeps `ctxt` (and hence `irs`) alive until all tiles are
+    // drawn.
     auto ctxt_ptr = ctxt.get();
-    auto irs_ptr = ctxt->irs.get();
-    auto cleanup_task = make_lambda_task([ctxt=std::move(ctxt)]() mutable {
-        DBG_LOG1(DEBUG_PLOT, "CLEANUP TASK called!!! ctxt = %p", ctxt.get());
-        ctxt.reset();
-    });
+    //
+    // If it was the last request in flight, we also let StripArena free its
+    // unused chunks, as we may stay idle for a long time.
+    auto cleanup_task =
+        make_lambda_task([this, ctxt=std::move(ctxt)]() mutable {
+            DBG_LOG1(DEBUG_PLOT, "CLEANUP TASK called!!! ctxt = %p",
+                     ctxt.get());
+            ctxt.reset();
+            if (--inflight_reqs_ == 0) StripArena::trim();
+        });
 
     // Create and send back the requested tiles.
-    int row_start = irs_ptr->row_start();
-    int col_start = irs_ptr->col_start();
-    int nrows = irs_ptr->nrows();
-    int ncols = irs_ptr->ncols();
-    for (int row = row_start; row < row_start + nrows; row++) {
-        for (int col = col_start; col < col_start + ncols; col++) {
-            int buf_id = irs_ptr->get_buf_id(row, col);
-            bool is_prio = irs_ptr->is_priority(row, col);
-
-            if (buf_id == -1) continue;
-
-            TileKey key(req.sm_version, req.canvas.id, req.canvas.zoom_level,
-                        row, col, req.item_id);
-            DBG_LOG1(DEBUG_PLOT, ">>> Enqueueing tile task for %s (%s) ...",
-                     key.debugString().c_str(), (is_prio) ? "prio" : "reg");
-            auto iter = inflight_tiles_.find(key);
-            CHECK(iter != inflight_tiles_.end());
-            InflightTileInfo &info = iter->second;
-            CHECK(info.task_ctxt == ctxt_ptr && info.tile_task == nullptr);
-
-            info.task_ctxt = nullptr;
-            info.tile_task = ThrManager::enqueue_lambda_no_delete(
-                [=]() { draw_tile_task(req, irs_ptr, row, col); },
-                (is_prio) ? Task::SCHD_LIFO : Task::SCHD_LIFO_LOW,
-                cleanup_task.get()
-            );
-        }
+    const std::vector<int> &tiles = ctxt_ptr->tiles;
+    for (size_t i = 0; i < tiles.size(); i += 3) {
+        const int row = tiles[i];
+        const int col = tiles[i + 1];
+        const bool is_prio = tiles[i + 2];
+        CHECK(irs->get_buf_id(row, col) != -1);
+
+        TileKey key(req.sm_version, req.canvas.id, req.canvas.zoom_level,
+                    row, col, req.item_id, req.item_end);
+        DBG_LOG1(DEBUG_PLOT, ">>> Enqueueing tile task for %s (%s) ...",
+                 key.debugString().c_str(), (is_prio) ? "prio" : "reg");
+        auto iter = inflight_tiles_.find(key);
+        CHECK(iter != inflight_tiles_.end());
+        InflightTileInfo &info = iter->second;
+        CHECK(info.task_ctxt == ctxt_ptr && info.tile_task == nullptr);
+
+        info.task_ctxt = nullptr;
+        info.tile_task = ThrManager::enqueue_lambda_no_delete(
+            [=]() { draw_tile_task(req, irs, row, col); },
+            (is_prio) ? Task::SCHD_LIFO : Task::SCHD_LIFO_LOW,
+            cleanup_task.get()
+        );
     }
 
     ThrManager::enqueue(std::move(cleanup_task));
 }
 
+template<typename DType>
 void Plotter::draw_tile_task(const PlotRequest req,
-                             const IntersectionResultSet<int64_t> *irs,
+                             const IntersectionResultSet<DType> *irs,
                              int row, int col)
 {
     const int buf_id = irs->get_buf_id(row, col);
     auto iter = irs->get_iter(buf_id);
 
-    // Might be too big to allocate on stack.
-    std::unique_ptr<ColoredBufferBase> tile;
-    if (req.is_highlight())
-        tile = std::make_unique<RgbaBuffer>();
-    else
-        tile = std::make_unique<RgbBuffer>(0xffffff);  // white
-
-    for (auto &fd : data_) {
-        if (!iter.has_next()) break;
+    TileBufPtr tile = new_tile_buffer(req, false);
 
-        int64_t next_idx = iter.peek();
-        int64_t fd_end = fd->start_atom_idx + fd->atom_cnt;
-        if (next_idx < fd_end)
-            iter = fd->paint(tile.get(), req, iter, row, col);
-    }
+    // If a tile has most of the data (e.g., a dense band of lines in the
+    // middle of the canvas), painting it would take much longer than other
+    // tiles: so let other threads help.
+    auto jobs = split_tile_atoms(iter, irs->elem_cnt(buf_id));
+    if (jobs.size() == 1)
+        paint_atoms(req, tile.get(), iter, row, col);
+    else
+        paint_atoms_parallel(req, tile.get(), jobs, row, col);
 
-    // Create the buffer for PNG file generation.
-    std::unique_ptr<UniqueMessageData> png_data =
-        tile->make_png_data(util::string_printf("tile-r%d-c%d", row, col));
+    // Create the PNG file.  Compression is relatively expensive, so we do it
+    // here (in parallel with other tiles) rather than in Python.
+    std::unique_ptr<UniqueMessageData> png_data = make_png_file(
+        *tile->make_png_data(util::string_printf("tile-r%d-c%d", row, col)),
+        req.tile_size, req.is_highlight());
 
     std::unique_ptr<UniqueMessageData> hovermap_data;
     if (!req.is_highlight()) {
@@ -456,7 +707,7 @@ void Plotter::draw_tile_task(const PlotRequest req,
         seqs.swap(orphaned_seqs_);
 
         TileKey key(req.sm_version, req.canvas.id, req.canvas.zoom_level,
-                    row, col, req.item_id);
+                    row, col, req.item_id, req.item_end);
         InflightTileInfo &info = inflight_tiles_.at(key);
         seqs.push_back(info.seq_no);
 
@@ -487,21 +738,186 @@ void Plotter::draw_tile_task(const PlotRequest req,
 
     if (req.is_highlight())
         dict.push_back("#item_id=" + std::to_string(req.item_id));
+    if (req.is_group_highlight())
+        dict.push_back("#item_end=" + std::to_string(req.item_end));
 
     tmgr_->send_msg(this, dict, std::move(png_data), std::move(hovermap_data));
 }
 
-std::pair<int64_t, int64_t> Plotter::get_atom_idxs(int item_id)
+Plotter::TileBufPtr Plotter::new_tile_buffer(const PlotRequest &req,
+                                             bool is_layer)
+{
+    // Might be too big to allocate on stack, and expensive to initialize: so
+    // we reuse buffers of previous tiles drawn by this thread.
+    using util::ThreadLocalPool;
+    const int ts = req.tile_size;
+    if (req.is_highlight())
+        return ThreadLocalPool<RgbaBuffer>::acquire<ColoredBufferBase>(ts);
+    if (density_mode_)
+        return ThreadLocalPool<DensityBuffer>::acquire<ColoredBufferBase>(ts);
+    if (is_layer)
+        return ThreadLocalPool<LayerBuffer>::acquire<ColoredBufferBase>(ts);
+
+    return ThreadLocalPool<RgbBuffer>::acquire<ColoredBufferBase>(
+               0xffffff /* white */, ts);
+}
+
+template<typename IrsIter>
+void Plotter::paint_atoms(const PlotRequest &req, ColoredBufferBase *tile,
+                          IrsIter iter, int row, int col)
 {
-    // TODO: Use binary search?
-    for (auto &fd : data_) {
-        int next_start = fd->start_item_id + fd->item_cnt;
-        if (item_id < next_start) return fd->get_atom_idxs(item_id);
+    // Each call to paint() consumes all atoms belonging to that FigureData.
+    while (iter.has_next()) {
+        size_t idx = find_fd_by_atom(iter.peek());
+        CHECK(idx < data_.size());
+        iter = data_[idx]->paint(tile, req, *sm_, iter, row, col);
     }
+}
+
+template<typename IrsIter>
+std::vector<IrsIter> Plotter::split_tile_atoms(const IrsIter &iter,
+                                               int64_t cnt)
+{
+    std::vector<IrsIter> retval{iter};
+    if (tmgr_->nthreads == 1) return retval;
+
+    const int64_t job_cnt =
+        std::min((int64_t) tmgr_->nthreads, cnt / PAINT_JOB_ATOMS);
+    if (job_cnt <= 1) return retval;
+
+    // Only split where a new item starts: otherwise, the item would be merged
+    // twice, and pixels drawn by both parts would look different.  For
+    // simplicity, we only check at the start of each run.
+    int64_t sum = 0;
+    int64_t prev_end = -1;  // End of the previous run.
+    for (IrsIter it = iter; it.has_next(); ) {
+        const int64_t atom_idx = it.peek();
+        if (sum >= cnt * (int64_t) retval.size() / job_cnt &&
+            get_item_start_atom(atom_idx) >= prev_end) {
+            retval.back().set_limit(atom_idx);
+            retval.push_back(it);
+        }
+
+        const int64_t len = it.skip_run();
+        sum += len;
+        prev_end = atom_idx + len;
+    }
+
+    DBG_LOG1(DEBUG_PLOT, "Splitting tile with %" PRId64 " atoms into %d jobs",
+             cnt, (int) retval.size());
+    return retval;
+}
+
+// We enqueue a helper task for each job except the first one, which we paint
+// directly on `tile`.  Then we go over the remaining jobs in order, and compose
+// each layer on `tile`: if a helper has not started yet, we paint its layer
+// ourselves, so that we never wait for a task that may be stuck in the queue.
+//
+// Composing a layer may round differently from painting directly on `tile`
+// (see ColoredBufferBase::compose()), so every job except the first is always
+// painted on a layer, no matter which thread paints it: that way, the result
+// doesn't depend on timing.
+template<typename IrsIter>
+void Plotter::paint_atoms_parallel(const PlotRequest &req,
+                                   ColoredBufferBase *tile,
+                                   const std::vector<IrsIter> &jobs,
+                                   int row, int col)
+{
+    enum { WAITING = 0, RUNNING = 1, DONE = 2 };
+
+    // Shared with helper tasks, which may run after we return (in which case
+    // they find that the job is already done, and do nothing).
+    struct JobState {
+        std::mutex m;
+        std::condition_variable cv;
+        std::vector<int> status;
+        std::vector<TileBufPtr> layers;
+    };
+    auto st = std::make_shared<JobState>();
+    st->status.resize(jobs.size(), WAITING);
+    for (size_t k = 0; k < jobs.size(); k++)
+        st->layers.emplace_back(nullptr, nullptr);
+
+    for (size_t k = 1; k < jobs.size(); k++) {
+        const IrsIter iter = jobs[k];
+        ThrManager::enqueue_lambda([this, st, req, iter, k, row, col]() {
+            {
+                std::unique_lock<std::mutex> lck(st->m);
+                if (st->status[k] != WAITING) return;
+                st->status[k] = RUNNING;
+            }
+
+            TileBufPtr layer = new_tile_buffer(req, true);
+            paint_atoms(req, layer.get(), iter, row, col);
+
+            std::unique_lock<std::mutex> lck(st->m);
+            st->layers[k] = std::move(layer);
+            st->status[k] = DONE;
+            st->cv.notify_all();
+        });
+    }
+
+    paint_atoms(req, tile, jobs[0], row, col);
+
+    for (size_t k = 1; k < jobs.size(); k++) {
+        TileBufPtr layer(nullptr, nullptr);
+        std::unique_lock<std::mutex> lck(st->m);
+        if (st->status[k] == WAITING) {
+            st->status[k] = DONE;
+            lck.unlock();
+            layer = new_tile_buffer(req, true);
+            paint_atoms(req, layer.get(), jobs[k], row, col);
+        }
+        else {
+            st->cv.wait(lck, [&]() { return st->status[k] == DONE; });
+            layer = std::move(st->layers[k]);
+            lck.unlock();
+        }
+
+        tile->compose(*layer);
+    }
+}
+
+std::pair<int64_t, int64_t> Plotter::get_atom_idxs(int item_id)
+{
+    size_t idx = find_fd_by_item(item_id);
+    if (idx < data_.size()) return data_[idx]->get_atom_idxs(item_id);
 
     DIE_MSG("Invalid item_id - shouldn't come here !!");
 }
 
+int64_t Plotter::get_item_start_atom(int64_t atom_idx)
+{
+    size_t idx = find_fd_by_atom(atom_idx);
+    CHECK(idx < data_.size());
+    FigureData *fd = data_[idx].get();
+
+    // Find the last item that starts at or before `atom_idx`.
+    int lo = fd->start_item_id;
+    int hi = fd->start_item_id + fd->item_cnt - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (fd->get_atom_idxs(mid).first <= atom_idx)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    return fd->get_atom_idxs(lo).first;
+}
+
+size_t Plotter::find_fd_by_item(int item_id) const
+{
+    return std::upper_bound(fd_item_ends_.begin(), fd_item_ends_.end(),
+                            item_id) - fd_item_ends_.begin();
+}
+
+size_t Plotter::find_fd_by_atom(int64_t atom_idx) const
+{
+    return std::upper_bound(fd_atom_ends_.begin(), fd_atom_ends_.end(),
+                            atom_idx) - fd_atom_ends_.begin();
+}
+
 void Plotter::set_error(const std::string &msg)
 {
     if (msg.empty())
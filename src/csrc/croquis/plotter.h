@@ -2,16 +2,19 @@
 
 #pragma once
 
+#include <atomic>
 #include <list>
 #include <memory>  // unique_ptr
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>  // pair
 #include <vector>
 
 #include "croquis/buffer.h"
 #include "croquis/canvas.h"
+#include "croquis/constants.h"  // TILE_SIZE
 #include "croquis/figure_data.h"
 #include "croquis/util/macros.h"  // DISALLOW_COPY_AND_MOVE
 #include "croquis/util/optional.h"  // optional
@@ -36,6 +39,11 @@ class Plotter {
 
     std::vector<std::unique_ptr<FigureData>> data_;
 
+    // End (exclusive) of the item IDs and atom indices of each element of
+    // `data_`, for binary search.
+    std::vector<int> fd_item_ends_;
+    std::vector<int64_t> fd_atom_ends_;
+
     // During the data building: the next item ID and atom_idx.
     // After that: the number of items and atoms.
     int next_item_id_ = 0;
@@ -53,19 +61,131 @@ class Plotter {
     optional<SelectionMap> sm_;
     bool show_called() const { return bool(sm_); }
 
+    // Number of FigureData whose line pyramid is built (see
+    // FigureData::build_lod()): once it reaches data_.size(), requests can use
+    // reduced lines.  Pyramids are only built if `fast_lines_` is set.
+    std::atomic<int> lod_built_cnt_{0};
+    bool lod_ready() const
+    { return (size_t) lod_built_cnt_.load() == data_.size(); }
+
+    // Canvas configs whose tiles use reduced lines.  Reduced lines are not
+    // pixel-identical to the original data, so they are only used if
+    // `fast_lines_` is set, and we decide once, when the config is created
+    // (see create_canvas_config()): otherwise, tiles of the same view may be
+    // drawn differently before and after the pyramids are ready, and adjacent
+    // tiles would not match at the edges.
+    std::unordered_set<int> lod_config_ids_;
+    bool uses_lod(int config_id) const
+    { return lod_config_ids_.count(config_id) > 0; }
+
+    // Number of requests (TaskCtxt) whose tiles are not drawn yet: when it
+    // drops to zero, we return the free chunks of StripArena to the system.
+    std::atomic<int> inflight_reqs_{0};
+
+    // If true, regular tiles show the density of lines (using DensityBuffer)
+    // instead of individual lines.  Set before Plotter.show() is called.
+    bool density_mode_ = false;
+
+    // Width and height of each tile in pixels: one of 128, 256 (default), or
+    // 512.  Set before Plotter.show() is called.
+    int tile_size_ = TILE_SIZE;
+
+    // If true, dense lines are reduced with decimate_m4() before painting (see
+    // PlotRequest::fast_lines), and may be drawn with line pyramids (see
+    // `lod_config_ids_`).  Set before Plotter.show() is called.
+    bool fast_lines_ = false;
+
     // Sequence number for the tiles sent back to FE.
     int tile_seq_no_ = 0;
 
     // Largest sequence number "acknowledged" by FE.
     int ack_seq_ = -1;
 
+    // Holds either a 32-bit or 64-bit IntersectionResultSet, depending on the
+    // batch size: see launch_tasks().  It may be shared between a TaskCtxt and
+    // `irs_cache_`.
+    struct IrsHolder {
+        std::shared_ptr<IntersectionResultSet<int32_t>> irs32;
+        std::shared_ptr<IntersectionResultSet<int64_t>> irs64;
+
+        void set(std::shared_ptr<IntersectionResultSet<int32_t>> irs)
+        { irs32 = std::move(irs); }
+        void set(std::shared_ptr<IntersectionResultSet<int64_t>> irs)
+        { irs64 = std::move(irs); }
+
+        // Call fn(irs) with whichever one we have.
+        template<typename F> void visit(F fn) const {
+            if (irs32) fn(irs32.get()); else fn(irs64.get());
+        }
+    };
+
     // Helper class to keep data that belong to one FE request in a single
     // place.  We own the intersection tasks.
     struct TaskCtxt {
         std::vector<std::unique_ptr<Task>> intersection_tasks;
-        std::unique_ptr<IntersectionResultSet<int64_t>> irs;
+
+        // Tiles to draw for this request: (row, col, is_prio) triples.
+        // `irs` may contain more tiles than requested.
+        std::vector<int> tiles;
+
+        IrsHolder irs;
     };
 
+    // Intersection results of recent requests, so that we can draw more tiles
+    // with the same configuration (e.g., while the user is panning, or after
+    // the selection has changed) without scanning the data again.  To make it
+    // more useful, we compute intersections for all tiles in the "super tile"
+    // blocks (SUPER_TILE * SUPER_TILE tiles) touched by the request.
+    //
+    // Intersection results do not depend on SelectionMap (unselected items are
+    // skipped when we paint), so `sm_version` is not part of the key.  On the
+    // other hand, results computed without line pyramids cannot be painted
+    // with them (and vice versa), so `use_lod` is.
+    //
+    // Entries are added when the intersection is complete, and the most recent
+    // one comes first.  We keep at most IRS_CACHE_SIZE entries, and drop old
+    // entries if they use more than IRS_CACHE_MAX_BYTES.
+    struct IrsCacheEntry {
+        int config_id;
+        int zoom_level;
+        int item_id;
+        int item_end;
+        bool use_lod;
+        IrsHolder irs;
+
+        IrsCacheEntry(const PlotRequest &req, const IrsHolder &irs)
+            : config_id(req.canvas.id), zoom_level(req.canvas.zoom_level),
+              item_id(req.item_id), item_end(req.item_end),
+              use_lod(req.use_lod), irs(irs) { }
+
+        bool matches(const PlotRequest &req) const {
+            return config_id == req.canvas.id &&
+                   zoom_level == req.canvas.zoom_level &&
+                   item_id == req.item_id && item_end == req.item_end &&
+                   use_lod == req.use_lod;
+        }
+    };
+
+    static const int SUPER_TILE = 4;
+    static const int IRS_CACHE_SIZE = 8;
+    static const size_t IRS_CACHE_MAX_BYTES = 256 << 20;  // = 256 MB
+    std::list<IrsCacheEntry> irs_cache_;
+
+    // Encoding to use for the next IntersectionResultSet.  If the last one had
+    // short runs on average (i.e., tiles contain scattered atoms, as in noisy
+    // data), IrEncoding::VARINT uses much less memory.
+    static const int VARINT_MAX_AVG_RUN = 4;
+    IrEncoding irs_encoding_ = IrEncoding::RLE;
+
+    // A tile with at least (PAINT_JOB_ATOMS * 2) atoms is painted by multiple
+    // threads, each painting about PAINT_JOB_ATOMS atoms or more: see
+    // draw_tile_task().
+    static const int PAINT_JOB_ATOMS = 100000;
+
+    // A tile (or a layer of a tile) taken from util::ThreadLocalPool.
+    typedef std::unique_ptr<ColoredBufferBase, void (*)(ColoredBufferBase *)>
+            TileBufPtr;
+
     // Exactly one of `task_data` and `task` is non-NULL.
     // - If intersections are being computed: (task_data != nullptr).
     // - If the corresponding tile is being generated: (tile_task != nullptr).
@@ -136,6 +256,22 @@ class Plotter {
              bool is_zoom, float px0, float py0, float px1, float py1);
 
   public:
+    // Switch between the regular mode and the density mode: must be called
+    // before drawing starts.
+    void set_density_mode(bool density_mode);
+
+    // Set the size of tiles: larger tiles mean fewer tiles to draw and send
+    // (e.g., on high resolution displays), and smaller tiles can be drawn
+    // faster.  Must be called before drawing starts.
+    void set_tile_size(int tile_size);
+
+    // If true, draw dense lines faster by only keeping a few points per pixel
+    // column (see decimate_m4()) and using line pyramids (see LinePyramid), at
+    // the cost of slightly different anti-aliasing.  Line pyramids are only
+    // built for figure data added after this is set, so it should be called
+    // before add_figure_data().  Must be called before drawing starts.
+    void set_fast_lines(bool fast_lines);
+
     std::pair<bool *, size_t> init_selection_map();
 
     // Start/stop update of SelectionMap.
@@ -148,19 +284,22 @@ class Plotter {
 
     // Handle FE request for tiles for the given ID.
     //
-    // If `item_id` is -1, then FE is requesting regular (non-highlight) tiles.
-    // Otherwise, FE is requesting highlight tiles.
+    // If `item_id` is -1, then FE is requesting regular (non-highlight) tiles,
+    // and `item_end` must also be -1.  Otherwise, FE is requesting highlight
+    // tiles for items [item_id, item_end): if there's more than one item, only
+    // selected items are drawn (see PlotRequest::is_group_highlight()).
     //
     // For regular tiles, the Python handler also ensures that this function is
     // called after `sm_version` reaches the requested version, so C++ code does
     // not need to check the requested version.
     //
     // FE request message may contain multiple items: the Python handler calls
-    // this function once for each line.
+    // this function once for each item in the message.
     //
     // `prio_coords` and `reg_coords` are vectors of length multiple of 3, made
     // of coordinates (tile row, tile col, seq_no).
-    void tile_req_handler(const CanvasConfig *canvas, int item_id,
+    void tile_req_handler(const CanvasConfig *canvas,
+                          int item_id, int item_end,
                           const std::vector<int> &prio_coords,
                           const std::vector<int> &reg_coords);
 
@@ -179,20 +318,88 @@ class Plotter {
                          const PlotRequest req, TaskCtxt *ctxt,
                          const std::vector<int> &coords);
 
+    // Helper function for launch_tasks(): move coordinates (row, col, seq_no)
+    // covered by `irs` from `coords` to the returned vector.
+    static std::vector<int> extract_cached_coords(const IrsHolder &irs,
+                                                  std::vector<int> *coords);
+
+    // Helper function for launch_tasks(): draw the given tiles using cached
+    // intersection results.  Must be called with mutex held.
+    void launch_cached_tasks(const std::unique_lock<std::mutex> &lck,
+                             const PlotRequest req, const IrsHolder &irs,
+                             const std::vector<int> &prio_coords,
+                             const std::vector<int> &reg_coords);
+
+    // Helper function for launch_tasks(): enqueue intersection tasks for each
+    // batch of `irs` (which is owned by `ctxt`).
+    template<typename DType>
+    void launch_intersection_tasks(const PlotRequest req,
+                                   std::unique_ptr<TaskCtxt> ctxt,
+                                   const IntersectionResultSet<DType> *irs);
+
+    // Add the intersection result to `irs_cache_`.
+    // Must be called with mutex held.
+    void add_to_irs_cache(const std::unique_lock<std::mutex> &lck,
+                          const PlotRequest req, const IrsHolder &irs);
+
+    // Enqueue draw_tile_task() for each tile in `ctxt->tiles`, and the cleanup
+    // task.  Must be called with mutex held.
+    template<typename DType>
+    void launch_tile_tasks(const std::unique_lock<std::mutex> &lck,
+                           const PlotRequest req,
+                           std::unique_ptr<TaskCtxt> ctxt,
+                           const IntersectionResultSet<DType> *irs);
+
+    template<typename DType>
     void compute_intersection_task(
-             const PlotRequest req, const IntersectionResultSet<int64_t> *irs,
-             IntersectionResult<int64_t> *result);
+             const PlotRequest req, const IntersectionResultSet<DType> *irs,
+             IntersectionResult<DType> *result);
 
+    template<typename DType>
     void tile_launcher_task(const PlotRequest req,
-                            std::unique_ptr<TaskCtxt> ctxt);
+                            std::unique_ptr<TaskCtxt> ctxt,
+                            const IntersectionResultSet<DType> *irs);
 
+    template<typename DType>
     void draw_tile_task(const PlotRequest req,
-                        const IntersectionResultSet<int64_t> *irs,
+                        const IntersectionResultSet<DType> *irs,
                         int row, int col);
 
+    // Helper functions for draw_tile_task().
+
+    // Get an empty buffer for drawing a tile for `req`: if `is_layer` is true,
+    // the buffer is used as a layer (see ColoredBufferBase::compose()).
+    TileBufPtr new_tile_buffer(const PlotRequest &req, bool is_layer);
+
+    // Paint all atoms of `iter` on `tile`.
+    template<typename IrsIter>
+    void paint_atoms(const PlotRequest &req, ColoredBufferBase *tile,
+                     IrsIter iter, int row, int col);
+
+    // If the tile has too many atoms (`cnt`, as counted by
+    // IntersectionResultSet::elem_cnt()), split them into a few ranges of
+    // similar sizes.  Returns iterators for each range (or just `iter` if we
+    // don't need to split).
+    template<typename IrsIter>
+    std::vector<IrsIter> split_tile_atoms(const IrsIter &iter, int64_t cnt);
+
+    // Paint ranges of atoms given by split_tile_atoms() in parallel.
+    template<typename IrsIter>
+    void paint_atoms_parallel(const PlotRequest &req, ColoredBufferBase *tile,
+                              const std::vector<IrsIter> &jobs,
+                              int row, int col);
+
     // Helper function to find atom indices.
     std::pair<int64_t, int64_t> get_atom_idxs(int item_id);
 
+    // Find the first atom of the item that contains the given atom.
+    int64_t get_item_start_atom(int64_t atom_idx);
+
+    // Helper functions to find the index (in `data_`) of the FigureData that
+    // contains the given item or atom, or data_.size() if there's none.
+    size_t find_fd_by_item(int item_id) const;
+    size_t find_fd_by_atom(int64_t atom_idx) const;
+
     // TODO: Do we need this?
     void set_error(const std::string &msg);
 
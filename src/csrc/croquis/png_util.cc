@@ -0,0 +1,101 @@
+// Utility function for creating PNG files.
+//
+// Since we only generate exactly one kind of PNG, we take a number of shortcuts
+// to make it easier for us: see also RgbBuffer::make_png_data().
+
+#include "croquis/png_util.h"
+
+#include <stdint.h>  // uint8_t, uint32_t
+#include <string.h>  // memcpy
+
+#include <vector>
+
+#include <zlib.h>
+
+#include "croquis/util/macros.h"  // CHECK
+
+namespace croquis {
+
+static const uint8_t PNG_SIGNATURE[8] = {
+    0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a,
+};
+
+// The IEND chunk (which is always the same).
+static const uint8_t PNG_FOOTER[12] = {
+    0x00, 0x00, 0x00, 0x00, 0x49, 0x45, 0x4e, 0x44, 0xae, 0x42, 0x60, 0x82,
+};
+
+// Size of the IHDR chunk: length (4) + "IHDR" (4) + data (13) + CRC (4).
+static const int IHDR_CHUNK_SIZE = 25;
+
+// Write a 32-bit big-endian integer.
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+// Write a chunk header (length and type) followed by `data`, and then the CRC
+// (which covers the type and the data).
+static uint8_t *put_chunk(uint8_t *p, const char *type,
+                          const uint8_t *data, size_t len)
+{
+    p = put_u32(p, len);
+    memcpy(p, type, 4);
+    memcpy(p + 4, data, len);
+
+    uint32_t crc = crc32(0, p, 4 + len);
+    return put_u32(p + 4 + len, crc);
+}
+
+std::unique_ptr<UniqueMessageData>
+make_png_file(const MessageData &image_data, int tile_size, bool has_alpha)
+{
+    const int channels = has_alpha ? 4 : 3;
+    CHECK(image_data.size() == (size_t) tile_size * (tile_size * channels + 1));
+
+    // Compress into a scratch buffer first, because we don't know the exact
+    // size until we're done.  The buffer is reused by the same thread for the
+    // next tile.
+    //
+    // We use the default compression level (same as Python's zlib.compress(),
+    // which we used before).
+    static thread_local std::vector<uint8_t> scratch;
+    uLongf compressed_len = compressBound(image_data.size());
+    if (scratch.size() < compressed_len) scratch.resize(compressed_len);
+
+    int retval = compress2(scratch.data(), &compressed_len,
+                           (const Bytef *) image_data.get(), image_data.size(),
+                           Z_DEFAULT_COMPRESSION);
+    CHECK(retval == Z_OK);
+
+    const size_t sz = sizeof(PNG_SIGNATURE) + IHDR_CHUNK_SIZE +
+                      12 + compressed_len + sizeof(PNG_FOOTER);
+    auto msg = std::make_unique<UniqueMessageData>(image_data.name, sz);
+    uint8_t * const start = (uint8_t *) msg->get();
+    uint8_t *p = start;
+
+    memcpy(p, PNG_SIGNATURE, sizeof(PNG_SIGNATURE));
+    p += sizeof(PNG_SIGNATURE);
+
+    uint8_t ihdr[13];
+    put_u32(ihdr, tile_size);  // Width.
+    put_u32(ihdr + 4, tile_size);  // Height.
+    ihdr[8] = 8;  // Bit depth.
+    ihdr[9] = has_alpha ? 6 : 2;  // Color type: 8-bit RGBA or RGB.
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;  // No interlacing.
+    p = put_chunk(p, "IHDR", ihdr, sizeof(ihdr));
+
+    p = put_chunk(p, "IDAT", scratch.data(), compressed_len);
+
+    memcpy(p, PNG_FOOTER, sizeof(PNG_FOOTER));
+    p += sizeof(PNG_FOOTER);
+    CHECK(p == start + sz);
+
+    return msg;
+}
+
+}  // namespace croquis
@@ -0,0 +1,22 @@
+// Utility function for creating PNG files.
+
+#pragma once
+
+#include <memory>  // unique_ptr
+
+#include "croquis/message.h"  // MessageData, UniqueMessageData
+
+namespace croquis {
+
+// Compress the image data created by RgbBuffer::make_png_data() (or
+// RgbaBuffer/DensityBuffer) and wrap it into a complete PNG file: the image
+// must be a square tile (`tile_size` x `tile_size`), 8-bit RGB or RGBA (if
+// `has_alpha` is true), with PNG filtering already applied.
+//
+// This is called by the worker thread that painted the tile, so that
+// compression doesn't happen in Python while holding the GIL.  The returned
+// message has the same name as `image_data`.
+std::unique_ptr<UniqueMessageData>
+make_png_file(const MessageData &image_data, int tile_size, bool has_alpha);
+
+}  // namespace croquis
@@ -101,6 +101,19 @@ PYBIND11_MODULE(_csrc, m) {
             },
             py::call_guard<py::gil_scoped_release>()
         )
+        .def("add_scatter_data",
+            [](croquis::Plotter &p,
+               py::buffer X, py::buffer Y, py::buffer start_idxs,
+               py::buffer colors,
+               int item_cnt, int64_t total_pts_cnt,
+               float marker_size) {
+                p.add_figure_data<croquis::ScatterData>(
+                    X.request(), Y.request(), start_idxs.request(),
+                    colors.request(),
+                    item_cnt, total_pts_cnt, marker_size);
+            },
+            py::call_guard<py::gil_scoped_release>()
+        )
         .def("get_address",
              [](const croquis::Plotter &p) { return (uintptr_t) &p; })
         .def_property_readonly(
@@ -108,6 +121,9 @@ PYBIND11_MODULE(_csrc, m) {
                 return p.get_sm_version();
             }
         )
+        .def("set_density_mode", &croquis::Plotter::set_density_mode)
+        .def("set_tile_size", &croquis::Plotter::set_tile_size)
+        .def("set_fast_lines", &croquis::Plotter::set_fast_lines)
         .def("create_canvas_config", &croquis::Plotter::create_canvas_config,
              py::call_guard<py::gil_scoped_release>())
         .def("init_selection_map", [](croquis::Plotter &p) {
@@ -3,16 +3,19 @@
 #pragma once
 
 #include <stdint.h>  // uint32_t
+#include <stdlib.h>  // free
 #include <string.h>  // memset
 
 #include <immintrin.h>  // __m128i
 
 #include <memory>  // unique_ptr
 #include <string>
+#include <vector>
 
 #include "croquis/constants.h"  // TILE_SIZE
 #include "croquis/message.h"  // UniqueMessageData
-#include "croquis/util/macros.h"  // DIE_MSG
+#include "croquis/util/aligned_alloc.h"
+#include "croquis/util/macros.h"  // DIE_MSG, DISALLOW_COPY_AND_MOVE
 
 namespace croquis {
 
@@ -21,39 +24,125 @@ class GrayscaleBuffer;
 // An abstract base class for RgbBuffer or RgbaBuffer.
 class ColoredBufferBase {
   public:
-    // Each BitmapBuffer contains 256x256 pixels, and each block is 4x4.
-    enum { BLK_CNT = 4096 };  // = (256 * 256) / (4 * 4)
-    static_assert(BLK_CNT == (TILE_SIZE * TILE_SIZE) / 16, "Sanity check");
+    // Each buffer contains (tile_size x tile_size) pixels, and each block is
+    // 4x4, in the same order as GrayscaleBuffer.  Arrays are sized for the
+    // current tile, and reallocated by reset() if the tile size changes.
+    explicit ColoredBufferBase(int tile_size) : tile_size_(tile_size)
+    { alloc_dirty(); }
 
-    virtual ~ColoredBufferBase() { }
+    virtual ~ColoredBufferBase() {
+        free(dirty_);
+        free(dirty_list_);
+    }
+
+    DISALLOW_COPY_AND_MOVE(ColoredBufferBase);
+
+    int tile_size() const { return tile_size_; }
+
+    // Number of 4x4 blocks in the tile.
+    int tile_blk_cnt() const { return (tile_size_ * tile_size_) / 16; }
 
     // Merge the data from GrayscaleBuffer with the given color, and clears
-    // GrayscaleBuffer.
+    // GrayscaleBuffer, which must have the same tile size.
     // `line_id` is used in RgbBuffer to update `hovermap` on affected pixels.
     virtual void merge(GrayscaleBuffer *buf, int line_id,
                        uint32_t color /* 0xaarrggbb */) = 0;
 
+    // Put `layer` on top of this buffer, as if merge() calls made on `layer`
+    // were made on this buffer instead.  Used for painting a heavy tile in
+    // parallel (see Plotter::draw_tile_task()).
+    //
+    // `layer` must be a LayerBuffer for RgbBuffer, and the same type as this
+    // buffer otherwise.  The result may differ slightly from calling merge()
+    // directly, due to rounding (except for DensityBuffer).
+    virtual void compose(const ColoredBufferBase &layer) = 0;
+
     // Create a buffer of pixels organized according to PNG spec: it can be
     // compressed (via zlib) to generate a PNG IDAT chunk.
-    //
-    // (For simplicity, we're going to use python's `zlib` module to handle
-    // compression for us, for now.)
+    // See make_png_file() (png_util.h).
     virtual std::unique_ptr<UniqueMessageData>
     make_png_data(const std::string &name) const = 0;
 
-    // Only available for RgbBuffer.
+    // Create the "hovermap" showing which line is at each pixel, for FE to
+    // figure out which line is currently under the mouse cursor.  Not
+    // available for RgbaBuffer.
+    //
+    // To save bandwidth, the hovermap is sent in a compact format (all
+    // integers are little endian):
+    //  - int32 `width`: number of bytes per pixel (0, 1, 2, or 4).
+    //  - int32 `n`: size of the table below.
+    //  - int32 table[n]: line IDs; table[0] is always -1 (i.e., no line).
+    //  - (tile_size x tile_size) unsigned integers of `width` bytes each, in
+    //    the ordinary pixel order: the index into `table` for each pixel.  If
+    //    `width` is zero, there's no pixel data and every pixel is table[0].
     virtual std::unique_ptr<UniqueMessageData>
     make_hovermap_data(const std::string &name) const = 0;
 
     // Helper function for debugging.
     virtual uint32_t get_pixel(int x, int y) const = 0;
+
+  protected:
+    // Create a hovermap without any line.
+    static std::unique_ptr<UniqueMessageData>
+    make_empty_hovermap_data(const std::string &name);
+
+    // Called by reset() of subclasses: if the tile size changes, forget the
+    // dirty list and return true, in which case the caller must reallocate
+    // and initialize its own arrays for the new tile.
+    bool set_tile_size(int tile_size) {
+        if (tile_size == tile_size_) return false;
+        dirty_cnt_ = 0;
+        tile_size_ = tile_size;
+        alloc_dirty();
+        return true;
+    }
+
+    // Blocks changed by merge() since the buffer was created (or reset), so
+    // that the buffer can be reused for another tile by only clearing these
+    // blocks (see util::ThreadLocalPool).
+    //
+    // uint8_t dirty_[tile_blk_cnt()]: 1 if the block is in `dirty_list_`.
+    // uint16_t dirty_list_[tile_blk_cnt()];
+    uint8_t *dirty_ = nullptr;
+    uint16_t *dirty_list_ = nullptr;
+    int dirty_cnt_ = 0;
+
+    // Add blocks of `gray_buf` to the dirty list: must be called by merge()
+    // before clearing `gray_buf`.
+    void mark_dirty(const GrayscaleBuffer *gray_buf);
+
+    // Same, but adds dirty blocks of `layer`: called by compose().
+    void mark_dirty(const ColoredBufferBase &layer);
+
+    // Call `fn(offset)` for each dirty block, and clear the dirty list.
+    template<typename F> void clear_dirty(F fn) {
+        for (int i = 0; i < dirty_cnt_; i++) {
+            fn(dirty_list_[i]);
+            dirty_[dirty_list_[i]] = 0;
+        }
+        dirty_cnt_ = 0;
+    }
+
+  private:
+    int tile_size_;
+
+    // (Re)allocate the dirty list for the current tile size.
+    void alloc_dirty() {
+        const int n = tile_blk_cnt();
+        dirty_ = (uint8_t *) util::realloc_aligned(dirty_, 16, n);
+        dirty_list_ = (uint16_t *)
+            util::realloc_aligned(dirty_list_, 16, n * sizeof(uint16_t));
+        memset(dirty_, 0x00, n);
+    }
 };
 
+class LayerBuffer;
+
 // RgbBuffer internally contains two buffers:
 // - `buf` contains RGB values in successive 4x4 blocks.
-// - `hovermap` contains the ID of the last merge() operation that touched the
-//   pixel: it is used by FE to figure out which "line" is currently under the
-//   mouse cursor.
+// - `hovermap` contains the last merge() operation that touched the pixel: it
+//   is used by FE to figure out which "line" is currently under the mouse
+//   cursor.
 class RgbBuffer final : public ColoredBufferBase {
   public:
     // Comprised of 16-byte blocks, where each block is a 4x4 area.
@@ -62,31 +151,40 @@ class RgbBuffer final : public ColoredBufferBase {
     // Block #2: (0..3, 0..3), B
     // Block #3: (4..7, 0..3), R
     // ...
-    alignas(16) __m128i buf[BLK_CNT * 3];
+    __m128i *buf = nullptr;  // alignas(16) __m128i buf[tile_blk_cnt() * 3];
 
     // Comprised of 64-byte blocks, where each block is a 4x4 area of 32-bit
-    // integers.  Initialized to -1.
+    // integers.  Initialized to -1.  Instead of line IDs, we store indices
+    // into `line_ids_`, so that make_hovermap_data() can easily find the set
+    // of lines in this tile.
+    //
+    // alignas(32) __m256i hovermap[tile_blk_cnt() * 2];
     //
-    // It seems like C++ doesn't correctly support 32-byte alignment until
-    // C++17 - so let's use posix_memalign for now, so that we can compile on
-    // C++14.
-    __m256i *hovermap;  // alignas(32) __m256i hovermap[BLK_CNT * 2];
+    // Both arrays are allocated with util::realloc_aligned(), because C++14
+    // doesn't support 32-byte alignment with `new`.
+    __m256i *hovermap = nullptr;
 
-    RgbBuffer(uint32_t color);  // color = 0x??rrggbb
+    // color = 0x??rrggbb
+    explicit RgbBuffer(uint32_t color, int tile_size = TILE_SIZE);
     ~RgbBuffer();
 
+    // Restore the buffer to the same state as RgbBuffer(color, tile_size).
+    void reset(uint32_t color, int tile_size = TILE_SIZE);
+
     void merge(GrayscaleBuffer *buf, int line_id,
                uint32_t color /* 0xaarrggbb */) override;
 
+    // `layer` must be a LayerBuffer.
+    void compose(const ColoredBufferBase &layer) override;
+
     std::unique_ptr<UniqueMessageData>
     make_png_data(const std::string &name) const override;
 
-    // Create a buffer of hovermap data arranged in the ordinary pixel order.
     std::unique_ptr<UniqueMessageData>
     make_hovermap_data(const std::string &name) const override;
 
     uint32_t get_pixel(int x, int y) const override {
-        int idx1 = (y / 4) * 64 + (x / 4);
+        int idx1 = (y / 4) * (tile_size() / 4) + (x / 4);
         int idx2 = (y % 4) * 4 + (x % 4);
 
         uint8_t r = ((const char *) buf)[idx1 * 48 + idx2];
@@ -94,6 +192,31 @@ class RgbBuffer final : public ColoredBufferBase {
         uint8_t b = ((const char *) buf)[idx1 * 48 + 32 + idx2];
         return ((uint32_t) r << 16) + ((uint32_t) g << 8) + b;
     }
+
+  private:
+    uint32_t bg_color_;  // Background color given to the constructor.
+
+    // (Re)allocate `buf` and `hovermap` for the current tile size: the caller
+    // must call fill_background() afterwards.
+    void alloc_blks();
+
+    // Fill every block of the tile with `bg_color_`, and clear the hovermap.
+    void fill_background();
+
+    // Line IDs of merge() calls so far, in the order of calls (not counting
+    // calls with empty GrayscaleBuffer).
+    std::vector<int> line_ids_;
+
+    // Implementations of merge() for each instruction set.
+    void merge_scalar(GrayscaleBuffer *buf, int line_id, uint32_t color);
+    void merge_sse4(GrayscaleBuffer *buf, int line_id, uint32_t color);
+    void merge_avx2(GrayscaleBuffer *buf, int line_id, uint32_t color);
+    void merge_avx512(GrayscaleBuffer *buf, int line_id, uint32_t color);
+
+    // Implementations of make_png_data(): write the filtered scanlines to
+    // `dest`.
+    void make_png_rows_scalar(char *dest) const;
+    void make_png_rows_avx2(char *dest) const;
 };
 
 // For highlight tiles: similar as above, but also contains the alpha channel,
@@ -135,24 +258,42 @@ class RgbaBuffer final : public ColoredBufferBase {
     // Block #3: (0..3, 0..3), W
     // Block #4: (4..7, 0..3), R
     // ...
-    alignas(16) __m128i buf[BLK_CNT * 4];
+    __m128i *buf = nullptr;  // alignas(16) __m128i buf[tile_blk_cnt() * 4];
 
-    RgbaBuffer() { memset(buf, 0x00, sizeof(buf)); }
+    explicit RgbaBuffer(int tile_size = TILE_SIZE)
+        : ColoredBufferBase(tile_size)
+    { alloc_blks(); }
+
+    ~RgbaBuffer() { free(buf); }
+
+    // Restore the buffer to the same state as RgbaBuffer(tile_size).
+    void reset(int tile_size = TILE_SIZE) {
+        if (set_tile_size(tile_size)) {
+            alloc_blks();
+            return;
+        }
+        clear_dirty([this](int i) {
+            for (int j = 0; j < 4; j++) buf[i * 4 + j] = _mm_setzero_si128();
+        });
+    }
 
     // `line_id` is unused here.
     void merge(GrayscaleBuffer *buf, int line_id,
                uint32_t color /* 0xaarrggbb */) override;
 
+    // `layer` must be an RgbaBuffer.
+    void compose(const ColoredBufferBase &layer) override;
+
     std::unique_ptr<UniqueMessageData>
     make_png_data(const std::string &name) const override;
 
     std::unique_ptr<UniqueMessageData>
-    make_hovermap_data(const std::string &name) const override {
+    make_hovermap_data(const std::string & /* name */) const override {
         DIE_MSG("RgbaBuffer doesn't support make_hovermap_data()!\n");
     }
 
     uint32_t get_pixel(int x, int y) const override {
-        int idx1 = (y / 4) * 64 + (x / 4);
+        int idx1 = (y / 4) * (tile_size() / 4) + (x / 4);
         int idx2 = (y % 4) * 4 + (x % 4);
 
         uint8_t r = ((const char *) buf)[idx1 * 64 + idx2];
@@ -162,6 +303,88 @@ class RgbaBuffer final : public ColoredBufferBase {
         return ((uint32_t) w << 24) +
                ((uint32_t) r << 16) + ((uint32_t) g << 8) + b;
     }
+
+  private:
+    // (Re)allocate `buf` for the current tile size, and clear it.
+    void alloc_blks() {
+        const int n = tile_blk_cnt() * 4;
+        buf = (__m128i *) util::realloc_aligned(buf, 16, n * sizeof(__m128i));
+        memset(buf, 0x00, n * sizeof(__m128i));
+    }
+
+    // Implementations of merge() for each instruction set.
+    void merge_scalar(GrayscaleBuffer *buf, uint32_t color);
+    void merge_sse4(GrayscaleBuffer *buf, uint32_t color);
+    void merge_avx2(GrayscaleBuffer *buf, uint32_t color);
+    void merge_avx512(GrayscaleBuffer *buf, uint32_t color);
+
+    // Table of multipliers for converting RGBW to RGBA, indexed by W: each
+    // channel C becomes ((C * table[W]) & 0xffff) >> 8, which is roughly
+    // C * (255 / W).  See rgb_buffer_scalar.cc.
+    static const int32_t *unpremultiply_table();
+
+    // Implementations of make_png_data(): write the filtered scanlines to
+    // `dest`.
+    void make_png_rows_scalar(char *dest) const;
+    void make_png_rows_avx2(char *dest) const;
+};
+
+// A partial tile used when a heavy tile is painted in parallel (see
+// Plotter::draw_tile_task()): each thread paints a subset of lines on its own
+// LayerBuffer, and they are composed on top of an RgbBuffer in order.
+//
+// Unlike RgbBuffer, the layer must be transparent where no line is drawn, so
+// we store colors in RgbaBuffer (which uses the RGBW format above).  Also
+// contains the hovermap, which is the same as RgbBuffer.
+class LayerBuffer final : public ColoredBufferBase {
+  public:
+    RgbaBuffer colors;
+
+    // Same as RgbBuffer::hovermap, in 4x4 blocks.  Initialized to -1.
+    int32_t *hovermap = nullptr;  // int32_t hovermap[tile_blk_cnt() * 16];
+
+    explicit LayerBuffer(int tile_size = TILE_SIZE)
+        : ColoredBufferBase(tile_size), colors(tile_size)
+    { alloc_blks(); }
+
+    ~LayerBuffer() { free(hovermap); }
+
+    // Restore the buffer to the same state as LayerBuffer(tile_size).
+    void reset(int tile_size = TILE_SIZE);
+
+    void merge(GrayscaleBuffer *buf, int line_id,
+               uint32_t color /* 0xaarrggbb */) override;
+
+    void compose(const ColoredBufferBase & /* layer */) override {
+        DIE_MSG("LayerBuffer doesn't support compose()!\n");
+    }
+
+    std::unique_ptr<UniqueMessageData>
+    make_png_data(const std::string & /* name */) const override {
+        DIE_MSG("LayerBuffer doesn't support make_png_data()!\n");
+    }
+
+    std::unique_ptr<UniqueMessageData>
+    make_hovermap_data(const std::string & /* name */) const override {
+        DIE_MSG("LayerBuffer doesn't support make_hovermap_data()!\n");
+    }
+
+    uint32_t get_pixel(int x, int y) const override
+    { return colors.get_pixel(x, y); }
+
+  private:
+    // Same as RgbBuffer::line_ids_.
+    std::vector<int> line_ids_;
+
+    // (Re)allocate `hovermap` for the current tile size, and clear it.
+    void alloc_blks() {
+        const int n = tile_blk_cnt() * 16;
+        hovermap = (int32_t *)
+            util::realloc_aligned(hovermap, 16, n * sizeof(int32_t));
+        memset(hovermap, 0xff, n * sizeof(int32_t));
+    }
+
+    friend class RgbBuffer;
 };
 
 } // namespace croquis
@@ -0,0 +1,448 @@
+// AVX2 version of RgbBuffer::merge() and RgbaBuffer::merge().  Versions for
+// other instruction sets (rgb_buffer_{scalar,sse4,avx512}.cc) follow the same
+// algorithm, so the detailed comments are here: see also RgbBuffer::merge() in
+// rgb_buffer.cc.
+//
+// Also contains the AVX2 version of make_png_data(), which is only implemented
+// for AVX2 (AVX-512 CPUs use this one, too), and scalar otherwise.
+//
+// This file is compiled with AVX2 flags, and only called if the CPU supports
+// it (see util/cpu_features.h).
+
+#include <math.h>  // ceilf
+#include <stdint.h>  // uint32_t
+#include <stdio.h>  // printf (for debugging)
+#include <string.h>  // memset
+
+#include <immintrin.h>
+
+#include "croquis/grayscale_buffer.h"
+#include "croquis/rgb_buffer.h"
+#include "croquis/util/avx_util.h"  // to_string (for debugging)
+
+// #define DEBUG_BITMAP
+
+namespace croquis {
+
+void RgbBuffer::merge_avx2(GrayscaleBuffer *gray_buf, int line_id,
+                           uint32_t color)
+{
+    const __m128i zeros = _mm_setzero_si128();
+    const __m256i L = _mm256_set1_epi32(line_id);
+
+    int alpha = (color >> 24) & 0xff;
+    int scaled_alpha = ceilf(alpha * (65536.f / 255.f / 255.f));
+    const __m256i Alpha = _mm256_set1_epi16(scaled_alpha);
+
+    const __m256i R = _mm256_set1_epi16((color >> 16) & 0xff);
+    const __m256i G = _mm256_set1_epi16((color >> 8) & 0xff);
+    const __m256i B = _mm256_set1_epi16(color & 0xff);
+
+    const int blk_cnt = gray_buf->blk_cnt;
+    for (int i = 0; i < blk_cnt; i++) {
+        int offset = gray_buf->blklist[i];
+
+        //----------------------------------------
+        // First, update `hovermap`.
+
+        __m128i Gray0 = gray_buf->buf[offset];
+        __m256i Gray = _mm256_cvtepu8_epi16(Gray0);
+        gray_buf->buf[offset] = zeros;
+
+        // Zero iff the corresponding pixel is being updated.
+        __m128i mask = _mm_cmpeq_epi8(Gray0, zeros);  // vpcmpeqb
+
+        __m256i mask1 = _mm256_cvtepi8_epi32(mask);  // vpmovsxbd
+        mask = _mm_bsrli_si128(mask, 8);  // vpsrldq
+        __m256i mask2 = _mm256_cvtepi8_epi32(mask);  // vpmovsxbd
+
+        __m256i H1 = hovermap[offset * 2];
+        __m256i H2 = hovermap[offset * 2 + 1];
+
+        // vpblendvb x2
+        hovermap[offset * 2] = _mm256_blendv_epi8(L, H1, mask1);
+        hovermap[offset * 2 + 1] = _mm256_blendv_epi8(L, H2, mask2);
+
+        //----------------------------------------
+        // Now update RGB colors in `buf`.
+
+        // vpmovzxbw x3
+        __m256i R0 = _mm256_cvtepu8_epi16(buf[offset * 3]);
+        __m256i G0 = _mm256_cvtepu8_epi16(buf[offset * 3 + 1]);
+        __m256i B0 = _mm256_cvtepu8_epi16(buf[offset * 3 + 2]);
+
+        __m256i dR = _mm256_sub_epi16(R, R0);  // vpsubw
+        __m256i dG = _mm256_sub_epi16(G, G0);  // vpsubw
+        __m256i dB = _mm256_sub_epi16(B, B0);  // vpsubw
+
+#ifdef DEBUG_BITMAP
+        printf("color=%x Gray=%s\n    R0=%s\n    dR=%s\n",
+               color, util::to_string(Gray).c_str(),
+               util::to_string(R0).c_str(), util::to_string(dR).c_str());
+#endif
+
+        // Because `Gray` and `dR` are in the range [0, 255] and [-255, 255],
+        // respectively, we can't just multiply them - it goes over 16bit range.
+        // So we take absolute values, and remember the original, so that we can
+        // apply the sign operation at the end.
+        __m256i abs_dR = _mm256_abs_epi16(dR);  // vpabsw
+        __m256i abs_dG = _mm256_abs_epi16(dG);  // vpabsw
+        __m256i abs_dB = _mm256_abs_epi16(dB);  // vpabsw
+
+#ifdef DEBUG_BITMAP
+        printf("abs_dR=%s\n", util::to_string(abs_dR).c_str());
+#endif
+
+        // Compute Gray * (dR, dG, dB): result is unsigned, in range
+        // [0, 255 * 255].
+        abs_dR = _mm256_mullo_epi16(Gray, abs_dR);  // vpmullw
+        abs_dG = _mm256_mullo_epi16(Gray, abs_dG);  // vpmullw
+        abs_dB = _mm256_mullo_epi16(Gray, abs_dB);  // vpmullw
+
+#ifdef DEBUG_BITMAP
+        printf("after *Gray dR=%s\n", util::to_string(abs_dR).c_str());
+#endif
+
+        // Now multiply by the alpha value.
+        abs_dR = _mm256_mulhi_epu16(Alpha, abs_dR);  // vpmulhuw
+        abs_dG = _mm256_mulhi_epu16(Alpha, abs_dG);  // vpmulhuw
+        abs_dB = _mm256_mulhi_epu16(Alpha, abs_dB);  // vpmulhuw
+
+#ifdef DEBUG_BITMAP
+        printf("after *Alpha dR=%s\n", util::to_string(abs_dR).c_str());
+#endif
+
+        // Apply back the sign.
+        dR = _mm256_sign_epi16(abs_dR, dR);  // vpsignw
+        dG = _mm256_sign_epi16(abs_dG, dG);  // vpsignw
+        dB = _mm256_sign_epi16(abs_dB, dB);  // vpsignw
+
+#ifdef DEBUG_BITMAP
+        printf("after sign dR=%s\n", util::to_string(dR).c_str());
+#endif
+
+        // Add back the difference.
+        __m256i R1 = _mm256_add_epi16(R0, dR);  // vpaddw
+        __m256i G1 = _mm256_add_epi16(G0, dG);  // vpaddw
+        __m256i B1 = _mm256_add_epi16(B0, dB);  // vpaddw
+
+#ifdef DEBUG_BITMAP
+        printf("R1=%s\n", util::to_string(dR).c_str());
+#endif
+
+        // Shuffle back to 8-bit values.
+        const __m256i idxs = _mm256_set_epi32(
+            0x00000000, 0x00000000, 0x0e0c0a08, 0x06040200,
+            0x00000000, 0x00000000, 0x0e0c0a08, 0x06040200);
+        R1 = _mm256_shuffle_epi8(R1, idxs);  // vpshufb
+        G1 = _mm256_shuffle_epi8(G1, idxs);  // vpshufb
+        B1 = _mm256_shuffle_epi8(B1, idxs);  // vpshufb
+
+        // R1[0:63, 128:191] -> R1[0:63, 64:127], etc.
+        R1 = _mm256_permute4x64_epi64(R1, 0x08);  // vpermq
+        G1 = _mm256_permute4x64_epi64(G1, 0x08);  // vpermq
+        B1 = _mm256_permute4x64_epi64(B1, 0x08);  // vpermq
+
+        buf[offset * 3] = _mm256_castsi256_si128(R1);
+        buf[offset * 3 + 1] = _mm256_castsi256_si128(G1);
+        buf[offset * 3 + 2] = _mm256_castsi256_si128(B1);
+    }
+
+    // Clear the blocklist for `gray_buf`.
+    gray_buf->blk_cnt = 0;
+}
+
+void RgbaBuffer::merge_avx2(GrayscaleBuffer *gray_buf, uint32_t color)
+{
+    const __m128i zeros = _mm_setzero_si128();
+
+    int alpha = (color >> 24) & 0xff;
+    int scaled_alpha = ceilf(alpha * (65536.f / 255.f / 255.f));
+    const __m256i Alpha = _mm256_set1_epi16(scaled_alpha);
+
+    const __m256i R = _mm256_set1_epi16((color >> 16) & 0xff);
+    const __m256i G = _mm256_set1_epi16((color >> 8) & 0xff);
+    const __m256i B = _mm256_set1_epi16(color & 0xff);
+    const __m256i W = _mm256_set1_epi16(0xff);
+
+    const int blk_cnt = gray_buf->blk_cnt;
+    for (int i = 0; i < blk_cnt; i++) {
+        int offset = gray_buf->blklist[i];
+
+        __m128i Gray0 = gray_buf->buf[offset];
+        __m256i Gray = _mm256_cvtepu8_epi16(Gray0);
+        gray_buf->buf[offset] = zeros;
+
+        // vpmovzxbw x4
+        __m256i R0 = _mm256_cvtepu8_epi16(buf[offset * 4]);
+        __m256i G0 = _mm256_cvtepu8_epi16(buf[offset * 4 + 1]);
+        __m256i B0 = _mm256_cvtepu8_epi16(buf[offset * 4 + 2]);
+        __m256i W0 = _mm256_cvtepu8_epi16(buf[offset * 4 + 3]);
+
+        __m256i dR = _mm256_sub_epi16(R, R0);  // vpsubw
+        __m256i dG = _mm256_sub_epi16(G, G0);  // vpsubw
+        __m256i dB = _mm256_sub_epi16(B, B0);  // vpsubw
+        __m256i dW = _mm256_sub_epi16(W, W0);  // vpsubw
+
+#ifdef DEBUG_BITMAP
+        printf("color=%x Gray=%s\n    R0=%s\n    dR=%s\n",
+               color, util::to_string(Gray).c_str(),
+               util::to_string(R0).c_str(), util::to_string(dR).c_str());
+#endif
+
+        // Because `Gray` and `dR` are in the range [0, 255] and [-255, 255],
+        // respectively, we can't just multiply them - it goes over 16bit range.
+        // So we take absolute values, and remember the original, so that we can
+        // apply the sign operation at the end.
+        //
+        // We don't need that for dW because W should always increase.
+        __m256i abs_dR = _mm256_abs_epi16(dR);  // vpabsw
+        __m256i abs_dG = _mm256_abs_epi16(dG);  // vpabsw
+        __m256i abs_dB = _mm256_abs_epi16(dB);  // vpabsw
+        __m256i abs_dW = dW;
+
+#ifdef DEBUG_BITMAP
+        printf("abs_dR=%s\n", util::to_string(abs_dR).c_str());
+#endif
+
+        // Compute Gray * (dR, dG, dB): result is unsigned, in range
+        // [0, 255 * 255].
+        abs_dR = _mm256_mullo_epi16(Gray, abs_dR);  // vpmullw
+        abs_dG = _mm256_mullo_epi16(Gray, abs_dG);  // vpmullw
+        abs_dB = _mm256_mullo_epi16(Gray, abs_dB);  // vpmullw
+        abs_dW = _mm256_mullo_epi16(Gray, abs_dW);  // vpmullw
+
+#ifdef DEBUG_BITMAP
+        printf("after *Gray dR=%s\n", util::to_string(abs_dR).c_str());
+#endif
+
+        // Now multiply by the alpha value.
+        abs_dR = _mm256_mulhi_epu16(Alpha, abs_dR);  // vpmulhuw
+        abs_dG = _mm256_mulhi_epu16(Alpha, abs_dG);  // vpmulhuw
+        abs_dB = _mm256_mulhi_epu16(Alpha, abs_dB);  // vpmulhuw
+        abs_dW = _mm256_mulhi_epu16(Alpha, abs_dW);  // vpmulhuw
+
+#ifdef DEBUG_BITMAP
+        printf("after *Alpha dR=%s\n", util::to_string(abs_dR).c_str());
+#endif
+
+        // Apply back the sign.
+        dR = _mm256_sign_epi16(abs_dR, dR);  // vpsignw
+        dG = _mm256_sign_epi16(abs_dG, dG);  // vpsignw
+        dB = _mm256_sign_epi16(abs_dB, dB);  // vpsignw
+        dW = abs_dW;
+
+#ifdef DEBUG_BITMAP
+        printf("after sign dR=%s\n", util::to_string(dR).c_str());
+#endif
+
+        // Add back the difference.
+        __m256i R1 = _mm256_add_epi16(R0, dR);  // vpaddw
+        __m256i G1 = _mm256_add_epi16(G0, dG);  // vpaddw
+        __m256i B1 = _mm256_add_epi16(B0, dB);  // vpaddw
+        __m256i W1 = _mm256_add_epi16(W0, dW);  // vpaddw
+
+#ifdef DEBUG_BITMAP
+        printf("R1=%s\n", util::to_string(dR).c_str());
+#endif
+
+        // Shuffle back to 8-bit values.
+        const __m256i idxs = _mm256_set_epi32(
+            0x00000000, 0x00000000, 0x0e0c0a08, 0x06040200,
+            0x00000000, 0x00000000, 0x0e0c0a08, 0x06040200);
+        R1 = _mm256_shuffle_epi8(R1, idxs);  // vpshufb
+        G1 = _mm256_shuffle_epi8(G1, idxs);  // vpshufb
+        B1 = _mm256_shuffle_epi8(B1, idxs);  // vpshufb
+        W1 = _mm256_shuffle_epi8(W1, idxs);  // vpshufb
+
+        // R1[0:63, 128:191] -> R1[0:63, 64:127], etc.
+        R1 = _mm256_permute4x64_epi64(R1, 0x08);  // vpermq
+        G1 = _mm256_permute4x64_epi64(G1, 0x08);  // vpermq
+        B1 = _mm256_permute4x64_epi64(B1, 0x08);  // vpermq
+        W1 = _mm256_permute4x64_epi64(W1, 0x08);  // vpermq
+
+        buf[offset * 4] = _mm256_castsi256_si128(R1);
+        buf[offset * 4 + 1] = _mm256_castsi256_si128(G1);
+        buf[offset * 4 + 2] = _mm256_castsi256_si128(B1);
+        buf[offset * 4 + 3] = _mm256_castsi256_si128(W1);
+    }
+
+    // Clear the blocklist for `gray_buf`.
+    gray_buf->blk_cnt = 0;
+}
+
+//------------------------------------------------------------------------------
+// make_png_data()
+
+// Put two 16-byte blocks into the lower/upper half of a 256-bit register.
+static inline __m256i make_pair(__m128i lo, __m128i hi)
+{
+    return _mm256_inserti128_si256(
+        _mm256_castsi128_si256(lo), hi, 1);  // vinserti128
+}
+
+// Given four channels (C0-C3) of a 4x4 block in each 128-bit lane, transpose
+// them so that rows[r] holds the four channels of row #r:
+//
+//      C0 = (C0 row #0, C0 row #1, C0 row #2, C0 row #3), ...
+//  rows[0] = (C0 row #0, C1 row #0, C2 row #0, C3 row #0), ...
+//
+// (Each "row" is four bytes, i.e., four pixels.)
+static inline void transpose_blk(__m256i C0, __m256i C1, __m256i C2,
+                                 __m256i C3, __m256i rows[4])
+{
+    __m256i t0 = _mm256_unpacklo_epi32(C0, C1);  // vpunpckldq
+    __m256i t1 = _mm256_unpacklo_epi32(C2, C3);  // vpunpckldq
+    __m256i t2 = _mm256_unpackhi_epi32(C0, C1);  // vpunpckhdq
+    __m256i t3 = _mm256_unpackhi_epi32(C2, C3);  // vpunpckhdq
+
+    rows[0] = _mm256_unpacklo_epi64(t0, t1);  // vpunpcklqdq
+    rows[1] = _mm256_unpackhi_epi64(t0, t1);  // vpunpckhqdq
+    rows[2] = _mm256_unpacklo_epi64(t2, t3);  // vpunpcklqdq
+    rows[3] = _mm256_unpackhi_epi64(t2, t3);  // vpunpckhqdq
+}
+
+// We process one "block row" (four rows of pixels) at a time, two blocks at a
+// time: read the blocks, transpose them into rows, apply the "up" filter, and
+// interleave the channels to get RGB pixels.  The filter is applied before
+// interleaving, because it's the same byte-wise subtraction either way.
+//
+// For the first row of each block row, the row above belongs to the previous
+// block row, so we remember the last row of each block in `prev`.
+void RgbBuffer::make_png_rows_avx2(char *dest) const
+{
+    const int TS = tile_size();
+    const int blks = TS / 4;  // Number of blocks per row.
+    const int stride = TS * 3 + 1;  // Bytes per row, including the filter.
+
+    // Last row of each block (in the transposed format) of the previous block
+    // row: all zeros for the first row.
+    alignas(16) __m128i prev[MAX_TILE_SIZE / 4];
+    memset(prev, 0x00, sizeof(prev[0]) * blks);
+
+    // (R0 R1 R2 R3 G0 G1 G2 G3 B0 B1 B2 B3 x x x x) ->
+    // (R0 G0 B0 R1 G1 B1 R2 G2 B2 R3 G3 B3 0 0 0 0)
+    const __m256i interleave = _mm256_setr_epi8(
+        0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, -1, -1, -1, -1,
+        0, 4, 8, 1, 5, 9, 2, 6, 10, 3, 7, 11, -1, -1, -1, -1);
+
+    // Move the first 12 bytes of each lane together.
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+
+    const __m256i zeros = _mm256_setzero_si256();
+
+    for (int blk_row = 0; blk_row < blks; blk_row++) {
+        char *out = dest + (blk_row * 4) * stride;
+        for (int r = 0; r < 4; r++)
+            out[r * stride] = (blk_row == 0 && r == 0) ? 0 : 2;
+        out++;
+
+        const __m128i *src = buf + (blk_row * blks * 3);
+        for (int i = 0; i < blks; i += 2) {
+            const __m128i *s = src + i * 3;
+            __m256i rows[4];
+            transpose_blk(make_pair(s[0], s[3]), make_pair(s[1], s[4]),
+                          make_pair(s[2], s[5]), zeros, rows);
+
+            __m256i P = make_pair(prev[i], prev[i + 1]);
+            prev[i] = _mm256_castsi256_si128(rows[3]);
+            prev[i + 1] = _mm256_extracti128_si256(rows[3], 1);
+
+            for (int r = 0; r < 4; r++) {
+                __m256i D = _mm256_sub_epi8(rows[r], P);  // vpsubb
+                P = rows[r];
+
+                D = _mm256_shuffle_epi8(D, interleave);  // vpshufb
+                D = _mm256_permutevar8x32_epi32(D, compact);  // vpermd
+
+                // Store exactly 24 bytes, so that we don't overwrite the next
+                // row (which we've already written).
+                char *ptr = out + r * stride + i * 12;
+                _mm_storeu_si128((__m128i *) ptr, _mm256_castsi256_si128(D));
+                _mm_storel_epi64((__m128i *) (ptr + 16),
+                                 _mm256_extracti128_si256(D, 1));
+            }
+        }
+    }
+}
+
+// Convert 16 pixels of RGBW to RGBA: see RgbaBuffer::unpremultiply_table().
+static inline void unpremultiply(const int32_t *table, __m128i W,
+                                 __m128i *R, __m128i *G, __m128i *B)
+{
+    const int *t = (const int *) table;
+    __m256i M0 = _mm256_i32gather_epi32(
+        t, _mm256_cvtepu8_epi32(W), 4);  // vpmovzxbd, vpgatherdd
+    __m256i M1 = _mm256_i32gather_epi32(
+        t, _mm256_cvtepu8_epi32(_mm_bsrli_si128(W, 8)), 4);
+
+    // Pack to 16 bits and fix the order (vpackssdw doesn't cross lanes).
+    __m256i M = _mm256_packs_epi32(M0, M1);  // vpackssdw
+    M = _mm256_permute4x64_epi64(M, 0xd8);  // vpermq
+
+    // Compute ((C * M) & 0xffff) >> 8, and pack back to 8 bits.
+    auto apply = [M](__m128i C) {
+        __m256i X = _mm256_mullo_epi16(M, _mm256_cvtepu8_epi16(C));
+        X = _mm256_srli_epi16(X, 8);  // vpsrlw
+        return _mm_packus_epi16(_mm256_castsi256_si128(X),
+                                _mm256_extracti128_si256(X, 1));
+    };
+
+    *R = apply(*R);
+    *G = apply(*G);
+    *B = apply(*B);
+}
+
+// Same as RgbBuffer::make_png_rows_avx2(), but with four channels, after
+// converting RGBW to RGBA.
+void RgbaBuffer::make_png_rows_avx2(char *dest) const
+{
+    const int TS = tile_size();
+    const int blks = TS / 4;
+    const int stride = TS * 4 + 1;
+    const int32_t *table = unpremultiply_table();
+
+    alignas(16) __m128i prev[MAX_TILE_SIZE / 4];
+    memset(prev, 0x00, sizeof(prev[0]) * blks);
+
+    // (R0 R1 R2 R3 G0 G1 G2 G3 B0 B1 B2 B3 A0 A1 A2 A3) ->
+    // (R0 G0 B0 A0 R1 G1 B1 A1 R2 G2 B2 A2 R3 G3 B3 A3)
+    const __m256i interleave = _mm256_setr_epi8(
+        0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+        0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+
+    for (int blk_row = 0; blk_row < blks; blk_row++) {
+        char *out = dest + (blk_row * 4) * stride;
+        for (int r = 0; r < 4; r++)
+            out[r * stride] = (blk_row == 0 && r == 0) ? 0 : 2;
+        out++;
+
+        const __m128i *src = buf + (blk_row * blks * 4);
+        for (int i = 0; i < blks; i += 2) {
+            const __m128i *s = src + i * 4;
+            __m128i R0 = s[0], G0 = s[1], B0 = s[2];
+            __m128i R1 = s[4], G1 = s[5], B1 = s[6];
+            unpremultiply(table, s[3], &R0, &G0, &B0);
+            unpremultiply(table, s[7], &R1, &G1, &B1);
+
+            __m256i rows[4];
+            transpose_blk(make_pair(R0, R1), make_pair(G0, G1),
+                          make_pair(B0, B1), make_pair(s[3], s[7]), rows);
+
+            __m256i P = make_pair(prev[i], prev[i + 1]);
+            prev[i] = _mm256_castsi256_si128(rows[3]);
+            prev[i + 1] = _mm256_extracti128_si256(rows[3], 1);
+
+            for (int r = 0; r < 4; r++) {
+                __m256i D = _mm256_sub_epi8(rows[r], P);  // vpsubb
+                P = rows[r];
+
+                D = _mm256_shuffle_epi8(D, interleave);  // vpshufb
+                _mm256_storeu_si256(
+                    (__m256i *) (out + r * stride + i * 16), D);
+            }
+        }
+    }
+}
+
+}  // namespace croquis
@@ -0,0 +1,149 @@
+// AVX-512 version of RgbBuffer::merge() and RgbaBuffer::merge(): see
+// rgb_buffer_avx2.cc for the original (AVX2) version, which has more detailed
+// comments.
+//
+// This file is compiled with AVX-512 flags, and only called if the CPU supports
+// it (see util/cpu_features.h).  The results must be identical to the AVX2
+// version.
+
+#include <math.h>  // ceilf
+#include <stdint.h>  // uint32_t
+
+#include <immintrin.h>
+
+#include <algorithm>  // min
+
+#include "croquis/grayscale_buffer.h"
+#include "croquis/rgb_buffer.h"
+
+namespace croquis {
+
+// Read blocks #off0 and #off1 from `buf`, and widen to 16-bit values.
+static inline __m512i load_blks(const __m128i *buf, int off0, int off1)
+{
+    return _mm512_cvtepu8_epi16(  // vpmovzxbw
+        _mm256_set_m128i(buf[off1], buf[off0]));  // vinserti128
+}
+
+// Inverse of load_blks().
+static inline void store_blks(__m128i *buf, int off0, int off1, __m512i v)
+{
+    __m256i v8 = _mm512_cvtepi16_epi8(v);  // vpmovwb
+    buf[off0] = _mm256_castsi256_si128(v8);
+    buf[off1] = _mm256_extracti128_si256(v8, 1);  // vextracti128
+}
+
+// Compute C1 = C0 + (C - C0) * (Gray * Alpha) for one channel.
+static inline __m512i blend_channel(__m512i C, __m512i C0,
+                                    __m512i Gray, __m512i Alpha)
+{
+    __m512i dC = _mm512_sub_epi16(C, C0);  // vpsubw
+    __m512i abs_dC = _mm512_abs_epi16(dC);  // vpabsw
+    abs_dC = _mm512_mullo_epi16(Gray, abs_dC);  // vpmullw
+    abs_dC = _mm512_mulhi_epu16(Alpha, abs_dC);  // vpmulhuw
+
+    // There's no vpsignw in AVX-512: negate using the sign bits as the mask.
+    __mmask32 is_neg = _mm512_movepi16_mask(dC);  // vpmovw2m
+    dC = _mm512_mask_sub_epi16(  // vpsubw
+        abs_dC, is_neg, _mm512_setzero_si512(), abs_dC);
+
+    return _mm512_add_epi16(C0, dC);  // vpaddw
+}
+
+// We process two blocks per iteration.  If there's an odd number of blocks, the
+// last block is processed twice, which is harmless because we read everything
+// before writing.
+void RgbBuffer::merge_avx512(GrayscaleBuffer *gray_buf, int line_id,
+                             uint32_t color)
+{
+    const __m128i zeros = _mm_setzero_si128();
+    const __m512i L = _mm512_set1_epi32(line_id);
+
+    int alpha = (color >> 24) & 0xff;
+    int scaled_alpha = ceilf(alpha * (65536.f / 255.f / 255.f));
+    const __m512i Alpha = _mm512_set1_epi16(scaled_alpha);
+
+    const __m512i R = _mm512_set1_epi16((color >> 16) & 0xff);
+    const __m512i G = _mm512_set1_epi16((color >> 8) & 0xff);
+    const __m512i B = _mm512_set1_epi16(color & 0xff);
+
+    const int blk_cnt = gray_buf->blk_cnt;
+    for (int i = 0; i < blk_cnt; i += 2) {
+        const int off0 = gray_buf->blklist[i];
+        const int off1 = gray_buf->blklist[std::min(i + 1, blk_cnt - 1)];
+
+        __m128i Gray0 = gray_buf->buf[off0];
+        __m128i Gray1 = gray_buf->buf[off1];
+        __m512i Gray = _mm512_cvtepu8_epi16(  // vpmovzxbw
+            _mm256_set_m128i(Gray1, Gray0));  // vinserti128
+        gray_buf->buf[off0] = zeros;
+        gray_buf->buf[off1] = zeros;
+
+        // Update `hovermap` for pixels being updated.
+        __mmask16 mask0 = _mm_test_epi8_mask(Gray0, Gray0);  // vptestmb
+        __mmask16 mask1 = _mm_test_epi8_mask(Gray1, Gray1);  // vptestmb
+        _mm512_mask_storeu_epi32(&hovermap[off0 * 2], mask0, L);  // vmovdqu32
+        _mm512_mask_storeu_epi32(&hovermap[off1 * 2], mask1, L);  // vmovdqu32
+
+        // Now update RGB colors in `buf`.
+        __m512i R0 = load_blks(buf, off0 * 3, off1 * 3);
+        __m512i G0 = load_blks(buf, off0 * 3 + 1, off1 * 3 + 1);
+        __m512i B0 = load_blks(buf, off0 * 3 + 2, off1 * 3 + 2);
+
+        store_blks(buf, off0 * 3, off1 * 3,
+                   blend_channel(R, R0, Gray, Alpha));
+        store_blks(buf, off0 * 3 + 1, off1 * 3 + 1,
+                   blend_channel(G, G0, Gray, Alpha));
+        store_blks(buf, off0 * 3 + 2, off1 * 3 + 2,
+                   blend_channel(B, B0, Gray, Alpha));
+    }
+
+    // Clear the blocklist for `gray_buf`.
+    gray_buf->blk_cnt = 0;
+}
+
+// Same as above, but with the "white" channel instead of `hovermap`.
+void RgbaBuffer::merge_avx512(GrayscaleBuffer *gray_buf, uint32_t color)
+{
+    const __m128i zeros = _mm_setzero_si128();
+
+    int alpha = (color >> 24) & 0xff;
+    int scaled_alpha = ceilf(alpha * (65536.f / 255.f / 255.f));
+    const __m512i Alpha = _mm512_set1_epi16(scaled_alpha);
+
+    const __m512i R = _mm512_set1_epi16((color >> 16) & 0xff);
+    const __m512i G = _mm512_set1_epi16((color >> 8) & 0xff);
+    const __m512i B = _mm512_set1_epi16(color & 0xff);
+    const __m512i W = _mm512_set1_epi16(0xff);
+
+    const int blk_cnt = gray_buf->blk_cnt;
+    for (int i = 0; i < blk_cnt; i += 2) {
+        const int off0 = gray_buf->blklist[i];
+        const int off1 = gray_buf->blklist[std::min(i + 1, blk_cnt - 1)];
+
+        __m512i Gray = _mm512_cvtepu8_epi16(  // vpmovzxbw
+            _mm256_set_m128i(gray_buf->buf[off1], gray_buf->buf[off0]));
+        gray_buf->buf[off0] = zeros;
+        gray_buf->buf[off1] = zeros;
+
+        __m512i R0 = load_blks(buf, off0 * 4, off1 * 4);
+        __m512i G0 = load_blks(buf, off0 * 4 + 1, off1 * 4 + 1);
+        __m512i B0 = load_blks(buf, off0 * 4 + 2, off1 * 4 + 2);
+        __m512i W0 = load_blks(buf, off0 * 4 + 3, off1 * 4 + 3);
+
+        // (W never decreases, so blend_channel() works for W, too.)
+        store_blks(buf, off0 * 4, off1 * 4,
+                   blend_channel(R, R0, Gray, Alpha));
+        store_blks(buf, off0 * 4 + 1, off1 * 4 + 1,
+                   blend_channel(G, G0, Gray, Alpha));
+        store_blks(buf, off0 * 4 + 2, off1 * 4 + 2,
+                   blend_channel(B, B0, Gray, Alpha));
+        store_blks(buf, off0 * 4 + 3, off1 * 4 + 3,
+                   blend_channel(W, W0, Gray, Alpha));
+    }
+
+    // Clear the blocklist for `gray_buf`.
+    gray_buf->blk_cnt = 0;
+}
+
+}  // namespace croquis
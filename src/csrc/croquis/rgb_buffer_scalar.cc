@@ -0,0 +1,276 @@
+// Scalar version of RgbBuffer::merge() and RgbaBuffer::merge(): see
+// rgb_buffer_avx2.cc for the algorithm.  Also contains the scalar version of
+// make_png_data().
+//
+// This file is compiled without any instruction set flags, so it runs on any
+// x86-64 CPU.  The results must be identical to other versions.
+
+#include <math.h>  // ceilf
+#include <stdint.h>  // int32_t, uint8_t, uint32_t
+#include <string.h>  // memcpy, memset
+
+#include <immintrin.h>
+
+#include "croquis/grayscale_buffer.h"
+#include "croquis/rgb_buffer.h"
+
+namespace croquis {
+
+// Compute C1 = C0 + (C - C0) * (Gray * Alpha) for one pixel of one channel: see
+// RgbBuffer::merge() in rgb_buffer.cc.
+static inline uint8_t blend(int C, int C0, int gray, int scaled_alpha)
+{
+    const int dC = C - C0;
+    const int abs_dC = (((dC < 0 ? -dC : dC) * gray) * scaled_alpha) >> 16;
+    return C0 + (dC < 0 ? -abs_dC : abs_dC);
+}
+
+void RgbBuffer::merge_scalar(GrayscaleBuffer *gray_buf, int line_id,
+                             uint32_t color)
+{
+    int alpha = (color >> 24) & 0xff;
+    int scaled_alpha = ceilf(alpha * (65536.f / 255.f / 255.f));
+
+    const int R = (color >> 16) & 0xff;
+    const int G = (color >> 8) & 0xff;
+    const int B = color & 0xff;
+
+    const int blk_cnt = gray_buf->blk_cnt;
+    for (int i = 0; i < blk_cnt; i++) {
+        const int offset = gray_buf->blklist[i];
+        const uint8_t *gray = (const uint8_t *) &gray_buf->buf[offset];
+        int32_t *hmap = (int32_t *) &hovermap[offset * 2];
+        uint8_t *R0 = (uint8_t *) &buf[offset * 3];
+        uint8_t *G0 = (uint8_t *) &buf[offset * 3 + 1];
+        uint8_t *B0 = (uint8_t *) &buf[offset * 3 + 2];
+
+        for (int j = 0; j < 16; j++) {
+            if (gray[j] == 0) continue;
+            hmap[j] = line_id;
+            R0[j] = blend(R, R0[j], gray[j], scaled_alpha);
+            G0[j] = blend(G, G0[j], gray[j], scaled_alpha);
+            B0[j] = blend(B, B0[j], gray[j], scaled_alpha);
+        }
+
+        memset(&gray_buf->buf[offset], 0x00, sizeof(gray_buf->buf[offset]));
+    }
+
+    // Clear the blocklist for `gray_buf`.
+    gray_buf->blk_cnt = 0;
+}
+
+// Same as above, but with the "white" channel instead of `hovermap`.
+void RgbaBuffer::merge_scalar(GrayscaleBuffer *gray_buf, uint32_t color)
+{
+    int alpha = (color >> 24) & 0xff;
+    int scaled_alpha = ceilf(alpha * (65536.f / 255.f / 255.f));
+
+    const int R = (color >> 16) & 0xff;
+    const int G = (color >> 8) & 0xff;
+    const int B = color & 0xff;
+
+    const int blk_cnt = gray_buf->blk_cnt;
+    for (int i = 0; i < blk_cnt; i++) {
+        const int offset = gray_buf->blklist[i];
+        const uint8_t *gray = (const uint8_t *) &gray_buf->buf[offset];
+        uint8_t *R0 = (uint8_t *) &buf[offset * 4];
+        uint8_t *G0 = (uint8_t *) &buf[offset * 4 + 1];
+        uint8_t *B0 = (uint8_t *) &buf[offset * 4 + 2];
+        uint8_t *W0 = (uint8_t *) &buf[offset * 4 + 3];
+
+        // (W never decreases, so blend() works for W, too.)
+        for (int j = 0; j < 16; j++) {
+            R0[j] = blend(R, R0[j], gray[j], scaled_alpha);
+            G0[j] = blend(G, G0[j], gray[j], scaled_alpha);
+            B0[j] = blend(B, B0[j], gray[j], scaled_alpha);
+            W0[j] = blend(0xff, W0[j], gray[j], scaled_alpha);
+        }
+
+        memset(&gray_buf->buf[offset], 0x00, sizeof(gray_buf->buf[offset]));
+    }
+
+    // Clear the blocklist for `gray_buf`.
+    gray_buf->blk_cnt = 0;
+}
+
+// This is the original implementation before we had AVX2 version.  The
+// compiler does a reasonable job with it.
+void RgbBuffer::make_png_rows_scalar(char *dest) const
+{
+    const int TS = tile_size();
+
+    // `line_buf` holds six single-color lines.  The first three is for even
+    // rows, and the next is for odd rows.  E.g., for 256x256 tiles, after
+    // processing line #0 and #1:
+    //      line_buf[0..255]    : line #0 R
+    //      line_buf[256..511]  : line #0 G
+    //      line_buf[512..767]  : line #0 B
+    //      line_buf[768..1023] : line #1 R
+    //      line_buf[1024..1279]: line #1 G
+    //      line_buf[1280..1535]: line #1 B
+    char line_buf[6 * MAX_TILE_SIZE];
+    memset(line_buf, 0, sizeof(line_buf));
+
+    for (int row = 0; row < TS; row++) {
+        *(dest++) = (row == 0) ? 0 : 2;
+
+        char *this_line = line_buf + ((row % 2) ? 3 * TS : 0);
+        char *prev_line = line_buf + ((row % 2) ? 0 : 3 * TS);
+
+        // Read the current row from blocks, and re-arrange them into three
+        // lines (one each for R, G, B).
+        char *line_ptr = this_line;
+        char *src = (char *) buf + (TS * 4 * 3 * (row / 4)) + (4 * (row % 4));
+        for (int i = 0; i < TS / 4; i++) {
+            memcpy(line_ptr, src, 4);  // R
+            memcpy(line_ptr + TS, src + 16, 4);  // G
+            memcpy(line_ptr + 2 * TS, src + 32, 4);  // B
+            line_ptr += 4;
+            src += 48;
+        }
+
+        // Compute the difference from the previous line and emit to `dest`.
+        line_ptr = this_line;
+        char *prev_ptr = prev_line;
+        for (int i = 0; i < TS; i++) {
+            // Emitting R, G, B.
+            *(dest++) = ((uint8_t) line_ptr[0]) - ((uint8_t) prev_ptr[0]);
+            *(dest++) = ((uint8_t) line_ptr[TS]) - ((uint8_t) prev_ptr[TS]);
+            *(dest++) =
+                ((uint8_t) line_ptr[2 * TS]) - ((uint8_t) prev_ptr[2 * TS]);
+
+            line_ptr++;
+            prev_ptr++;
+        }
+    }
+}
+
+// Compute the multipliers for converting RGBW to RGBA, for eight pixels (W
+// values are 16-bit).  We simply use SSE2 (which every x86-64 CPU supports).
+static inline __m128i unpremultiply_mult(__m128i W)
+{
+    const __m128 mult = _mm_set1_ps(255 * 256.f);
+    const __m128i zeros = _mm_setzero_si128();
+
+    // Force nonzero to avoid division by zero.
+    W = _mm_max_epi16(W, _mm_set1_epi16(0x01));  // pmaxsw
+
+    // (punpcklwd, cvtdq2ps) x2
+    __m128 WL = _mm_cvtepi32_ps(_mm_unpacklo_epi16(W, zeros));
+    __m128 WH = _mm_cvtepi32_ps(_mm_unpackhi_epi16(W, zeros));
+
+    __m128 WL_reci = _mm_rcp_ps(WL);  // rcpps
+    __m128 WH_reci = _mm_rcp_ps(WH);  // rcpps
+
+    __m128 WL_mult = _mm_mul_ps(WL_reci, mult);  // mulps
+    __m128 WH_mult = _mm_mul_ps(WH_reci, mult);  // mulps
+
+    // NOTE: The rounding mode of cvtps2dq depends on the MXCSR register - see
+    // the discussion on bitmap_buffer.cc.
+    __m128i WL_mult1 = _mm_cvtps_epi32(WL_mult);  // cvtps2dq
+    __m128i WH_mult1 = _mm_cvtps_epi32(WH_mult);  // cvtps2dq
+    return _mm_packs_epi32(WL_mult1, WH_mult1);  // packssdw
+}
+
+// Other implementations use the same multipliers via this table, so that the
+// results are identical.
+const int32_t *RgbaBuffer::unpremultiply_table()
+{
+    struct Table {
+        alignas(16) int32_t v[256];
+
+        Table() {
+            const __m128i zeros = _mm_setzero_si128();
+            for (int w = 0; w < 256; w += 8) {
+                __m128i M = unpremultiply_mult(_mm_setr_epi16(
+                    w, w + 1, w + 2, w + 3, w + 4, w + 5, w + 6, w + 7));
+                _mm_store_si128((__m128i *) (v + w),
+                                _mm_unpacklo_epi16(M, zeros));
+                _mm_store_si128((__m128i *) (v + w + 4),
+                                _mm_unpackhi_epi16(M, zeros));
+            }
+        }
+    };
+
+    static const Table table;
+    return table.v;
+}
+
+// Same as RgbBuffer::make_png_rows_scalar(), but also converts RGBW to RGBA.
+void RgbaBuffer::make_png_rows_scalar(char *dest) const
+{
+    const int TS = tile_size();
+
+    alignas(16) char line_buf[8 * MAX_TILE_SIZE];
+    memset(line_buf, 0, sizeof(line_buf));
+
+    const __m128i zeros = _mm_setzero_si128();
+    for (int row = 0; row < TS; row++) {
+        *(dest++) = (row == 0) ? 0 : 2;
+
+        char *this_line = line_buf + ((row % 2) ? 4 * TS : 0);
+        char *prev_line = line_buf + ((row % 2) ? 0 : 4 * TS);
+
+        // Read the current row from blocks, and re-arrange them into four
+        // lines (one each for R, G, B, W).
+        char *line_ptr = this_line;
+        char *src = (char *) buf + (TS * 4 * 4 * (row / 4)) + (4 * (row % 4));
+        for (int i = 0; i < TS / 4; i++) {
+            memcpy(line_ptr, src, 4);  // R
+            memcpy(line_ptr + TS, src + 16, 4);  // G
+            memcpy(line_ptr + 2 * TS, src + 32, 4);  // B
+            memcpy(line_ptr + 3 * TS, src + 48, 4);  // A
+            line_ptr += 4;
+            src += 64;
+        }
+
+        // Convert RGBW to RGBA, eight pixels at a time.
+        line_ptr = this_line;
+        for (int i = 0; i < TS / 8; i++) {
+            // (movq x4, punpcklbw x4)
+            __m128i R = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *) line_ptr), zeros);
+            __m128i G = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *) (line_ptr + TS)), zeros);
+            __m128i B = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *) (line_ptr + 2 * TS)), zeros);
+            __m128i W = _mm_unpacklo_epi8(
+                _mm_loadl_epi64((const __m128i *) (line_ptr + 3 * TS)), zeros);
+            __m128i W_mult = unpremultiply_mult(W);
+
+            // Compute (R * W_mult) >> 8, etc.
+            R = _mm_srli_epi16(_mm_mullo_epi16(W_mult, R), 8);  // pmullw, psrlw
+            G = _mm_srli_epi16(_mm_mullo_epi16(W_mult, G), 8);  // pmullw, psrlw
+            B = _mm_srli_epi16(_mm_mullo_epi16(W_mult, B), 8);  // pmullw, psrlw
+
+            // Pack back to 8-bit values. (packuswb, movq) x3
+            _mm_storel_epi64((__m128i *) line_ptr, _mm_packus_epi16(R, R));
+            _mm_storel_epi64((__m128i *) (line_ptr + TS),
+                             _mm_packus_epi16(G, G));
+            _mm_storel_epi64((__m128i *) (line_ptr + 2 * TS),
+                             _mm_packus_epi16(B, B));
+
+            line_ptr += 8;
+        }
+
+        // Compute the difference from the previous line and emit to `dest`.
+        // TODO: Not sure why but clang can't vectorize this?
+        //       (Clang does vectorize the same loop in RgbBuffer ...)
+        line_ptr = this_line;
+        char *prev_ptr = prev_line;
+        for (int i = 0; i < TS; i++) {
+            // Emitting R, G, B, A.
+            *(dest++) = ((uint8_t) line_ptr[0]) - ((uint8_t) prev_ptr[0]);
+            *(dest++) = ((uint8_t) line_ptr[TS]) - ((uint8_t) prev_ptr[TS]);
+            *(dest++) =
+                ((uint8_t) line_ptr[2 * TS]) - ((uint8_t) prev_ptr[2 * TS]);
+            *(dest++) =
+                ((uint8_t) line_ptr[3 * TS]) - ((uint8_t) prev_ptr[3 * TS]);
+
+            line_ptr++;
+            prev_ptr++;
+        }
+    }
+}
+
+}  // namespace croquis
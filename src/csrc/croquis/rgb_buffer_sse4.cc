@@ -0,0 +1,120 @@
+// SSE4 version of RgbBuffer::merge() and RgbaBuffer::merge(): see
+// rgb_buffer_avx2.cc for the algorithm.
+//
+// This file is compiled with SSE4.2 flags, and only called if the CPU supports
+// it (see util/cpu_features.h).  The results must be identical to other
+// versions.
+
+#include <math.h>  // ceilf
+#include <stdint.h>  // uint32_t
+
+#include <immintrin.h>
+
+#include "croquis/grayscale_buffer.h"
+#include "croquis/rgb_buffer.h"
+
+namespace croquis {
+
+// Compute C1 = C0 + (C - C0) * (Gray * Alpha) for eight pixels of one channel.
+static inline __m128i blend_channel(__m128i C, __m128i C0,
+                                    __m128i Gray, __m128i Alpha)
+{
+    __m128i dC = _mm_sub_epi16(C, C0);  // psubw
+    __m128i abs_dC = _mm_abs_epi16(dC);  // pabsw
+    abs_dC = _mm_mullo_epi16(Gray, abs_dC);  // pmullw
+    abs_dC = _mm_mulhi_epu16(Alpha, abs_dC);  // pmulhuw
+    dC = _mm_sign_epi16(abs_dC, dC);  // psignw
+    return _mm_add_epi16(C0, dC);  // paddw
+}
+
+// Apply blend_channel() to a 4x4 block (16 pixels) at `blk`.  `GrayL` and
+// `GrayH` are the lower and higher eight pixels of `gray_buf`, respectively.
+static inline void blend_blk(__m128i *blk, __m128i C,
+                             __m128i GrayL, __m128i GrayH, __m128i Alpha)
+{
+    __m128i C0 = *blk;
+    __m128i C0L = _mm_cvtepu8_epi16(C0);  // pmovzxbw
+    __m128i C0H = _mm_cvtepu8_epi16(_mm_bsrli_si128(C0, 8));  // psrldq, ...
+
+    *blk = _mm_packus_epi16(  // packuswb
+        blend_channel(C, C0L, GrayL, Alpha),
+        blend_channel(C, C0H, GrayH, Alpha));
+}
+
+void RgbBuffer::merge_sse4(GrayscaleBuffer *gray_buf, int line_id,
+                           uint32_t color)
+{
+    const __m128i zeros = _mm_setzero_si128();
+    const __m128i L = _mm_set1_epi32(line_id);
+
+    int alpha = (color >> 24) & 0xff;
+    int scaled_alpha = ceilf(alpha * (65536.f / 255.f / 255.f));
+    const __m128i Alpha = _mm_set1_epi16(scaled_alpha);
+
+    const __m128i R = _mm_set1_epi16((color >> 16) & 0xff);
+    const __m128i G = _mm_set1_epi16((color >> 8) & 0xff);
+    const __m128i B = _mm_set1_epi16(color & 0xff);
+
+    const int blk_cnt = gray_buf->blk_cnt;
+    for (int i = 0; i < blk_cnt; i++) {
+        int offset = gray_buf->blklist[i];
+
+        __m128i Gray0 = gray_buf->buf[offset];
+        __m128i GrayL = _mm_cvtepu8_epi16(Gray0);  // pmovzxbw
+        __m128i GrayH = _mm_cvtepu8_epi16(_mm_bsrli_si128(Gray0, 8));
+        gray_buf->buf[offset] = zeros;
+
+        // Update `hovermap` for pixels being updated, four pixels at a time.
+        __m128i mask = _mm_cmpeq_epi8(Gray0, zeros);  // pcmpeqb
+        __m128i *hmap = (__m128i *) &hovermap[offset * 2];
+        for (int j = 0; j < 4; j++) {
+            __m128i mask1 = _mm_cvtepi8_epi32(mask);  // pmovsxbd
+            hmap[j] = _mm_blendv_epi8(L, hmap[j], mask1);  // pblendvb
+            mask = _mm_bsrli_si128(mask, 4);  // psrldq
+        }
+
+        // Now update RGB colors in `buf`.
+        blend_blk(&buf[offset * 3], R, GrayL, GrayH, Alpha);
+        blend_blk(&buf[offset * 3 + 1], G, GrayL, GrayH, Alpha);
+        blend_blk(&buf[offset * 3 + 2], B, GrayL, GrayH, Alpha);
+    }
+
+    // Clear the blocklist for `gray_buf`.
+    gray_buf->blk_cnt = 0;
+}
+
+// Same as above, but with the "white" channel instead of `hovermap`.
+void RgbaBuffer::merge_sse4(GrayscaleBuffer *gray_buf, uint32_t color)
+{
+    const __m128i zeros = _mm_setzero_si128();
+
+    int alpha = (color >> 24) & 0xff;
+    int scaled_alpha = ceilf(alpha * (65536.f / 255.f / 255.f));
+    const __m128i Alpha = _mm_set1_epi16(scaled_alpha);
+
+    const __m128i R = _mm_set1_epi16((color >> 16) & 0xff);
+    const __m128i G = _mm_set1_epi16((color >> 8) & 0xff);
+    const __m128i B = _mm_set1_epi16(color & 0xff);
+    const __m128i W = _mm_set1_epi16(0xff);
+
+    const int blk_cnt = gray_buf->blk_cnt;
+    for (int i = 0; i < blk_cnt; i++) {
+        int offset = gray_buf->blklist[i];
+
+        __m128i Gray0 = gray_buf->buf[offset];
+        __m128i GrayL = _mm_cvtepu8_epi16(Gray0);  // pmovzxbw
+        __m128i GrayH = _mm_cvtepu8_epi16(_mm_bsrli_si128(Gray0, 8));
+        gray_buf->buf[offset] = zeros;
+
+        // (W never decreases, so blend_channel() works for W, too.)
+        blend_blk(&buf[offset * 4], R, GrayL, GrayH, Alpha);
+        blend_blk(&buf[offset * 4 + 1], G, GrayL, GrayH, Alpha);
+        blend_blk(&buf[offset * 4 + 2], B, GrayL, GrayH, Alpha);
+        blend_blk(&buf[offset * 4 + 3], W, GrayL, GrayH, Alpha);
+    }
+
+    // Clear the blocklist for `gray_buf`.
+    gray_buf->blk_cnt = 0;
+}
+
+}  // namespace croquis
@@ -0,0 +1,280 @@
+// Points drawn as markers only.
+
+#include "croquis/figure_data.h"
+
+#include <inttypes.h>  // PRId64
+#include <math.h>  // isnan
+
+#include <algorithm>  // max
+#include <tuple>  // tie
+
+#include "croquis/grayscale_buffer.h"  // GrayscaleBuffer
+#include "croquis/intersection_finder.h"
+#include "croquis/line_algorithm.h"
+#include "croquis/rgb_buffer.h"  // ColoredBufferBase
+#include "croquis/util/logging.h"  // DBG_LOG1
+#include "croquis/util/thread_local_pool.h"
+
+#define DEBUG_FIG 0
+
+namespace croquis {
+
+Range2D ScatterData::range() const
+{
+    Range2D retval;
+    std::tie(retval.xmin, retval.xmax) = X_.minmax();
+    std::tie(retval.ymin, retval.ymax) = Y_.minmax();
+
+    return retval;
+}
+
+void ScatterData::build_index()
+{
+    index_.build(total_pts_cnt_,
+                 [this](int64_t g, double *x, double *y) {
+                     *x = X_.get_double(X_.get(0, g));
+                     *y = Y_.get_double(Y_.get(0, g));
+                 },
+                 item_cnt,
+                 [this](int i) { return get_end_idx(i); });
+}
+
+std::pair<int64_t, int64_t> ScatterData::get_atom_idxs(int item_id)
+{
+    int rel_id = item_id - start_item_id;
+    return { start_atom_idx + get_start_idx(rel_id),
+             start_atom_idx + get_end_idx(rel_id) };
+}
+
+// Runs in the thread pool.
+void ScatterData::compute_intersection(
+         const PlotRequest &req,
+         const IntersectionResultSet<int32_t> *irs,
+         IntersectionResult<int32_t> *result)
+{
+    dispatch_xy_types(X_, Y_, [&](const auto &X, const auto &Y) {
+        compute_intersection_impl(X, Y, req, irs, result);
+    });
+}
+
+// Runs in the thread pool.
+void ScatterData::compute_intersection(
+         const PlotRequest &req,
+         const IntersectionResultSet<int64_t> *irs,
+         IntersectionResult<int64_t> *result)
+{
+    dispatch_xy_types(X_, Y_, [&](const auto &X, const auto &Y) {
+        compute_intersection_impl(X, Y, req, irs, result);
+    });
+}
+
+template<typename XBuf, typename YBuf, typename DType>
+void ScatterData::compute_intersection_impl(
+         const XBuf &X, const YBuf &Y,
+         const PlotRequest &req,
+         const IntersectionResultSet<DType> *irs,
+         IntersectionResult<DType> *result)
+{
+    // Transformation from input coordinates to "tile coordinates".
+    CanvasConfig::Transform tr = req.canvas.get_tile_transform(req.tile_size);
+
+    const float marker_radius = marker_size_ / (2.f * req.tile_size);
+
+    // Atom #(start_atom_idx + g) is point #g, so we can just iterate over the
+    // points without caring about items.
+    //
+    // NOTE: We record all items regardless of SelectionMap, so that the result
+    // can be reused when the selection changes: unselected items are skipped
+    // by paint().
+    const int64_t pt_start =
+        std::max(start_atom_idx, result->start_id) - start_atom_idx;
+    const int64_t pt_end =
+        std::min(start_atom_idx + atom_cnt, result->end_id) - start_atom_idx;
+
+    DBG_LOG1(DEBUG_FIG,
+             "compute_intersection() called: pt_start=%" PRId64 " "
+             "pt_end=%" PRId64,
+             pt_start, pt_end);
+
+    auto do_visit = [=](int x, int y, int64_t atom_idx) {
+        int buf_id = irs->get_buf_id(y, x);
+        if (buf_id != -1) result->append(buf_id, atom_idx);
+    };
+
+    const float xmin = irs->col_start() - 1.f;
+    const float xmax = irs->col_start() + irs->ncols();
+    const float ymin = irs->row_start() - 1.f;
+    const float ymax = irs->row_start() + irs->nrows();
+    auto clamp_x = [=](float x) { return std::min(std::max(x, xmin), xmax); };
+    auto clamp_y = [=](float y) { return std::min(std::max(y, ymin), ymax); };
+
+    // Used to skip blocks of points that cannot intersect any of our tiles.
+    const SpatialIndex::Query query =
+        make_index_query(tr, irs, marker_radius);
+
+    // True if we need to consult the spatial index.
+    bool check_index = true;
+
+    for (int64_t g = pt_start; g < pt_end; ) {
+        // At each block boundary, skip blocks that cannot intersect.
+        if (check_index || (g & SpatialIndex::BLK_MASK) == 0) {
+            g = index_.next_candidate(g, pt_end, query);
+            if (g == pt_end) return;
+            check_index = false;
+        }
+
+        // Handle points until the next block boundary (or the end of the
+        // batch), up to eight at a time.
+        const int cnt = std::min<int64_t>({
+            8,
+            SpatialIndex::BLK_MASK + 1 - (g & SpatialIndex::BLK_MASK),
+            pt_end - g,
+        });
+
+        float tx[8], ty[8];
+        X.get_transformed_n(X.get(0, g), cnt, tr.xscale, tr.xbias, tx);
+        Y.get_transformed_n(Y.get(0, g), cnt, tr.yscale, tr.ybias, ty);
+
+        // Markers that stay inside a single tile (which is the common case
+        // unless we're zoomed in) only need one lookup.
+        int tile_x[8], tile_y[8];
+        const int single_tile =
+            (cnt == 8) ? find_single_tile_points(tx, ty, marker_radius,
+                                                 tile_x, tile_y)
+                       : 0;
+
+        for (int i = 0; i < cnt; i++) {
+            const int64_t atom_idx = start_atom_idx + g + i;
+            if (single_tile & (1 << i)) {
+                do_visit(tile_x[i], tile_y[i], atom_idx);
+                continue;
+            }
+            if (isnan(tx[i]) || isnan(ty[i])) continue;
+
+            // Visit every tile the marker overlaps: usually up to four, but a
+            // marker may be larger than a tile.  Coordinates are clamped to
+            // just outside `irs`, so that we don't loop over (or overflow on)
+            // far-away tiles.
+            const int txi0 = nearbyintf(clamp_x(tx[i] - marker_radius));
+            const int txi1 = nearbyintf(clamp_x(tx[i] + marker_radius));
+            const int tyi0 = nearbyintf(clamp_y(ty[i] - marker_radius));
+            const int tyi1 = nearbyintf(clamp_y(ty[i] + marker_radius));
+
+            for (int y = tyi0; y <= tyi1; y++) {
+                for (int x = txi0; x <= txi1; x++)
+                    do_visit(x, y, atom_idx);
+            }
+        }
+
+        g += cnt;
+    }
+}
+
+// Runs in the thread pool.
+ScatterData::IrsIter32_t
+ScatterData::paint(ColoredBufferBase *tile, const PlotRequest &req,
+                   const SelectionMap &sm,
+                   IrsIter32_t iter, int row, int col)
+{
+    return dispatch_xy_types(X_, Y_, [&](const auto &X, const auto &Y) {
+        return paint_impl(X, Y, tile, req, sm, iter, row, col);
+    });
+}
+
+// Runs in the thread pool.
+ScatterData::IrsIter64_t
+ScatterData::paint(ColoredBufferBase *tile, const PlotRequest &req,
+                   const SelectionMap &sm,
+                   IrsIter64_t iter, int row, int col)
+{
+    return dispatch_xy_types(X_, Y_, [&](const auto &X, const auto &Y) {
+        return paint_impl(X, Y, tile, req, sm, iter, row, col);
+    });
+}
+
+template<typename XBuf, typename YBuf, typename IrsIter>
+IrsIter
+ScatterData::paint_impl(const XBuf &X, const YBuf &Y,
+                        ColoredBufferBase *tile, const PlotRequest &req,
+                        const SelectionMap &sm,
+                        IrsIter iter, int row, int col)
+{
+    if (!iter.has_next()) return iter;
+
+    // Transformation from input to pixel coordinates.
+    CanvasConfig::Transform tr = req.canvas.get_transform();
+    tr.xbias -= col * req.tile_size;
+    tr.ybias -= row * req.tile_size;
+
+    auto gray_buf =
+        util::ThreadLocalPool<GrayscaleBuffer>::acquire(req.tile_size);
+
+    // Transformed coordinates of the markers being drawn.
+    float tx[MAX_MARKER_BATCH], ty[MAX_MARKER_BATCH];
+
+    // Remember `item_id` of the previous atom so that we can reuse `gray_buf`
+    // for points of the same item.
+    int prev_id = -1;
+
+    int64_t g = iter.peek() - start_atom_idx;
+    int rel_item_id = find_item(g);
+    int64_t end_idx = get_end_idx(rel_item_id);
+
+    while (true) {
+        if (!iter.has_next() || iter.peek() >= start_atom_idx + atom_cnt) break;
+        g = iter.get_next() - start_atom_idx;
+
+        // Keep `rel_item_id` in sync with `g`: try the next item first, and
+        // use binary search if we skipped further.
+        if (g >= end_idx) {
+            rel_item_id++;
+            CHECK(rel_item_id < item_cnt);  // Sanity check.
+            end_idx = get_end_idx(rel_item_id);
+            if (g >= end_idx) {
+                rel_item_id = find_item(g);
+                end_idx = get_end_idx(rel_item_id);
+            }
+            CHECK(g >= get_start_idx(rel_item_id) && g < end_idx);
+        }
+
+        // Skip unselected items.  (For single-item highlight tiles, we do not
+        // care about selected items because the item was explicitly
+        // requested.)
+        if (req.uses_selection() && !sm.m[start_item_id + rel_item_id])
+            continue;
+
+        // For highlight tiles, `line_id` is unused, so we can draw all items of
+        // the same color together and merge them once.
+        if (prev_id != -1 && prev_id != rel_item_id &&
+            !(req.is_highlight() &&
+              colors_.get_argb(rel_item_id) == colors_.get_argb(prev_id))) {
+            CHECK(prev_id < rel_item_id);
+            uint32_t color = colors_.get_argb(prev_id);
+            tile->merge(gray_buf.get(), start_item_id + prev_id, color);
+        }
+        prev_id = rel_item_id;
+
+        // Draw consecutive points of the same item together, so that we can
+        // transform them in bulk.
+        int cnt = 1;
+        while (cnt < MAX_MARKER_BATCH && g + cnt < end_idx &&
+               iter.has_next() && iter.peek() == start_atom_idx + g + cnt) {
+            iter.get_next();
+            cnt++;
+        }
+
+        X.get_transformed_n(X.get(0, g), cnt, tr.xscale, tr.xbias, tx);
+        Y.get_transformed_n(Y.get(0, g), cnt, tr.yscale, tr.ybias, ty);
+        for (int i = 0; i < cnt; i++)
+            gray_buf->draw_circle(tx[i], ty[i], marker_sprites_);
+    }
+
+    if (prev_id != -1) {
+        uint32_t color = colors_.get_argb(prev_id);
+        tile->merge(gray_buf.get(), start_item_id + prev_id, color);
+    }
+
+    return iter;
+}
+
+} // namespace croquis
@@ -0,0 +1,65 @@
+// A spatial index over a sequence of points.
+
+#include "croquis/spatial_index.h"
+
+#include <math.h>  // fabs
+
+#include <algorithm>  // max, swap
+
+namespace croquis {
+
+// Tolerance for comparing boxes in tile coordinates.  Actual coordinates are
+// computed in single precision (see GenericBuffer2D::get_transformed()), so
+// we need some slack to stay on the safe side.
+static const double ABS_EPS = 1e-3;
+static const double REL_EPS = 1e-6;
+
+bool SpatialIndex::intersects(const Box &b, const Query &q)
+{
+    if (b.xmin > b.xmax) return false;  // Empty box.
+
+    double x0 = q.xscale * b.xmin + q.xbias;
+    double x1 = q.xscale * b.xmax + q.xbias;
+    if (x0 > x1) std::swap(x0, x1);
+    double xeps = ABS_EPS + REL_EPS * (fabs(x0) + fabs(x1) + fabs(q.xbias));
+    if (!(x0 - xeps <= q.xmax && x1 + xeps >= q.xmin)) return false;
+
+    double y0 = q.yscale * b.ymin + q.ybias;
+    double y1 = q.yscale * b.ymax + q.ybias;
+    if (y0 > y1) std::swap(y0, y1);
+    double yeps = ABS_EPS + REL_EPS * (fabs(y0) + fabs(y1) + fabs(q.ybias));
+    return (y0 - yeps <= q.ymax && y1 + yeps >= q.ymin);
+}
+
+int64_t SpatialIndex::next_candidate(int64_t g, int64_t end,
+                                     const Query &q) const
+{
+    if (levels_.empty()) return g;
+
+    const int nlevels = levels_.size();
+    end = std::min(end, pts_cnt_);
+
+    while (g < end) {
+        // Go up as long as `g` is at the start of a larger box.
+        int level = 0;
+        while (level + 1 < nlevels &&
+               (g & ((int64_t(1) << level_shift(level + 1)) - 1)) == 0)
+            level++;
+
+        // Now go down until we find a block that may intersect, or a box that
+        // doesn't (in which case we skip the box entirely).
+        while (true) {
+            const int64_t idx = g >> level_shift(level);
+            if (!intersects(levels_[level][idx], q)) {
+                g = (idx + 1) << level_shift(level);
+                break;
+            }
+            if (level == 0) return g;
+            level--;
+        }
+    }
+
+    return end;
+}
+
+} // namespace croquis
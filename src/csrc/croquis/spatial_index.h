@@ -0,0 +1,177 @@
+// A spatial index over a sequence of points, used to skip parts of the data
+// that cannot intersect the tiles being computed.
+
+#pragma once
+
+#include <math.h>  // isnan, INFINITY
+#include <stdint.h>  // int64_t
+
+#include <algorithm>  // min
+#include <utility>  // move
+#include <vector>
+
+#include "croquis/canvas.h"  // CanvasConfig
+
+namespace croquis {
+
+// The index treats the data as a linear sequence of points (indexed by a
+// 64-bit integer `g`), because that's how atoms are laid out: for each line,
+// segment #i connects points #i and #(i+1), and marker #i sits at point #i.
+//
+// Points are grouped into "blocks" of 64 points, and we remember the bounding
+// box of each block: the box for block #k covers points [64k, 64(k+1)] (note
+// the inclusive upper end), so that it also covers every segment starting
+// inside the block.  The boxes are again grouped by 16 to make the next level,
+// and so on, until we end up with a single box.
+//
+// It means that the index doesn't care whether consecutive points actually
+// belong to the same line: if they don't, we just get a slightly larger box,
+// which is harmless.
+//
+// NaN points are ignored (they are never drawn); a block made only of NaN
+// points gets an "empty" box, which never intersects anything.
+//
+// Optionally, we also keep the bounding box of each item (i.e., line), so that
+// we can skip an item entirely in O(1) when none of it is visible.
+class SpatialIndex {
+  public:
+    enum {
+        BLK_SHIFT = 6,  // 64 points per block.
+        BLK_MASK = (1 << BLK_SHIFT) - 1,
+        FANOUT_SHIFT = 4,  // 16 children per box.
+    };
+
+    // Query box, in tile coordinates.  Holds a copy of the transformation
+    // (from data to tile coordinates) so that we can test each box.
+    struct Query {
+        double xscale, xbias, yscale, ybias;
+        double xmin, ymin, xmax, ymax;
+
+        Query(const CanvasConfig::Transform &tr,
+              double xmin, double ymin, double xmax, double ymax)
+            : xscale(tr.xscale), xbias(tr.xbias),
+              yscale(tr.yscale), ybias(tr.ybias),
+              xmin(xmin), ymin(ymin), xmax(xmax), ymax(ymax) { }
+    };
+
+  private:
+    struct Box {
+        double xmin, ymin, xmax, ymax;
+
+        Box() : xmin(INFINITY), ymin(INFINITY),
+                xmax(-INFINITY), ymax(-INFINITY) { }
+
+        void add(double x, double y) {
+            if (isnan(x) || isnan(y)) return;
+            xmin = std::min(xmin, x);
+            ymin = std::min(ymin, y);
+            xmax = std::max(xmax, x);
+            ymax = std::max(ymax, y);
+        }
+
+        void merge(const Box &b) {
+            xmin = std::min(xmin, b.xmin);
+            ymin = std::min(ymin, b.ymin);
+            xmax = std::max(xmax, b.xmax);
+            ymax = std::max(ymax, b.ymax);
+        }
+    };
+
+    int64_t pts_cnt_ = 0;
+
+    // levels_[0] holds one box per block, levels_[1] one box per 16 blocks,
+    // and so on.  Empty if the index was not built.
+    std::vector<std::vector<Box>> levels_;
+
+    // Bounding box of each item (empty if not built).
+    std::vector<Box> item_boxes_;
+
+  public:
+    SpatialIndex() { }
+
+    bool empty() const { return levels_.empty(); }
+
+    // Build the index: `get_pt(g, &x, &y)` should return the coordinate of
+    // point #g, for 0 <= g < pts_cnt.  Points are visited in increasing
+    // order, but the same point may be visited twice in a row.
+    template<typename F> void build(int64_t pts_cnt, F get_pt) {
+        build(pts_cnt, get_pt, 0, [](int) { return int64_t(0); });
+    }
+
+    // Same as above, but also compute the bounding box of each item:
+    // `get_item_end(i)` should return the index of the point after the last
+    // point of item #i, for 0 <= i < item_cnt.  (Item #0 starts at point #0.)
+    template<typename F, typename G>
+    void build(int64_t pts_cnt, F get_pt, int item_cnt, G get_item_end);
+
+    // Return the smallest index g' in [g, end) such that the block containing
+    // g' may intersect the query box; returns `end` if there's none.
+    //
+    // The caller should process points from g' until the next block boundary
+    // (i.e., until g' is a multiple of 64), and then call this function again.
+    //
+    // If the index is empty, it simply returns `g`.
+    int64_t next_candidate(int64_t g, int64_t end, const Query &q) const;
+
+    // Returns false if item #i cannot intersect the query box.  Always returns
+    // true if item boxes were not built.
+    bool item_may_intersect(int i, const Query &q) const {
+        return item_boxes_.empty() || intersects(item_boxes_[i], q);
+    }
+
+  private:
+    static int level_shift(int level)
+    { return BLK_SHIFT + FANOUT_SHIFT * level; }
+
+    static bool intersects(const Box &b, const Query &q);
+};
+
+template<typename F, typename G>
+void SpatialIndex::build(int64_t pts_cnt, F get_pt,
+                         int item_cnt, G get_item_end)
+{
+    pts_cnt_ = pts_cnt;
+    levels_.clear();
+    item_boxes_.clear();
+    if (pts_cnt == 0) return;
+
+    const int64_t blk_cnt = ((pts_cnt - 1) >> BLK_SHIFT) + 1;
+    levels_.emplace_back(blk_cnt);
+    std::vector<Box> &blks = levels_[0];
+
+    // The current item, and the point after its last point.
+    item_boxes_.resize(item_cnt);
+    int item = 0;
+    int64_t item_end = (item_cnt > 0) ? get_item_end(0) : pts_cnt;
+
+    for (int64_t k = 0; k < blk_cnt; k++) {
+        const int64_t start = k << BLK_SHIFT;
+        const int64_t end = std::min(start + (1 << BLK_SHIFT), pts_cnt - 1);
+        Box &box = blks[k];
+        for (int64_t g = start; g <= end; g++) {
+            double x, y;
+            get_pt(g, &x, &y);
+            box.add(x, y);
+
+            // (Adding the same point twice is harmless.)
+            if (item_cnt > 0) {
+                while (g >= item_end && item < item_cnt - 1)
+                    item_end = get_item_end(++item);
+                item_boxes_[item].add(x, y);
+            }
+        }
+    }
+
+    // Build upper levels.
+    while (levels_.back().size() > 1) {
+        const std::vector<Box> &prev = levels_.back();
+        const size_t cnt = ((prev.size() - 1) >> FANOUT_SHIFT) + 1;
+        std::vector<Box> next(cnt);
+        for (size_t i = 0; i < prev.size(); i++)
+            next[i >> FANOUT_SHIFT].merge(prev[i]);
+
+        levels_.push_back(std::move(next));
+    }
+}
+
+} // namespace croquis
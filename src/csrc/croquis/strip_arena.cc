@@ -0,0 +1,99 @@
+// A process-wide pool of memory chunks for IntersectionResult.
+
+#include "croquis/strip_arena.h"
+
+#include <stdlib.h>  // posix_memalign, free
+
+#include <mutex>
+#include <vector>
+
+#include "croquis/util/macros.h"  // CHECK
+
+namespace croquis {
+
+// Maximum number of free chunks each thread keeps.
+static const size_t THREAD_CACHE_MAX = 8;  // = 2 MB
+
+// Maximum number of free chunks in the global list: if we have more, chunks
+// are returned to the system.
+static const size_t GLOBAL_MAX = 64;  // = 16 MB
+
+static std::mutex global_m;
+static std::vector<void *> global_chunks;  // Guarded by `global_m`.
+
+// Move chunks from `chunks` to the global list, until `chunks` has at most
+// `keep` elements.
+static void move_to_global(std::vector<void *> *chunks, size_t keep)
+{
+    std::unique_lock<std::mutex> lck(global_m);
+    while (chunks->size() > keep) {
+        void *chunk = chunks->back();
+        chunks->pop_back();
+        if (global_chunks.size() < GLOBAL_MAX)
+            global_chunks.push_back(chunk);
+        else
+            free(chunk);
+    }
+}
+
+namespace {
+
+struct ThreadCache {
+    std::vector<void *> chunks;
+
+    ~ThreadCache() { move_to_global(&chunks, 0); }
+};
+
+}  // namespace
+
+static thread_local ThreadCache thread_cache;
+
+void *StripArena::alloc()
+{
+    std::vector<void *> &chunks = thread_cache.chunks;
+
+    if (chunks.empty()) {
+        // Grab some chunks from the global list.
+        std::unique_lock<std::mutex> lck(global_m);
+        while (!global_chunks.empty() &&
+               chunks.size() < THREAD_CACHE_MAX / 2) {
+            chunks.push_back(global_chunks.back());
+            global_chunks.pop_back();
+        }
+    }
+
+    if (!chunks.empty()) {
+        void *chunk = chunks.back();
+        chunks.pop_back();
+        return chunk;
+    }
+
+    void *chunk;
+    CHECK(posix_memalign(&chunk, 4096, CHUNK_SZ) == 0);
+    return chunk;
+}
+
+void StripArena::release(void *chunk)
+{
+    std::vector<void *> &chunks = thread_cache.chunks;
+
+    chunks.push_back(chunk);
+    if (chunks.size() > THREAD_CACHE_MAX)
+        move_to_global(&chunks, THREAD_CACHE_MAX / 2);
+}
+
+void StripArena::trim()
+{
+    std::vector<void *> &chunks = thread_cache.chunks;
+    for (void *chunk : chunks) free(chunk);
+    chunks.clear();
+
+    std::vector<void *> to_free;
+    {
+        std::unique_lock<std::mutex> lck(global_m);
+        to_free.swap(global_chunks);
+    }
+    for (void *chunk : to_free) free(chunk);
+}
+
+} // namespace croquis
@@ -0,0 +1,32 @@
+// A process-wide pool of memory chunks for IntersectionResult.
+
+#pragma once
+
+#include <stddef.h>  // size_t
+
+namespace croquis {
+
+// IntersectionResult allocates its buffers in "chunks" of a fixed size, and
+// frees them as soon as the tiles are drawn.  Instead of going through
+// malloc/free (and page faults) for every request, we recycle chunks here.
+//
+// Each thread keeps a small cache of free chunks, so that most allocations do
+// not need to grab the global mutex.  Chunks freed by one thread can be reused
+// by another thread via the global list.  Both are bounded, and Plotter calls
+// trim() when no request is in flight, so that an idle process does not keep
+// holding memory that was only needed for a burst of requests.
+//
+// Returned chunks are *not* initialized.
+class StripArena {
+  public:
+    enum { CHUNK_SZ = 256 * 1024 };  // Size of each chunk in bytes.
+
+    static void *alloc();
+    static void release(void *chunk);
+
+    // Return the free chunks in the global list (and the calling thread's
+    // cache) to the system.
+    static void trim();
+};
+
+} // namespace croquis
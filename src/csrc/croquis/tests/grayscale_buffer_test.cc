@@ -8,6 +8,7 @@
 #include <math.h>  // sqrtf
 #include <stdio.h>  // fopen
 #include <stdint.h>  // uint64_t
+#include <stdlib.h>  // abs
 #include <string.h>  // memcpy
 
 #include <immintrin.h>  // _mm_testz_si128
@@ -16,6 +17,7 @@
 #include <random>
 #include <unordered_set>
 
+#include "croquis/util/cpu_features.h"
 #include "croquis/util/string_printf.h"
 
 namespace croquis {
@@ -24,8 +26,8 @@ namespace croquis {
 static void write_bitmap(const GrayscaleBuffer &buf, const char *filename)
 {
     FILE *fp = fopen(filename, "wb");
-    for (int y = 0; y < 256; y++) {
-        for (int x = 0; x < 256; x++) {
+    for (int y = 0; y < buf.tile_size(); y++) {
+        for (int x = 0; x < buf.tile_size(); x++) {
             uint8_t pixel = buf.get_pixel(x, y);
             fwrite(&pixel, 1, 1, fp);
         }
@@ -41,8 +43,9 @@ static void do_test(GrayscaleBuffer *buf,
            x0, y0, x1, y1, width);
 #endif
 
-    GrayscaleBuffer before;
-    memcpy(before.buf, buf->buf, sizeof(buf->buf));
+    const int TS = buf->tile_size();
+    GrayscaleBuffer before(TS);
+    memcpy(before.buf, buf->buf, buf->tile_blk_cnt() * sizeof(__m128i));
 
     buf->draw_line(x0, y0, x1, y1, width);
 
@@ -91,8 +94,8 @@ static void do_test(GrayscaleBuffer *buf,
            xmin0, xmin1, xmax0, xmax1, ymin0, ymin1, ymax0, ymax1);
 #endif
 
-    for (int y = 0; y < 256; y++) {
-        for (int x = 0; x < 256; x++) {
+    for (int y = 0; y < TS; y++) {
+        for (int x = 0; x < TS; x++) {
             uint8_t orig, pixel;
             if (xyflip) {
                 orig = before.get_pixel(y, x);
@@ -143,9 +146,10 @@ static void do_test(GrayscaleBuffer *buf,
         blks.insert(blk_id);
     }
 
-    for (int blk_id = 0; blk_id < GrayscaleBuffer::BLK_CNT; blk_id++) {
+    for (int blk_id = 0; blk_id < buf->tile_blk_cnt(); blk_id++) {
         __m128i blk = buf->buf[blk_id];
-        bool is_zero = _mm_testz_si128(blk, blk);
+        bool is_zero = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(blk, _mm_setzero_si128())) == 0xffff;
         assert(blks.count(blk_id) == !is_zero);
     }
 }
@@ -178,8 +182,11 @@ static void test_random_lines()
     std::uniform_real_distribution<float> width_dist(0.0, 5.0);
 
     for (int n = 0; n < 20; n++) {
-        printf("Running random test iteration #%d ...\n", n);
-        GrayscaleBuffer buf;
+        // Also test other tile sizes for the last few iterations.
+        const int tile_size = (n < 16) ? 256 : (n % 2) ? 128 : 512;
+        printf("Running random test iteration #%d (tile size %d) ...\n",
+               n, tile_size);
+        GrayscaleBuffer buf(tile_size);
 
         for (int i = 0; i < 200; i++) {
             float x0 = coord_dist(gen);
@@ -203,10 +210,111 @@ static void test_random_lines()
     }
 }
 
+// Check that every implementation gives the same result as the scalar version.
+static void test_isa()
+{
+    const util::Isa orig_isa = util::cpu_features.isa;
+    for (int isa = (int) util::Isa::SSE4; isa <= (int) orig_isa; isa++) {
+        for (int tile_size : { 128, 256, 512 }) {
+            std::mt19937 gen(87654321);  // Random number generator.
+            std::normal_distribution<float> coord_dist(128.0, 200.0);
+            std::uniform_real_distribution<float> width_dist(0.0, 5.0);
+
+            GrayscaleBuffer buf1(tile_size), buf2(tile_size);
+            for (int i = 0; i < 2000; i++) {
+                float x0 = coord_dist(gen);
+                float y0 = coord_dist(gen);
+                float x1 = coord_dist(gen);
+                float y1 = coord_dist(gen);
+                float width = width_dist(gen);
+                if (width_dist(gen) < 0.5) width *= 10;
+
+                util::cpu_features.isa = util::Isa::SCALAR;
+                buf1.draw_line(x0, y0, x1, y1, width);
+                buf1.draw_circle(x0, y0, width);
+
+                util::cpu_features.isa = (util::Isa) isa;
+                buf2.draw_line(x0, y0, x1, y1, width);
+                buf2.draw_circle(x0, y0, width);
+            }
+
+            assert(memcmp(buf1.buf, buf2.buf,
+                          buf1.tile_blk_cnt() * sizeof(__m128i)) == 0);
+            assert(buf1.blk_cnt == buf2.blk_cnt);
+            assert(memcmp(buf1.blklist, buf2.blklist,
+                          buf1.blk_cnt * sizeof(buf1.blklist[0])) == 0);
+        }
+    }
+
+    util::cpu_features.isa = orig_isa;
+}
+
+// Check that draw_polyline() gives the same result as drawing each segment
+// separately, including segments that are skipped for being outside.
+static void test_polyline()
+{
+    std::mt19937 gen(13572468);  // Random number generator.
+    std::normal_distribution<float> step_dist(0.0, 20.0);
+    std::uniform_real_distribution<float> width_dist(0.0, 5.0);
+
+    for (int n = 0; n < 20; n++) {
+        const int pts_cnt = 500;
+        float xs[pts_cnt], ys[pts_cnt];
+        float x = 128.0, y = 128.0;
+        for (int i = 0; i < pts_cnt; i++) {
+            xs[i] = (x += step_dist(gen));
+            ys[i] = (y += step_dist(gen));
+        }
+        const float width = width_dist(gen);
+
+        GrayscaleBuffer buf1, buf2;
+        for (int i = 0; i < pts_cnt - 1; i++)
+            buf1.draw_line(xs[i], ys[i], xs[i + 1], ys[i + 1], width);
+        buf2.draw_polyline(xs, ys, pts_cnt, width);
+
+        assert(memcmp(buf1.buf, buf2.buf,
+                      buf1.tile_blk_cnt() * sizeof(__m128i)) == 0);
+        assert(buf1.blk_cnt == buf2.blk_cnt);
+    }
+}
+
+// Drawing circles with CircleSprites should be the same as drawing them after
+// rounding the center to 1/8 pixel.
+static void test_circle_sprites()
+{
+    std::mt19937 gen(24681357);  // Random number generator.
+    std::uniform_real_distribution<float> coord_dist(-10.0, 266.0);
+
+    for (float radius : { 0.5f, 1.5f, 2.f, 3.7f, 4.f, 6.f }) {
+        const CircleSprites sprites(radius);
+        assert(sprites.empty() == (radius > CircleSprites::MAX_RADIUS));
+
+        GrayscaleBuffer buf1, buf2;
+        for (int i = 0; i < 2000; i++) {
+            float x0 = coord_dist(gen);
+            float y0 = coord_dist(gen);
+            if (!sprites.empty()) {
+                x0 = nearbyintf(x0 * 8) / 8;
+                y0 = nearbyintf(y0 * 8) / 8;
+            }
+
+            buf1.draw_circle(x0, y0, radius);
+            buf2.draw_circle(x0, y0, sprites);
+        }
+
+        assert(memcmp(buf1.buf, buf2.buf,
+                      buf1.tile_blk_cnt() * sizeof(__m128i)) == 0);
+        assert(buf1.blk_cnt == buf2.blk_cnt);
+    }
+}
+
 static void run_test()
 {
     test_lines();
     test_random_lines();
+    test_isa();
+    test_polyline();
+    test_circle_sprites();
 }
 
 } // namespace croquis
@@ -0,0 +1,126 @@
+// Test IntersectionResult and IntersectionResultSet.
+
+#include "croquis/intersection_finder.h"
+
+#include <assert.h>
+#include <stdint.h>  // int64_t
+
+#include <algorithm>  // lower_bound
+#include <random>
+#include <vector>
+
+namespace croquis {
+
+// Append random runs of atoms to each tile, and check that we get them back.
+template<typename DType>
+static void test_random(int64_t start, int64_t end, int64_t batch_size,
+                        IrEncoding encoding)
+{
+    std::mt19937 gen(12345678);  // Random number generator.
+    std::uniform_int_distribution<int> coin(0, 99);
+
+    std::vector<int> prio_coords{ 0, 0, 0, 1 };
+    std::vector<int> reg_coords{ 1, 0, 1, 1, 2, 3 };
+    IntersectionResultSet<DType> irs(prio_coords, reg_coords,
+                                     start, end, batch_size, encoding);
+    const int tile_cnt = 5;
+
+    // Tile #0 gets everything (one long run), tile #1 gets nothing, and the
+    // rest get random subsets.
+    std::vector<std::vector<int64_t>> expected(tile_cnt);
+    for (auto &ir : irs.results) {
+        for (int64_t d = ir->start_id; d < ir->end_id; d++) {
+            for (int buf_id = 0; buf_id < tile_cnt; buf_id++) {
+                bool add = (buf_id == 0) ? true :
+                           (buf_id == 1) ? false :
+                                           (coin(gen) < 10 * buf_id);
+                if (!add) continue;
+                ir->append(buf_id, d);
+                ir->append(buf_id, d);  // Duplicates should be ignored.
+                expected[buf_id].push_back(d);
+            }
+        }
+    }
+
+    for (auto &ir : irs.results) ir->finish();
+
+    int64_t total = 0;
+    for (const auto &v : expected) total += v.size();
+    assert(irs.elem_cnt() == total);
+
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 4; col++) {
+            int buf_id = irs.get_buf_id(row, col);
+            if (buf_id == -1) continue;
+
+            std::vector<int64_t> result;
+            for (auto iter = irs.get_iter(buf_id); iter.has_next(); ) {
+                int64_t peek = iter.peek();
+                int64_t d = iter.get_next();
+                assert(d == peek);
+                result.push_back(d);
+            }
+            assert(result == expected[buf_id]);
+
+            // skip_run() should stop at the start of each run (runs may also
+            // be broken at batch boundaries), and count all elements.
+            const std::vector<int64_t> &v = expected[buf_id];
+            int64_t cnt = 0;
+            for (auto iter = irs.get_iter(buf_id); iter.has_next(); ) {
+                const int64_t d = iter.peek();
+                const int64_t idx = std::lower_bound(v.begin(), v.end(), d) -
+                                    v.begin();
+                assert(idx == cnt);
+                cnt += iter.skip_run();
+            }
+            assert(cnt == (int64_t) v.size());
+            assert(irs.elem_cnt(buf_id) == cnt);
+
+            // Iterator should stop at the limit.
+            if (v.empty()) continue;
+            const int64_t limit = v[v.size() / 3];
+            auto iter = irs.get_iter(buf_id);
+            iter.set_limit(limit);
+            result.clear();
+            while (iter.has_next()) result.push_back(iter.get_next());
+            assert(result == std::vector<int64_t>(v.begin(),
+                                                  v.begin() + v.size() / 3));
+        }
+    }
+}
+
+// Appending 65533 right after the start used to be confused with the initial
+// sentinel value.
+template<typename DType>
+static void test_sentinel()
+{
+    IntersectionResult<DType> ir(1, 0, 100000);
+    ir.append(0, 65533);
+    ir.finish();
+    auto iter = ir.get_iter(0);
+    assert(iter.has_next() && iter.get_next() == 65533);
+    assert(!iter.has_next());
+}
+
+static void run_test()
+{
+    for (auto enc : { IrEncoding::RLE, IrEncoding::VARINT }) {
+        test_random<int32_t>(0, 1000000, 100000, enc);
+        test_random<int32_t>(5000000000LL, 5000300000LL,
+                             IntersectionResult<int32_t>::max_batch_size(),
+                             enc);
+        test_random<int64_t>(0, 1000000, 100000, enc);
+        test_random<int64_t>(5000000000LL, 5001000000LL, 400000, enc);
+    }
+
+    test_sentinel<int32_t>();
+    test_sentinel<int64_t>();
+}
+
+} // namespace croquis
+
+int main()
+{
+    croquis::run_test();
+    return 0;
+}
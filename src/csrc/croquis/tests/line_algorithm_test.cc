@@ -3,11 +3,17 @@
 #include "croquis/line_algorithm.h"
 
 #include <assert.h>
+#include <stdint.h>  // int64_t
 #include <stdio.h>
+#include <stdlib.h>  // llabs
 
+#include <algorithm>  // copy
+#include <map>
 #include <memory>  // make_unique
 #include <random>
 
+#include "croquis/grayscale_buffer.h"
+
 namespace croquis {
 
 class LineAlgorithmTester {
@@ -205,10 +211,227 @@ static void test_random_lines()
     }
 }
 
+// Check that find_single_pixel_segments() agrees with the visitor.
+static void test_single_pixel_segments()
+{
+    std::mt19937 gen(12345678);  // Random number generator.
+    std::normal_distribution<float> coord_dist(0.0, 0.5);
+    std::uniform_real_distribution<float> width_dist(0.0, 0.3);
+    int single_cnt = 0;
+
+    for (int n = 0; n < 2000; n++) {
+        float x[9], y[9];
+        for (int i = 0; i < 9; i++) {
+            x[i] = coord_dist(gen) + (n % 5);
+            y[i] = coord_dist(gen) - (n % 3);
+        }
+        if (n % 10 == 0) x[n % 9] = NAN;
+        if (n % 10 == 1) x[n % 9] = x[(n + 1) % 9];
+
+        float width = width_dist(gen);
+        int px[8], py[8];
+        int mask = find_single_pixel_segments(x, y, width / 2, px, py);
+
+        for (int i = 0; i < 8; i++) {
+            if (!(mask & (1 << i))) continue;
+            single_cnt++;
+
+            int cnt = 0;
+            auto visitor = create_straight_line_visitor(
+                -100, -100, 100, 100,
+                [&](int xx, int yy) {
+                    assert(xx == px[i] && yy == py[i]);
+                    cnt++;
+                }
+            );
+            visitor.visit(x[i], y[i], x[i + 1], y[i + 1], width);
+            assert(cnt == 1);
+        }
+    }
+
+    printf("Found %d single-pixel segments.\n", single_cnt);
+    assert(single_cnt > 0);
+}
+
+// Check that find_single_tile_points() agrees with the corners of the marker.
+static void test_single_tile_points()
+{
+    std::mt19937 gen(12345678);  // Random number generator.
+    std::normal_distribution<float> coord_dist(0.0, 3.0);
+    std::uniform_real_distribution<float> radius_dist(0.0, 0.3);
+    int single_cnt = 0;
+
+    for (int n = 0; n < 2000; n++) {
+        float x[8], y[8];
+        for (int i = 0; i < 8; i++) {
+            x[i] = coord_dist(gen);
+            y[i] = coord_dist(gen);
+        }
+        if (n % 10 == 0) y[n % 8] = NAN;
+        if (n % 10 == 1) x[n % 8] = INFINITY;
+
+        float r = radius_dist(gen);
+        int px[8], py[8];
+        int mask = find_single_tile_points(x, y, r, px, py);
+
+        for (int i = 0; i < 8; i++) {
+            const bool finite = !isnan(x[i]) && !isnan(y[i]) &&
+                                !isinf(x[i]) && !isinf(y[i]);
+            const bool single = finite &&
+                nearbyintf(x[i] - r) == nearbyintf(x[i] + r) &&
+                nearbyintf(y[i] - r) == nearbyintf(y[i] + r);
+            assert(single == !!(mask & (1 << i)));
+            if (!single) continue;
+
+            single_cnt++;
+            assert(px[i] == nearbyintf(x[i]) && py[i] == nearbyintf(y[i]));
+        }
+    }
+
+    printf("Found %d single-tile points.\n", single_cnt);
+    assert(single_cnt > 0);
+}
+
+// Check that decimate_m4() keeps the first/last point and the y range of each
+// pixel column.
+static void test_decimate_m4()
+{
+    std::mt19937 gen(12345678);  // Random number generator.
+    std::uniform_real_distribution<float> step_dist(0.0, 0.05);
+    std::normal_distribution<float> y_dist(0.0, 10.0);
+
+    for (int n = 0; n < 100; n++) {
+        const int pts_cnt = 1000;
+        float x[pts_cnt], y[pts_cnt];
+        float xx = -20.0f;
+        for (int i = 0; i < pts_cnt; i++) {
+            x[i] = (xx += step_dist(gen) * (n % 4));
+            y[i] = y_dist(gen);
+        }
+
+        float x2[pts_cnt], y2[pts_cnt];
+        std::copy(x, x + pts_cnt, x2);
+        std::copy(y, y + pts_cnt, y2);
+        const int cnt = decimate_m4(x2, y2, pts_cnt);
+        assert(cnt < pts_cnt);
+
+        // The result must be a subsequence of the input, with the same
+        // endpoints and the same y range in each column.
+        assert(x2[0] == x[0] && y2[0] == y[0]);
+        assert(x2[cnt - 1] == x[pts_cnt - 1] && y2[cnt - 1] == y[pts_cnt - 1]);
+
+        std::map<float, std::pair<float, float>> range1, range2;
+        auto update = [](std::map<float, std::pair<float, float>> *m,
+                         float x, float y) {
+            auto iter = m->emplace(floorf(x + 0.5f), std::make_pair(y, y));
+            auto &r = iter.first->second;
+            r.first = std::min(r.first, y);
+            r.second = std::max(r.second, y);
+        };
+
+        int j = 0;
+        for (int i = 0; i < pts_cnt; i++) {
+            update(&range1, x[i], y[i]);
+            if (j < cnt && x[i] == x2[j] && y[i] == y2[j]) j++;
+        }
+        assert(j == cnt);
+        for (int i = 0; i < cnt; i++) update(&range2, x2[i], y2[i]);
+        assert(range1 == range2);
+        assert(cnt <= (int) range2.size() * 4);
+    }
+
+    // Not monotonic, or not dense enough: unchanged.
+    float x[16], y[16];
+    for (int i = 0; i < 16; i++) {
+        x[i] = i * 0.01f;
+        y[i] = i % 3;
+    }
+    x[10] = 0.0f;
+    assert(decimate_m4(x, y, 16) == 16);
+    for (int i = 0; i < 16; i++) x[i] = i * 0.2f;
+    assert(decimate_m4(x, y, 16) == 16);
+}
+
+// Paint the same dense line with and without decimate_m4() and check that the
+// results are close: total coverage (sum of pixel values) is within 25%, and
+// every pixel drawn by only one of them is within two pixels of a pixel drawn
+// by the other.  (They are not identical: see decimate_m4().)
+static void test_decimate_m4_painting()
+{
+    std::mt19937 gen(24681357);  // Random number generator.
+    std::normal_distribution<float> step_dist(0.0, 0.5);
+
+    GrayscaleBuffer buf1(256), buf2(256);
+    auto get = [](const GrayscaleBuffer &buf, int x, int y) -> int {
+        if (x < 0 || x >= 256 || y < 0 || y >= 256) return 0;
+        int idx1 = (y / 4) * (256 / 4) + (x / 4);
+        int idx2 = (y % 4) * 4 + (x % 4);
+        return ((const uint8_t *) &buf.buf[idx1])[idx2];
+    };
+
+    for (int n = 0; n < 20; n++) {
+        // Random walk with 10-50 points per pixel column.
+        const int pts_cnt = 1025;
+        const float x_range = 20.0f + n * 5;
+        float x[pts_cnt], y[pts_cnt];
+        float yy = 128.0f;
+        for (int i = 0; i < pts_cnt; i++) {
+            x[i] = 10.3f + i * (x_range / pts_cnt);
+            y[i] = (yy += step_dist(gen));
+        }
+
+        float x2[pts_cnt], y2[pts_cnt];
+        std::copy(x, x + pts_cnt, x2);
+        std::copy(y, y + pts_cnt, y2);
+        const int cnt = decimate_m4(x2, y2, pts_cnt);
+        assert(cnt < pts_cnt);
+
+        for (float width : { 1.0f, 3.0f }) {
+            buf1.reset(256);
+            buf2.reset(256);
+            buf1.draw_polyline(x, y, pts_cnt, width);
+            buf2.draw_polyline(x2, y2, cnt, width);
+
+            int64_t sum1 = 0, sum2 = 0;
+            for (int py = 0; py < 256; py++) {
+                for (int px = 0; px < 256; px++) {
+                    const int p1 = get(buf1, px, py);
+                    const int p2 = get(buf2, px, py);
+                    sum1 += p1;
+                    sum2 += p2;
+                    if ((p1 == 0) == (p2 == 0)) continue;
+
+                    const GrayscaleBuffer &other = (p1 == 0) ? buf1 : buf2;
+                    bool found = false;
+                    for (int dy = -2; dy <= 2; dy++) {
+                        for (int dx = -2; dx <= 2; dx++)
+                            if (get(other, px + dx, py + dy)) found = true;
+                    }
+                    assert(found);
+                }
+            }
+            assert(sum1 > 0);
+            assert(llabs(sum1 - sum2) * 4 <= sum1);
+        }
+    }
+}
+
 static void run_test()
 {
     test_lines();
     test_random_lines();
+
+    // Test both the scalar version and (if available) the AVX2 version.
+    const util::Isa orig_isa = util::cpu_features.isa;
+    util::cpu_features.isa = util::Isa::SCALAR;
+    test_single_pixel_segments();
+    test_single_tile_points();
+    util::cpu_features.isa = orig_isa;
+    test_single_pixel_segments();
+    test_single_tile_points();
+
+    test_decimate_m4();
+    test_decimate_m4_painting();
 }
 
 } // namespace croquis
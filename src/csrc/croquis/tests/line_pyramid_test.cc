@@ -0,0 +1,178 @@
+// Line pyramid test.
+
+#include "croquis/line_pyramid.h"
+
+#include <assert.h>
+#include <math.h>  // NAN
+#include <stdint.h>  // int32_t, int64_t, uint8_t
+#include <stdio.h>
+#include <stdlib.h>  // llabs
+
+#include <algorithm>  // max_element, min_element
+#include <random>
+#include <vector>
+
+#include "croquis/grayscale_buffer.h"
+
+namespace croquis {
+
+// Check that each level keeps the first/last points and the min/max of each
+// bucket, in order, with about half as many points as the previous level.
+static void test_time_series()
+{
+    std::mt19937 gen(12345678);  // Random number generator.
+    std::normal_distribution<double> step_dist(0.0, 1.0);
+    std::uniform_int_distribution<int> len_dist(0, 3000);
+
+    // Lines of random lengths (including very short ones).  Line #1 goes
+    // backwards, and line #2 has NaN, so they should not be reduced.
+    const int item_cnt = 50;
+    std::vector<std::vector<double>> xs(item_cnt), ys(item_cnt);
+    for (int i = 0; i < item_cnt; i++) {
+        const int len = (i < 3) ? 1000 : len_dist(gen);
+        double y = 0.0;
+        for (int j = 0; j < len; j++) {
+            xs[i].push_back((i == 1) ? -j : j * 0.5);
+            ys[i].push_back(y += step_dist(gen));
+        }
+    }
+    ys[2][500] = NAN;
+
+    LinePyramid lod;
+    lod.build(item_cnt,
+              [&](int i) { return (int) xs[i].size(); },
+              [&](int i, int j, double *x, double *y) {
+                  *x = xs[i][j];
+                  *y = ys[i][j];
+              });
+
+    // Buckets at level #l have (4 << l) points at intervals of 0.5, so the
+    // level is usable if:
+    //      (((4 << l) - 1) * 0.5) * xscale <= MAX_SPAN_PX (= 0.5)
+    assert(lod.select_level(0.2) == 0);
+    assert(lod.select_level(0.14) == 1);
+    assert(lod.select_level(0.066) == 2);
+    assert(lod.select_level(0.032) == 3);
+
+    for (int level = 1; level <= 3; level++) {
+        const int bucket = 4 << level;
+        for (int i = 0; i < item_cnt; i++) {
+            const int len = xs[i].size();
+            const auto kept = lod.get(level, i);
+            const int cnt = kept.second - kept.first;
+            if (i == 1 || i == 2 || len < LinePyramid::MIN_PTS_CNT) {
+                assert(cnt == 0);
+                continue;
+            }
+
+            assert(kept.first[0] == 0 && kept.second[-1] == len - 1);
+            for (int k = 1; k < cnt; k++)
+                assert(kept.first[k - 1] < kept.first[k]);
+            assert(cnt <= ((len + bucket - 1) / bucket) * 4);
+
+            for (int start = 0; start < len; start += bucket) {
+                const auto b = ys[i].begin() + start;
+                const auto e = ys[i].begin() + std::min(start + bucket, len);
+                const int32_t jmin = std::min_element(b, e) - ys[i].begin();
+                const int32_t jmax = std::max_element(b, e) - ys[i].begin();
+                const int32_t last = std::min(start + bucket, len) - 1;
+                assert(std::binary_search(kept.first, kept.second, start));
+                assert(std::binary_search(kept.first, kept.second, last));
+                assert(std::binary_search(kept.first, kept.second, jmin));
+                assert(std::binary_search(kept.first, kept.second, jmax));
+            }
+        }
+    }
+}
+
+// Check that a line drawn with the level chosen by select_level() matches the
+// same line drawn with the original data (level #0): it should cover the same
+// area, within a pixel or two, with about the same amount of ink.
+static void test_painting()
+{
+    std::mt19937 gen(87654321);  // Random number generator.
+    std::normal_distribution<double> step_dist(0.0, 0.5);
+
+    GrayscaleBuffer buf1(256), buf2(256);
+    auto get = [](const GrayscaleBuffer &buf, int x, int y) -> int {
+        if (x < 0 || x >= 256 || y < 0 || y >= 256) return 0;
+        int idx1 = (y / 4) * (256 / 4) + (x / 4);
+        int idx2 = (y % 4) * 4 + (x % 4);
+        return ((const uint8_t *) &buf.buf[idx1])[idx2];
+    };
+
+    for (double xscale : { 0.12, 0.06, 0.03, 0.015 }) {
+        // A random walk spanning ~240 pixels: x coordinates are at intervals
+        // of 0.5, as in test_time_series().
+        const int pts_cnt = 240.0 / (0.5 * xscale);
+        std::vector<double> ys(pts_cnt);
+        double yy = 128.0;
+        for (int j = 0; j < pts_cnt; j++) ys[j] = (yy += step_dist(gen));
+
+        LinePyramid lod;
+        lod.build(1,
+                  [&](int /* i */) { return pts_cnt; },
+                  [&](int /* i */, int j, double *x, double *y) {
+                      *x = j * 0.5;
+                      *y = ys[j];
+                  });
+
+        const int level = lod.select_level(xscale);
+        assert(level > 0);
+        const auto kept = lod.get(level, 0);
+        const int cnt = kept.second - kept.first;
+        assert(cnt > 0 && cnt < pts_cnt);
+
+        std::vector<float> x1(pts_cnt), y1(pts_cnt), x2(cnt), y2(cnt);
+        for (int j = 0; j < pts_cnt; j++) {
+            x1[j] = 8.3f + j * 0.5 * xscale;
+            y1[j] = ys[j];
+        }
+        for (int k = 0; k < cnt; k++) {
+            x2[k] = x1[kept.first[k]];
+            y2[k] = y1[kept.first[k]];
+        }
+
+        for (float width : { 1.0f, 3.0f }) {
+            buf1.reset(256);
+            buf2.reset(256);
+            buf1.draw_polyline(x1.data(), y1.data(), pts_cnt, width);
+            buf2.draw_polyline(x2.data(), y2.data(), cnt, width);
+
+            int64_t sum1 = 0, sum2 = 0;
+            for (int py = 0; py < 256; py++) {
+                for (int px = 0; px < 256; px++) {
+                    const int p1 = get(buf1, px, py);
+                    const int p2 = get(buf2, px, py);
+                    sum1 += p1;
+                    sum2 += p2;
+                    if ((p1 == 0) == (p2 == 0)) continue;
+
+                    const GrayscaleBuffer &other = (p1 == 0) ? buf1 : buf2;
+                    bool found = false;
+                    for (int dy = -2; dy <= 2; dy++) {
+                        for (int dx = -2; dx <= 2; dx++)
+                            if (get(other, px + dx, py + dy)) found = true;
+                    }
+                    assert(found);
+                }
+            }
+            assert(sum1 > 0);
+            assert(llabs(sum1 - sum2) * 4 <= sum1);
+        }
+    }
+}
+
+static void run_test()
+{
+    test_time_series();
+    test_painting();
+}
+
+} // namespace croquis
+
+int main()
+{
+    croquis::run_test();
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Test make_png_file().
+//
+// TODO: Use a proper test framework!
+
+#include "croquis/png_util.h"
+
+#include <assert.h>
+#include <stdint.h>  // uint8_t, uint32_t
+#include <string.h>  // memcmp
+
+#include <zlib.h>  // crc32, uncompress
+
+#include <random>
+#include <vector>
+
+namespace croquis {
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    return (p[0] << 24) + (p[1] << 16) + (p[2] << 8) + p[3];
+}
+
+// Check a chunk starting at `p`, and return the pointer to the next chunk.
+static const uint8_t *check_chunk(const uint8_t *p, const char *type,
+                                  uint32_t *len)
+{
+    *len = get_u32(p);
+    assert(memcmp(p + 4, type, 4) == 0);
+    assert(get_u32(p + 8 + *len) == crc32(0, p + 4, 4 + *len));
+    return p + 12 + *len;
+}
+
+// Create random image data (with PNG filter bytes), and check that the PNG
+// file has the right header and chunks, and decompresses to the same data.
+static void test_png_file()
+{
+    std::mt19937 gen(13579246);  // Random number generator.
+    std::uniform_int_distribution<int> byte_dist(0, 255);
+
+    for (int tile_size : { 128, 256, 512 }) {
+        for (bool has_alpha : { false, true }) {
+            const int channels = has_alpha ? 4 : 3;
+            const int row_size = tile_size * channels + 1;
+            UniqueMessageData image("test", tile_size * row_size);
+            uint8_t *data = (uint8_t *) image.get();
+            for (int y = 0; y < tile_size; y++) {
+                data[y * row_size] = (y == 0) ? 0 : 2;
+                // Mostly zeros, so that it can be compressed.
+                for (int i = 1; i < row_size; i++) {
+                    const int v = byte_dist(gen);
+                    data[y * row_size + i] = (v < 32) ? v : 0;
+                }
+            }
+
+            auto png = make_png_file(image, tile_size, has_alpha);
+            assert(png->name == "test");
+            const uint8_t *p = (const uint8_t *) png->get();
+            const uint8_t *end = p + png->size();
+
+            static const uint8_t signature[8] = {
+                0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a,
+            };
+            assert(memcmp(p, signature, 8) == 0);
+            p += 8;
+
+            uint32_t len;
+            const uint8_t *ihdr = p + 8;
+            p = check_chunk(p, "IHDR", &len);
+            assert(len == 13);
+            assert(get_u32(ihdr) == (uint32_t) tile_size);
+            assert(get_u32(ihdr + 4) == (uint32_t) tile_size);
+            assert(ihdr[8] == 8);  // Bit depth.
+            assert(ihdr[9] == (has_alpha ? 6 : 2));
+            assert(ihdr[10] == 0 && ihdr[11] == 0 && ihdr[12] == 0);
+
+            const uint8_t *idat = p + 8;
+            p = check_chunk(p, "IDAT", &len);
+            assert(len < image.size());
+
+            std::vector<uint8_t> decoded(image.size());
+            uLongf decoded_len = decoded.size();
+            assert(uncompress(decoded.data(), &decoded_len, idat, len) == Z_OK);
+            assert(decoded_len == image.size());
+            assert(memcmp(decoded.data(), data, image.size()) == 0);
+
+            p = check_chunk(p, "IEND", &len);
+            assert(len == 0);
+            assert(p == end);
+        }
+    }
+}
+
+static void run_test()
+{
+    test_png_file();
+}
+
+} // namespace croquis
+
+int main()
+{
+    croquis::run_test();
+    return 0;
+}
@@ -0,0 +1,270 @@
+// Test RgbBuffer (and other ColoredBufferBase implementations).
+//
+// TODO: Use a proper test framework!
+
+#include "croquis/rgb_buffer.h"
+
+#include <assert.h>
+#include <stdint.h>  // uint32_t
+#include <stdlib.h>  // abs
+#include <string.h>  // memcmp
+
+#include <immintrin.h>  // __m128i
+
+#include <random>
+#include <vector>
+
+#include "croquis/density_buffer.h"
+#include "croquis/grayscale_buffer.h"
+#include "croquis/util/cpu_features.h"
+#include "croquis/util/thread_local_pool.h"
+
+namespace croquis {
+
+// Check that buffers reused from util::ThreadLocalPool are the same as new
+// ones.
+static void test_pool_reuse()
+{
+    std::mt19937 gen(97531864);  // Random number generator.
+    std::uniform_real_distribution<float> coord_dist(-10.0, 266.0);
+
+    // Draw random lines into `tile` and `density`.
+    auto draw = [&](ColoredBufferBase *tile, DensityBuffer *density) {
+        auto gray_buf =
+            util::ThreadLocalPool<GrayscaleBuffer>::acquire(tile->tile_size());
+        for (int line_id = 0; line_id < 10; line_id++) {
+            const float x0 = coord_dist(gen), y0 = coord_dist(gen);
+            const float x1 = coord_dist(gen), y1 = coord_dist(gen);
+            gray_buf->draw_line(x0, y0, x1, y1, 3.0f);
+            tile->merge(gray_buf.get(), line_id, 0xff000000 + line_id * 99);
+            gray_buf->draw_line(x0, y0, x1, y1, 3.0f);
+            density->merge(gray_buf.get(), line_id, 0);
+        }
+    };
+
+    // Buffers are also reused when the tile size changes.
+    for (int tile_size : { 256, 256, 512, 128, 256 }) {
+        auto tile1 =
+            util::ThreadLocalPool<RgbBuffer>::acquire(0xffffff, tile_size);
+        auto density1 =
+            util::ThreadLocalPool<DensityBuffer>::acquire(tile_size);
+        RgbBuffer tile2(0xffffff, tile_size);
+        DensityBuffer density2(tile_size);
+
+        std::mt19937 orig_gen = gen;
+        draw(tile1.get(), density1.get());
+        gen = orig_gen;
+        draw(&tile2, &density2);
+
+        const int blk_cnt = tile2.tile_blk_cnt();
+        assert(memcmp(tile1->buf, tile2.buf,
+                      sizeof(__m128i) * blk_cnt * 3) == 0);
+        assert(memcmp(tile1->hovermap, tile2.hovermap,
+                      sizeof(__m256i) * blk_cnt * 2) == 0);
+        assert(memcmp(density1->counts, density2.counts,
+                      sizeof(uint32_t) * blk_cnt * 16) == 0);
+    }
+}
+
+// Check that make_hovermap_data() shows the last line merged at each pixel.
+static void test_hovermap()
+{
+    std::mt19937 gen(86420975);  // Random number generator.
+    std::uniform_real_distribution<float> coord_dist(-10.0, 266.0);
+
+    for (int line_cnt : { 0, 3, 200, 400 }) {
+        RgbBuffer tile(0xffffff);
+        GrayscaleBuffer gray_buf;
+        std::vector<int> expected(256 * 256, -1);
+        for (int i = 0; i < line_cnt; i++) {
+            const int line_id = i * 1000;
+            gray_buf.draw_line(coord_dist(gen), coord_dist(gen),
+                               coord_dist(gen), coord_dist(gen), 2.0f);
+            for (int y = 0; y < 256; y++) {
+                for (int x = 0; x < 256; x++) {
+                    if (gray_buf.get_pixel(x, y))
+                        expected[y * 256 + x] = line_id;
+                }
+            }
+            tile.merge(&gray_buf, line_id, 0xff000000);
+        }
+
+        auto msg = tile.make_hovermap_data("test");
+        const char *data = (const char *) msg->get();
+        int32_t width, n;
+        memcpy(&width, data, 4);
+        memcpy(&n, data + 4, 4);
+        assert(msg->size() == 8 + 4 * n + 256 * 256 * width);
+        assert((line_cnt == 0) == (width == 0));
+        assert(line_cnt <= 200 || width == 2);
+
+        const int32_t *table = (const int32_t *) (data + 8);
+        assert(table[0] == -1);
+        for (int i = 0; i < 256 * 256; i++) {
+            uint32_t idx = 0;
+            memcpy(&idx, data + 8 + 4 * n + i * width, width);
+            assert(idx < (uint32_t) n && table[idx] == expected[i]);
+        }
+    }
+}
+
+// Check that painting lines on a layer and composing it gives (almost) the
+// same result as painting on the tile directly.
+static void test_compose()
+{
+    std::mt19937 gen(13572468);  // Random number generator.
+    std::uniform_real_distribution<float> coord_dist(-10.0, 266.0);
+    std::uniform_int_distribution<uint32_t> color_dist(0, 0xffffff);
+
+    const int line_cnt = 300;
+    std::vector<float> coords(line_cnt * 4);
+    std::vector<uint32_t> colors(line_cnt);
+    for (float &c : coords) c = coord_dist(gen);
+    for (uint32_t &c : colors) c = 0xc0000000 + color_dist(gen);
+
+    // Draw lines [start, end) on `tile`.
+    auto draw = [&](ColoredBufferBase *tile, int start, int end) {
+        GrayscaleBuffer gray_buf;
+        for (int i = start; i < end; i++) {
+            const float *p = &coords[i * 4];
+            gray_buf.draw_line(p[0], p[1], p[2], p[3], 2.0f);
+            tile->merge(&gray_buf, i * 10, colors[i]);
+        }
+    };
+
+    auto check_pixels = [](const ColoredBufferBase &a,
+                           const ColoredBufferBase &b) {
+        for (int y = 0; y < 256; y++) {
+            for (int x = 0; x < 256; x++) {
+                const uint32_t p1 = a.get_pixel(x, y);
+                const uint32_t p2 = b.get_pixel(x, y);
+                for (int shift = 0; shift < 32; shift += 8) {
+                    const int d = (int) ((p1 >> shift) & 0xff) -
+                                  (int) ((p2 >> shift) & 0xff);
+                    assert(abs(d) <= 4);
+                }
+            }
+        }
+    };
+
+    for (int split : { 0, 1, 150, line_cnt }) {
+        // RgbBuffer: the hovermap should be identical.
+        {
+            RgbBuffer tile1(0xffffff), tile2(0xffffff);
+            LayerBuffer layer;
+            draw(&tile1, 0, line_cnt);
+            draw(&tile2, 0, split);
+            draw(&layer, split, line_cnt);
+            tile2.compose(layer);
+            check_pixels(tile1, tile2);
+
+            auto hmap1 = tile1.make_hovermap_data("test1");
+            auto hmap2 = tile2.make_hovermap_data("test2");
+            assert(hmap1->size() == hmap2->size());
+            assert(memcmp(hmap1->get(), hmap2->get(), hmap1->size()) == 0);
+        }
+
+        {
+            RgbaBuffer tile1, tile2, layer;
+            draw(&tile1, 0, line_cnt);
+            draw(&tile2, 0, split);
+            draw(&layer, split, line_cnt);
+            tile2.compose(layer);
+            check_pixels(tile1, tile2);
+        }
+
+        // DensityBuffer should give the exact same result.
+        {
+            DensityBuffer tile1, tile2, layer;
+            draw(&tile1, 0, line_cnt);
+            draw(&tile2, 0, split);
+            draw(&layer, split, line_cnt);
+            tile2.compose(layer);
+            assert(memcmp(tile1.counts, tile2.counts,
+                          sizeof(uint32_t) * tile1.tile_blk_cnt() * 16) == 0);
+        }
+    }
+}
+
+// Check that make_png_data() gives the same result for every implementation,
+// and that undoing the "up" filter gives back the pixels.
+static void test_png_data()
+{
+    const util::Isa orig_isa = util::cpu_features.isa;
+    for (int tile_size : { 128, 256, 512 }) {
+        std::mt19937 gen(24681357);  // Random number generator.
+        std::uniform_real_distribution<float> coord_dist(-10.0, tile_size + 10);
+        std::uniform_int_distribution<uint32_t> color_dist(0, 0xffffffff);
+
+        RgbBuffer rgb(0xffffff, tile_size);
+        RgbaBuffer rgba(tile_size);
+        GrayscaleBuffer gray_buf(tile_size);
+        for (int i = 0; i < 300; i++) {
+            float x0 = coord_dist(gen), y0 = coord_dist(gen);
+            float x1 = coord_dist(gen), y1 = coord_dist(gen);
+            const uint32_t color = color_dist(gen);
+            gray_buf.draw_line(x0, y0, x1, y1, 3.0f);
+            rgb.merge(&gray_buf, i, color);
+            gray_buf.draw_line(x0, y0, x1, y1, 3.0f);
+            rgba.merge(&gray_buf, i, color);
+        }
+
+        util::cpu_features.isa = util::Isa::SCALAR;
+        auto rgb1 = rgb.make_png_data("test1");
+        auto rgba1 = rgba.make_png_data("test2");
+
+        for (int isa = (int) util::Isa::SSE4; isa <= (int) orig_isa; isa++) {
+            util::cpu_features.isa = (util::Isa) isa;
+            auto rgb2 = rgb.make_png_data("test3");
+            auto rgba2 = rgba.make_png_data("test4");
+            assert(memcmp(rgb1->get(), rgb2->get(), rgb1->size()) == 0);
+            assert(memcmp(rgba1->get(), rgba2->get(), rgba1->size()) == 0);
+        }
+
+        // Decode the RGB data and compare with the pixels.
+        const int W = tile_size * 3;
+        assert(rgb1->size() == (size_t) (W + 1) * tile_size);
+        const uint8_t *data = (const uint8_t *) rgb1->get();
+        std::vector<uint8_t> line(W, 0);
+        for (int y = 0; y < tile_size; y++) {
+            const uint8_t *row = data + y * (W + 1);
+            assert(row[0] == ((y == 0) ? 0 : 2));
+            for (int i = 0; i < W; i++) line[i] += row[i + 1];
+            for (int x = 0; x < tile_size; x++) {
+                const uint32_t pixel = (line[x * 3] << 16) +
+                                       (line[x * 3 + 1] << 8) + line[x * 3 + 2];
+                assert(pixel == rgb.get_pixel(x, y));
+            }
+        }
+
+        // For RGBA, the alpha channel should be the same as W.
+        const int W4 = tile_size * 4;
+        assert(rgba1->size() == (size_t) (W4 + 1) * tile_size);
+        data = (const uint8_t *) rgba1->get();
+        line.assign(W4, 0);
+        for (int y = 0; y < tile_size; y++) {
+            const uint8_t *row = data + y * (W4 + 1);
+            for (int i = 0; i < W4; i++) line[i] += row[i + 1];
+            for (int x = 0; x < tile_size; x++)
+                assert(line[x * 4 + 3] == rgba.get_pixel(x, y) >> 24);
+        }
+    }
+
+    util::cpu_features.isa = orig_isa;
+}
+
+static void run_test()
+{
+    test_pool_reuse();
+    test_hovermap();
+    test_compose();
+    test_png_data();
+}
+
+} // namespace croquis
+
+int main()
+{
+    croquis::run_test();
+    return 0;
+}
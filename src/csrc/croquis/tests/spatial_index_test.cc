@@ -0,0 +1,153 @@
+// Spatial index test.
+
+#include "croquis/spatial_index.h"
+
+#include <assert.h>
+#include <math.h>  // NAN
+#include <stdint.h>  // int64_t
+#include <stdio.h>
+
+#include <random>
+#include <vector>
+
+namespace croquis {
+
+// Check that next_candidate() never skips a point inside the query box.
+static void check_query(const SpatialIndex &index,
+                        const std::vector<double> &xs,
+                        const std::vector<double> &ys,
+                        const SpatialIndex::Query &q)
+{
+    const int64_t pts_cnt = xs.size();
+    int64_t g = 0;
+
+    while (g < pts_cnt) {
+        int64_t next = index.next_candidate(g, pts_cnt, q);
+        assert(next >= g && next <= pts_cnt);
+
+        // Everything we skipped (including the endpoint of the last skipped
+        // segment) must be outside the query box.
+        if (next > g) {
+            for (int64_t i = g; i <= next && i < pts_cnt; i++) {
+                double tx = q.xscale * xs[i] + q.xbias;
+                double ty = q.yscale * ys[i] + q.ybias;
+                bool inside = (tx >= q.xmin && tx <= q.xmax &&
+                               ty >= q.ymin && ty <= q.ymax);
+                assert(!inside);
+            }
+        }
+
+        if (next == pts_cnt) break;
+
+        // Process until the next block boundary.
+        g = (next | SpatialIndex::BLK_MASK) + 1;
+    }
+}
+
+static void test_random_walk()
+{
+    std::mt19937 gen(12345678);  // Random number generator.
+    std::normal_distribution<double> step_dist(0.0, 1.0);
+    std::uniform_real_distribution<double> pos_dist(-300.0, 300.0);
+
+    const int pts_cnt = 100000;
+    std::vector<double> xs(pts_cnt), ys(pts_cnt);
+    double x = 0.0, y = 0.0;
+    for (int i = 0; i < pts_cnt; i++) {
+        xs[i] = (x += step_dist(gen));
+        ys[i] = (y += step_dist(gen));
+    }
+
+    // Sprinkle some NaN's.
+    for (int i = 0; i < pts_cnt; i += 997) xs[i] = NAN;
+
+    SpatialIndex index;
+    index.build(pts_cnt, [&](int64_t g, double *x, double *y) {
+        *x = xs[g];
+        *y = ys[g];
+    });
+
+    // A query covering everything should return the starting point.
+    CanvasConfig::Transform identity{1.0f, 0.0f, 1.0f, 0.0f};
+    SpatialIndex::Query all(identity, -1e9, -1e9, 1e9, 1e9);
+    for (int g = 0; g < pts_cnt; g += 101)
+        assert(index.next_candidate(g, pts_cnt, all) == g);
+
+    for (int n = 0; n < 200; n++) {
+        double x0 = pos_dist(gen), y0 = pos_dist(gen);
+        double w = fabs(pos_dist(gen)) * 0.1, h = fabs(pos_dist(gen)) * 0.1;
+        CanvasConfig::Transform tr{-0.5f, 3.0f, 2.0f, -1.0f};
+        SpatialIndex::Query q(tr, x0, y0, x0 + w, y0 + h);
+        check_query(index, xs, ys, q);
+    }
+}
+
+// Check that item boxes never exclude an item with a point inside the query.
+static void test_item_boxes()
+{
+    std::mt19937 gen(87654321);  // Random number generator.
+    std::normal_distribution<double> step_dist(0.0, 1.0);
+    std::uniform_int_distribution<int> len_dist(0, 300);
+    std::uniform_real_distribution<double> pos_dist(-100.0, 100.0);
+
+    // Items of random lengths (including zero), each starting at a random
+    // place.
+    std::vector<int64_t> item_ends;
+    std::vector<double> xs, ys;
+    for (int i = 0; i < 500; i++) {
+        int len = len_dist(gen);
+        double x = pos_dist(gen), y = pos_dist(gen);
+        for (int j = 0; j < len; j++) {
+            xs.push_back(x += step_dist(gen));
+            ys.push_back(y += step_dist(gen));
+        }
+        item_ends.push_back(xs.size());
+    }
+    const int item_cnt = item_ends.size();
+
+    SpatialIndex index;
+    index.build(xs.size(),
+                [&](int64_t g, double *x, double *y) {
+                    *x = xs[g];
+                    *y = ys[g];
+                },
+                item_cnt,
+                [&](int i) { return item_ends[i]; });
+
+    int skipped = 0;
+    for (int n = 0; n < 200; n++) {
+        double x0 = pos_dist(gen), y0 = pos_dist(gen);
+        CanvasConfig::Transform tr{0.1f, 0.0f, 0.1f, 0.0f};
+        SpatialIndex::Query q(tr, x0 * 0.1, y0 * 0.1, x0 * 0.1 + 1.0,
+                              y0 * 0.1 + 1.0);
+
+        for (int i = 0; i < item_cnt; i++) {
+            if (index.item_may_intersect(i, q)) continue;
+            skipped++;
+
+            for (int64_t g = (i == 0) ? 0 : item_ends[i - 1];
+                 g < item_ends[i]; g++) {
+                double tx = q.xscale * xs[g] + q.xbias;
+                double ty = q.yscale * ys[g] + q.ybias;
+                bool inside = (tx >= q.xmin && tx <= q.xmax &&
+                               ty >= q.ymin && ty <= q.ymax);
+                assert(!inside);
+            }
+        }
+    }
+    assert(skipped > 0);
+}
+
+static void run_test()
+{
+    test_random_walk();
+    test_item_boxes();
+}
+
+} // namespace croquis
+
+int main()
+{
+    croquis::run_test();
+    return 0;
+}
@@ -0,0 +1,29 @@
+// Helper function for allocating aligned memory.
+
+#pragma once
+
+#include <stddef.h>  // size_t
+#include <stdlib.h>  // posix_memalign, free
+
+#include "croquis/util/macros.h"  // CHECK
+
+namespace croquis {
+namespace util {
+
+// Free `p` (which may be nullptr), and allocate `size` bytes aligned to
+// `align` bytes: used for tile buffers, which are reallocated when the tile
+// size changes.  The old contents are *not* preserved, and the new memory is
+// not initialized.  Free the result with free().
+//
+// It seems like C++ doesn't correctly support alignment larger than 16 bytes
+// with `new` until C++17 - so we use posix_memalign, so that we can compile on
+// C++14.
+static inline void *realloc_aligned(void *p, size_t align, size_t size)
+{
+    free(p);
+    CHECK(posix_memalign(&p, align, size) == 0);
+    return p;
+}
+
+} // namespace util
+} // namespace croquis
@@ -0,0 +1,64 @@
+// Runtime detection of CPU features.
+
+#include "croquis/util/cpu_features.h"
+
+#include <stdio.h>  // fprintf
+#include <stdlib.h>  // getenv
+#include <string.h>  // strcmp
+
+namespace croquis {
+namespace util {
+
+static CpuFeatures detect_cpu_features()
+{
+    CpuFeatures features;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    // Needed because we may be called before other static constructors.
+    __builtin_cpu_init();
+
+    features.sse4 = __builtin_cpu_supports("sse4.2");
+    features.avx2 = __builtin_cpu_supports("avx2") &&
+                    __builtin_cpu_supports("fma");
+    features.avx512 = __builtin_cpu_supports("avx512f") &&
+                      __builtin_cpu_supports("avx512bw") &&
+                      __builtin_cpu_supports("avx512vl") &&
+                      __builtin_cpu_supports("avx512dq");
+#endif
+
+    // AVX2 and AVX-512 kernels are not compiled if ENABLE_AVX2 is off: see
+    // src/CMakeLists.txt.
+#ifndef CROQUIS_ENABLE_AVX2
+    features.avx2 = features.avx512 = false;
+#endif
+
+    // (Every CPU with AVX-512 also has AVX2, and so on.)
+    features.isa = features.avx512 ? Isa::AVX512 :
+                   features.avx2   ? Isa::AVX2 :
+                   features.sse4   ? Isa::SSE4 : Isa::SCALAR;
+
+    // Allow the user to pick an older instruction set, e.g., for testing or
+    // benchmarking.
+    const char *env = getenv("CROQUIS_ISA");
+    if (env != nullptr && *env != '\0') {
+        const char *names[] = { "scalar", "sse4", "avx2", "avx512" };
+        int idx = 0;
+        while (idx < 4 && strcmp(env, names[idx]) != 0) idx++;
+
+        if (idx == 4)
+            fprintf(stderr, "croquis: ignoring unknown CROQUIS_ISA=%s\n", env);
+        else if (idx > (int) features.isa)
+            fprintf(stderr, "croquis: CROQUIS_ISA=%s is not supported on "
+                            "this CPU: using %s\n",
+                    env, names[(int) features.isa]);
+        else
+            features.isa = (Isa) idx;
+    }
+
+    return features;
+}
+
+CpuFeatures cpu_features = detect_cpu_features();
+
+}  // namespace util
+}  // namespace croquis
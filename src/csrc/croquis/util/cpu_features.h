@@ -0,0 +1,39 @@
+// Runtime detection of CPU features.
+
+#pragma once
+
+namespace croquis {
+namespace util {
+
+// Instruction sets we have kernels for, from the oldest to the newest: each
+// kernel (e.g., GrayscaleBuffer::draw_line()) has a separate implementation for
+// each instruction set, compiled in its own translation unit (e.g.,
+// grayscale_buffer_avx2.cc) with the matching compiler flags, so that the rest
+// of the library runs on any x86-64 CPU.
+//
+// SCALAR only needs SSE2, which is part of x86-64.
+enum class Isa { SCALAR = 0, SSE4 = 1, AVX2 = 2, AVX512 = 3 };
+
+struct CpuFeatures {
+    // SSE4.2 (which implies SSSE3 and SSE4.1).
+    bool sse4 = false;
+
+    // AVX2 and FMA (i.e., Haswell or later).
+    bool avx2 = false;
+
+    // True if we can use AVX-512 kernels: they need AVX512F, AVX512BW,
+    // AVX512VL, and AVX512DQ (i.e., Skylake-SP or later).
+    bool avx512 = false;
+
+    // The instruction set to use: the newest one supported by the CPU (and
+    // compiled in), unless lowered by environment variable CROQUIS_ISA (one of
+    // "scalar", "sse4", "avx2", "avx512").
+    Isa isa = Isa::SCALAR;
+};
+
+// Detected when the library is loaded.  Tests may modify `isa` to exercise
+// other code paths, as long as the CPU supports it.
+extern CpuFeatures cpu_features;
+
+}  // namespace util
+}  // namespace croquis
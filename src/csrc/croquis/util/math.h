@@ -4,9 +4,13 @@
 #pragma once
 
 #include <math.h>  // isnan
+#include <stdint.h>  // uint32_t, uint64_t
 
+#include <algorithm>  // min, max
 #include <utility>  // pair
 
+#include "croquis/util/macros.h"  // CHECK
+
 namespace croquis {
 namespace util {
 
@@ -54,5 +58,42 @@ static inline std::pair<float, float> minmax(const float *data, size_t sz)
     return std::make_pair(m, M);
 }
 
+// Division of a 64-bit unsigned integer by a fixed 32-bit divisor, using a
+// precomputed reciprocal (so that we don't need a slow `div` instruction).
+//
+// See: T. Granlund and P. L. Montgomery, "Division by invariant integers using
+// multiplication" (1994), Figure 4.1.
+class Divider {
+  private:
+    uint64_t d_;
+    uint64_t m_;
+    int sh1_, sh2_;
+
+  public:
+    explicit Divider(uint32_t d) : d_(d) {
+        CHECK(d > 0);
+        int l = 0;  // = ceil(log2(d))
+        while ((uint64_t(1) << l) < d) l++;
+
+        m_ = (uint64_t)
+            ((((unsigned __int128) ((uint64_t(1) << l) - d)) << 64) / d) + 1;
+        sh1_ = std::min(l, 1);
+        sh2_ = std::max(l - 1, 0);
+    }
+
+    uint64_t divisor() const { return d_; }
+
+    uint64_t divide(uint64_t n) const {
+        uint64_t t1 = (uint64_t) (((unsigned __int128) m_ * n) >> 64);
+        return (t1 + ((n - t1) >> sh1_)) >> sh2_;
+    }
+
+    // Returns { n / d, n % d }.
+    std::pair<uint64_t, uint64_t> divmod(uint64_t n) const {
+        uint64_t q = divide(n);
+        return { q, n - q * d_ };
+    }
+};
+
 }  // namespace util
 }  // namespace croquis
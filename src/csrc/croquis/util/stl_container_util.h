@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <initializer_list>
 #include <string>
 #include <tuple>      // forward_as_tuple
 #include <utility>    // move, piecewise_construct
@@ -35,6 +36,14 @@ inline typename Container::value_type &emplace_back(Container &v, Args&&... args
     return v.back();
 }
 
+// Append multiple elements at the end.
+template<class Container>
+inline void append(Container &v,
+                   std::initializer_list<typename Container::value_type> elems)
+{
+    v.insert(v.end(), elems);
+}
+
 // Run make_unique + emplace_back and return the reference to the unique_ptr.
 template<class Container, class... Args>
 inline typename Container::value_type &
@@ -0,0 +1,66 @@
+// A per-thread pool of large objects that are expensive to create.
+
+#pragma once
+
+#include <memory>  // unique_ptr
+#include <utility>  // forward
+#include <vector>
+
+namespace croquis {
+namespace util {
+
+// Keeps objects of type T (e.g., GrayscaleBuffer) in a thread-local free list,
+// so that a thread repeatedly drawing tiles can reuse the same buffers instead
+// of allocating and initializing new ones each time.
+//
+// T must have a method reset(args...) that brings the object to the same state
+// as a newly constructed T(args...): it's called when an object is reused, so
+// it can be lazy (e.g., only clear the part that was changed).
+//
+// Objects are returned to the pool of the thread that releases them (which is
+// normally the thread that acquired them), and freed when the thread exits.
+template<typename T>
+class ThreadLocalPool {
+  public:
+    // Maximum number of free objects to keep per thread: we normally need one
+    // at a time, but let's allow some slack.
+    static const int MAX_FREE_CNT = 4;
+
+    // A unique_ptr that returns the object to the pool, instead of deleting
+    // it.  `Base` can be a base class of T.
+    template<typename Base = T>
+    using Ptr = std::unique_ptr<Base, void (*)(Base *)>;
+
+    template<typename Base = T, typename... Args>
+    static Ptr<Base> acquire(Args&&... args) {
+        std::vector<std::unique_ptr<T>> &pool = free_list();
+        T *obj;
+        if (pool.empty()) {
+            obj = new T(std::forward<Args>(args)...);
+        }
+        else {
+            obj = pool.back().release();
+            pool.pop_back();
+            obj->reset(std::forward<Args>(args)...);
+        }
+
+        return Ptr<Base>(obj, [](Base *p) { release(static_cast<T *>(p)); });
+    }
+
+  private:
+    static std::vector<std::unique_ptr<T>> &free_list() {
+        static thread_local std::vector<std::unique_ptr<T>> pool;
+        return pool;
+    }
+
+    static void release(T *obj) {
+        std::vector<std::unique_ptr<T>> &pool = free_list();
+        if (pool.size() < MAX_FREE_CNT)
+            pool.emplace_back(obj);
+        else
+            delete obj;
+    }
+};
+
+} // namespace util
+} // namespace croquis
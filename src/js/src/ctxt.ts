@@ -89,7 +89,8 @@ export class Ctxt extends BaseCtxt {
             this._tile_handler.axis_handler.update(msg_dict);
         }
         else if (msg_dict.msg == 'tile') {
-            let tile = new Tile(msg_dict, attachments);
+            let tile = new Tile(msg_dict, attachments,
+                                this._tile_handler.tile_set.tile_size);
             let seqs = msg_dict.seqs.split(':').map((x: string) => parseInt(x));
             // console.log(`Received tile: ${tile.key}`);
             this._tile_handler.register_tile(tile, seqs);
@@ -1,7 +1,6 @@
 // The tile itself.
 
 import { AnyJson, BufList } from './types';
-import { TILE_SIZE } from './util';
 
 // A tile key does not contain `sm_version` because we want to use the latest
 // available version even if the "correct" (latest requested) version is not
@@ -18,7 +17,7 @@ export function tile_key(
 }
 
 export class Tile {
-    constructor(msg_dict: AnyJson, attachments: BufList) {
+    constructor(msg_dict: AnyJson, attachments: BufList, tile_size: number) {
         const is_hover = 'item_id' in msg_dict;
 
         this.sm_version = msg_dict.sm_version;  // Selection map version.
@@ -36,7 +35,7 @@ export class Tile {
                             this.row, this.col, this.item_id);
 
         const png_data = attachments[0];
-        this.elem = new Image(TILE_SIZE, TILE_SIZE);
+        this.elem = new Image(tile_size, tile_size);
         this.elem.classList.add('cr_tile');
         this.elem.setAttribute('draggable', 'false');
         this.elem.src = URL.createObjectURL(
@@ -45,9 +44,10 @@ export class Tile {
         // Hovermap data is available only if this is *not* a hover (i.e.,
         // highlight) image.
         if (!is_hover) {
-            this.hovermap = (attachments[1] instanceof ArrayBuffer)
-                ? new DataView(attachments[1])
-                : attachments[1] as DataView;
+            this.hovermap = new Hovermap(
+                (attachments[1] instanceof ArrayBuffer)
+                    ? new DataView(attachments[1])
+                    : attachments[1] as DataView);
         }
     }
 
@@ -68,5 +68,37 @@ export class Tile {
 
     key: string;
     elem: HTMLImageElement;
-    hovermap: DataView | null = null;
+    hovermap: Hovermap | null = null;
+}
+
+// Shows which item is at each pixel of a tile.  BE sends a table of item IDs,
+// followed by the index into the table for each pixel: see
+// ColoredBufferBase::make_hovermap_data() for the format.
+export class Hovermap {
+    constructor(data: DataView) {
+        this.data = data;
+        this.width = data.getInt32(0, true /* little endian */);
+        const n = data.getInt32(4, true);
+        this.table = [];
+        for (let i = 0; i < n; i++)
+            this.table.push(data.getInt32(8 + i * 4, true));
+        this.pixel_offset = 8 + n * 4;
+    }
+
+    // Return the item ID at the given offset (= y * tile_size + x), or -1 if
+    // there's no item.
+    get(offset: number): number {
+        const pos = this.pixel_offset + offset * this.width;
+        switch (this.width) {
+            case 0: return this.table[0];
+            case 1: return this.table[this.data.getUint8(pos)];
+            case 2: return this.table[this.data.getUint16(pos, true)];
+            default: return this.table[this.data.getUint32(pos, true)];
+        }
+    }
+
+    private data: DataView;
+    private width: number;  // Number of bytes per pixel.
+    private table: number[];
+    private pixel_offset: number;  // Where the pixel data starts.
 }
@@ -7,8 +7,7 @@ import {
     assert,
     get_child,
     HighlightType,
-    LRUCache,
-    TILE_SIZE
+    LRUCache
 } from './util';
 
 export enum CanvasResetMode {
@@ -154,6 +153,7 @@ export class TileSet {
         this.y0 = config.y0;
         this.x1 = config.x1;
         this.y1 = config.y1;
+        this.tile_size = config.tile_size;
 
         assert(config.zoom_level == 0 &&
                config.x_offset == 0 && config.y_offset == 0);
@@ -295,8 +295,9 @@ export class TileSet {
     }
 
     update_tile_position(tile: Tile): void {
-        tile.elem.style.top = (tile.row * TILE_SIZE + this.y_offset) + 'px';
-        tile.elem.style.left = (tile.col * TILE_SIZE + this.x_offset) + 'px';
+        const ts = this.tile_size;
+        tile.elem.style.top = (tile.row * ts + this.y_offset) + 'px';
+        tile.elem.style.left = (tile.col * ts + this.x_offset) + 'px';
     }
 
     // Hide a tile that is currently in the visible layer, and add it back
@@ -314,18 +315,18 @@ export class TileSet {
         x = Math.round(x - this.x_offset);
         y = Math.round(y - this.y_offset);
 
-        const row = Math.floor(y / TILE_SIZE);
-        const col = Math.floor(x / TILE_SIZE);
-        const offset_y = y - (row * TILE_SIZE);
-        const offset_x = x - (col * TILE_SIZE);
-        const offset = (offset_y * TILE_SIZE) + offset_x;
+        const row = Math.floor(y / this.tile_size);
+        const col = Math.floor(x / this.tile_size);
+        const offset_y = y - (row * this.tile_size);
+        const offset_x = x - (col * this.tile_size);
+        const offset = (offset_y * this.tile_size) + offset_x;
 
         const key = this.tile_key(row, col);
         if (!this.visible_tiles.has(key)) return UNKNOWN;
         const hovermap = this.visible_tiles.get(key)!.hovermap;
 
         assert(hovermap != null);
-        let item_id = hovermap!.getInt32(offset * 4, true /* little endian */);
+        let item_id = hovermap!.get(offset);
         return (item_id == -1) ? null : item_id;
     }
 
@@ -342,11 +343,11 @@ export class TileSet {
               tile.zoom_level == this.zoom_level))
             return false;
 
-        const top = tile.row * TILE_SIZE + this.y_offset;
-        const left = tile.col * TILE_SIZE + this.x_offset;
+        const top = tile.row * this.tile_size + this.y_offset;
+        const left = tile.col * this.tile_size + this.x_offset;
 
-        return (top > -TILE_SIZE) && (top < this.height) &&
-               (left > -TILE_SIZE) && (left < this.width);
+        return (top > -this.tile_size) && (top < this.height) &&
+               (left > -this.tile_size) && (left < this.width);
     }
 
     // Given screen coordinate (x, y), return the corresponding tile
@@ -355,8 +356,8 @@ export class TileSet {
         x = Math.round(x - this.x_offset);
         y = Math.round(y - this.y_offset);
 
-        const row = Math.floor(y / TILE_SIZE);
-        const col = Math.floor(x / TILE_SIZE);
+        const row = Math.floor(y / this.tile_size);
+        const col = Math.floor(x / this.tile_size);
         return [row, col];
     }
 
@@ -370,10 +371,11 @@ export class TileSet {
         }
 
         let retval: [number, number][] = []
-        const r0 = Math.floor(-this.y_offset / TILE_SIZE);
-        const c0 = Math.floor(-this.x_offset / TILE_SIZE);
-        const r1 = Math.ceil((this.height - this.y_offset) / TILE_SIZE) - 1;
-        const c1 = Math.ceil((this.width - this.x_offset) / TILE_SIZE) - 1;
+        const ts = this.tile_size;
+        const r0 = Math.floor(-this.y_offset / ts);
+        const c0 = Math.floor(-this.x_offset / ts);
+        const r1 = Math.ceil((this.height - this.y_offset) / ts) - 1;
+        const c1 = Math.ceil((this.width - this.x_offset) / ts) - 1;
         for (let row = r0; row <= r1; row++) {
             for (let col = c0; col <= c1; col++) {
                 retval.push([row, col]);
@@ -409,6 +411,9 @@ export class TileSet {
     private y1: number | null = null;
     zoom_level: number = 0;
 
+    // Size of each tile (in pixels): chosen by BE, see Plotter::set_tile_size.
+    tile_size: number = 256;
+
     // Panning offset, using screen coordinate.  E.g., if offset is (10, 3),
     // then the tiles are shifted 10 pixels to the right and 3 pixels down.
     x_offset: number = 0;